@@ -1,19 +1,23 @@
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
 #include <regex>
+#include <sstream>
 
+#include <jitsim/aot.hpp>
 #include <jitsim/jit_frontend.hpp>
 #include <jitsim/coreir.hpp>
 #include <coreir/ir/context.h>
 #include <coreir/libs/commonlib.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Path.h>
 
 using namespace std;
 
-JITSim::Circuit loadJSON(const string &str)
+CoreIR::Module * loadJSON(CoreIR::Context *ctx, const string &str)
 {
   using namespace CoreIR;
 
-  Context *ctx = newContext();
   CoreIRLoadLibrary_commonlib(ctx);
 
   Module* top;
@@ -26,39 +30,252 @@ JITSim::Circuit loadJSON(const string &str)
 
   ctx->runPasses({"rungenerators", "flattentypes"});
 
-  JITSim::Circuit circuit = JITSim::BuildFromCoreIR(top);
+  return top;
+}
+
+static void printCycleTime(const string &label, uint64_t cycles, chrono::steady_clock::time_point start)
+{
+  double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  cout << label << ": " << cycles << " cycles in " << ms << " ms, " << ms * 1e6 / cycles << " ns/cycle\n";
+}
+
+/* Times whole cycles with the inputs left as they are, so only designs
+ * that drive themselves from their registers are meaningful to bench.
+ * Stepping from the host is timed first, then the combined step function,
+ * then the same number of cycles in the JIT'd run loop, and finally a
+ * step of every lane with --lanes. */
+static void benchmark(JITSim::JITFrontend &jit, uint64_t cycles)
+{
+  auto start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < cycles; i++) {
+    jit.updateState();
+    jit.computeOutput();
+  }
+  printCycleTime("Stepped", cycles, start);
+
+  start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < cycles; i++) {
+    jit.step();
+  }
+  printCycleTime("Step function", cycles, start);
 
-  deleteContext(ctx);
+  start = chrono::steady_clock::now();
+  jit.run(cycles);
+  printCycleTime("Run loop", cycles, start);
+
+  /* Timed per lane, to compare with a single copy */
+  if (jit.getNumLanes() > 0) {
+    start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < cycles; i++) {
+      jit.stepLanes();
+    }
+    printCycleTime("Lanes", cycles * jit.getNumLanes(), start);
+  }
 
-  return circuit;
+  cout << "Final output: ";
+  jit.computeOutput().dump();
+  cout << "\n";
 }
 
 int main(int argc, char *argv[])
 {
   using namespace JITSim;
 
-  if (argc < 2) {
+  FrontendOptions options;
+  string json_file;
+  string profile_out;
+  string export_path;
+  string compile_stats_out;
+  vector<pair<string, unsigned>> opt_overrides;
+  vector<CPUVariant> export_variants;
+  bool compile_report = false;
+  uint64_t bench_cycles = 0;
+
+  regex cache_dir_flag(R"(--cache-dir=(.+))");
+  regex cache_size_flag(R"(--cache-size=(\d+))");
+  regex threads_flag(R"(--threads=(\d+))");
+  regex tier_threshold_flag(R"(--tier-threshold=(\d+))");
+  regex profile_generate_flag(R"(--profile-generate=(.+))");
+  regex profile_use_flag(R"(--profile-use=(.+))");
+  regex export_flag(R"(--export=(.+))");
+  regex opt_level_flag(R"(--opt-level=(\d))");
+  regex size_level_flag(R"(--size-level=(\d))");
+  regex opt_override_flag(R"(--opt-override=(.+):(\d))");
+  regex cpu_flag(R"(--cpu=(.+))");
+  regex finalize_flag(R"(--finalize-after=(\d+))");
+  regex recycle_flag(R"(--recycle-interval=(\d+))");
+  regex bundle_flag(R"(--bundle-size=(\d+))");
+  regex chunk_flag(R"(--chunk-size=(\d+))");
+  regex flatten_flag(R"(--flatten=(\d+))");
+  regex compile_stats_flag(R"(--compile-stats=(.+))");
+  regex export_variants_flag(R"(--export-variants=(.+))");
+  regex bench_flag(R"(--bench=(\d+))");
+  regex lanes_flag(R"(--lanes=(\d+))");
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    smatch match;
+    if (regex_match(arg, match, cache_dir_flag)) {
+      options.jit.cache_dir = match[1];
+    } else if (regex_match(arg, match, cache_size_flag)) {
+      /* Size is given in megabytes */
+      options.jit.cache_max_bytes = stoull(match[1]) << 20;
+    } else if (regex_match(arg, match, threads_flag)) {
+      options.compile_threads = stoul(match[1]);
+    } else if (arg == "--background-compile") {
+      options.background_compile = true;
+    } else if (arg == "--tiered") {
+      options.tiered = true;
+    } else if (regex_match(arg, match, tier_threshold_flag)) {
+      options.tier_up_threshold = stoull(match[1]);
+    } else if (regex_match(arg, match, profile_generate_flag)) {
+      options.profile_mode = ProfileMode::Instrument;
+      profile_out = match[1];
+    } else if (regex_match(arg, match, profile_use_flag)) {
+      options.profile_mode = ProfileMode::Use;
+      options.profile_file = match[1];
+    } else if (regex_match(arg, match, export_flag)) {
+      export_path = match[1];
+    } else if (regex_match(arg, match, opt_level_flag)) {
+      options.jit.optimization.opt_level = stoul(match[1]);
+    } else if (regex_match(arg, match, size_level_flag)) {
+      options.jit.optimization.size_level = stoul(match[1]);
+    } else if (arg == "--vectorize") {
+      options.jit.optimization.loop_vectorize = true;
+      options.jit.optimization.slp_vectorize = true;
+    } else if (arg == "--module-passes") {
+      options.jit.optimization.module_passes = true;
+    } else if (regex_match(arg, match, opt_override_flag)) {
+      /* Overrides start from the other optimization flags, so they are
+       * filled in once all the arguments have been read */
+      opt_overrides.emplace_back(match[1], stoul(match[2]));
+    } else if (regex_match(arg, match, finalize_flag)) {
+      options.finalize_after = stoull(match[1]);
+    } else if (arg == "--time-finalize") {
+      options.time_finalize = true;
+    } else if (regex_match(arg, match, recycle_flag)) {
+      options.context_recycle_interval = stoull(match[1]);
+    } else if (regex_match(arg, match, bundle_flag)) {
+      options.bundle_size = stoul(match[1]);
+    } else if (regex_match(arg, match, chunk_flag)) {
+      options.chunk_size = stoul(match[1]);
+    } else if (regex_match(arg, match, flatten_flag)) {
+      options.flatten_threshold = stoul(match[1]);
+    } else if (regex_match(arg, match, compile_stats_flag)) {
+      compile_stats_out = match[1];
+    } else if (arg == "--gdb") {
+      options.jit.gdb_listener = true;
+      options.debug_info = true;
+    } else if (arg == "--perf-map") {
+      options.jit.perf_map = true;
+      options.debug_info = true;
+    } else if (arg == "--code-layout") {
+      options.code_layout = true;
+    } else if (arg == "--huge-pages") {
+      options.huge_pages = true;
+    } else if (arg == "--compile-report") {
+      compile_report = true;
+    } else if (arg == "--no-wide-limbs") {
+      options.wide_limbs = false;
+    } else if (arg == "--no-promote-widths") {
+      options.promote_widths = false;
+    } else if (arg == "--shadow-state") {
+      options.shadow_state = true;
+    } else if (regex_match(arg, match, lanes_flag)) {
+      options.lanes = stoul(match[1]);
+    } else if (regex_match(arg, match, bench_flag)) {
+      bench_cycles = stoull(match[1]);
+    } else if (regex_match(arg, match, cpu_flag)) {
+      options.cpu = match[1];
+    } else if (regex_match(arg, match, export_variants_flag)) {
+      stringstream cpus(match[1]);
+      string cpu;
+      while (getline(cpus, cpu, ',')) {
+        CPUVariant variant;
+        if (!GetCPUVariant(cpu, variant)) {
+          cerr << "Unknown CPU variant " << cpu << "\n";
+          return 1;
+        }
+        export_variants.push_back(variant);
+      }
+    } else {
+      json_file = arg;
+    }
+  }
+
+  for (const auto &opt_override : opt_overrides) {
+    OptimizationOverride over;
+    over.pattern = opt_override.first;
+    over.options = options.jit.optimization;
+    over.options.opt_level = opt_override.second;
+    options.optimization_overrides.push_back(over);
+  }
+
+  if (json_file.empty()) {
     cerr << "Provide a json file to load\n";
     return 1;
   }
 
-  Circuit circuit = loadJSON(argv[1]);
+  CoreIR::Context *ctx = CoreIR::newContext();
+  Circuit circuit = BuildFromCoreIR(loadJSON(ctx, json_file));
+
+  /* Write out a shared library and header instead of simulating */
+  if (!export_path.empty()) {
+    CoreIR::deleteContext(ctx);
+
+    llvm::SmallString<128> header_path(export_path);
+    llvm::sys::path::replace_extension(header_path, "h");
+
+    AOTOptions aot_options;
+    aot_options.optimization = options.jit.optimization;
+    aot_options.cpu_variants = export_variants;
+
+    AOTCompiler compiler(circuit, aot_options);
+    if (!compiler.exportLibrary(export_path, header_path.str().str())) {
+      cerr << "Unable to export " << export_path << "\n";
+      return 1;
+    }
+
+    return 0;
+  }
+
+  /* With --background-compile this returns straight away, so tearing down
+   * CoreIR and printing the circuit overlap with compilation */
+  JITFrontend jit(circuit, options);
+
+  CoreIR::deleteContext(ctx);
   circuit.print();
 
-  JITFrontend jit(circuit);
-  jit.dumpIR();
+  /* Compiling everything up front is timed instead of dumping the IR */
+  if (compile_report || bench_cycles > 0) {
+    auto start = chrono::steady_clock::now();
+    jit.precompile();
+    auto end = chrono::steady_clock::now();
+
+    cout << "Compiled in " << chrono::duration<double, milli>(end - start).count() << " ms, "
+         << jit.getCodeBytes() / 1024 << " KB of code memory\n";
+  } else {
+    jit.dumpIR();
+  }
 
   LLVMStruct out = jit.computeOutput();
   cout << "Starting output: ";
   out.dump();
   cout << "\n";
 
+  /* The benchmark runs instead of the interactive session */
+  if (bench_cycles > 0) {
+    benchmark(jit, bench_cycles);
+  }
+
   int advance = 0;
   regex next(R"(next(?:\s+(\d+))?)");
   regex assign(R"(assign\s+(\w+)\s+(\d+))");
   regex print(R"(print\s+(?:(\w+).)+(\w+))");
+  regex show(R"(show((?:\s+\w+)+))");
+  regex run(R"(run\s+(\d+))");
+  regex step(R"(^\s*step\s*$)");
 
-  while (true) {
+  while (bench_cycles == 0) {
     if (advance == 0) {
       string input;
       getline(cin, input);
@@ -79,8 +296,34 @@ int main(int argc, char *argv[])
         strRef.getAsInteger(10, val);
         jit.setInput(in_name, val);
 
-        out = jit.computeOutput();
+        /* Only the logic downstream of the input is recomputed */
+        out = jit.computeChangedOutput();
+        out.dump();
+      } else if (regex_search(input, match, step)) {
+        /* Prints this cycle's output, then advances */
+        out = jit.step();
+        out.dump();
+      } else if (regex_search(input, match, run)) {
+        /* Free running, so only the final output is printed */
+        out = jit.run(stoull(match[1]));
         out.dump();
+      } else if (regex_search(input, match, show)) {
+        /* Only computes the cones of the named outputs */
+        stringstream names_stream(match[1]);
+        vector<string> names;
+        string port;
+        while (names_stream >> port) {
+          names.push_back(port);
+        }
+
+        const LLVMStruct &shown = jit.computeOutputs(names);
+        for (const string &name : names) {
+          if (shown.hasMember(name)) {
+            cout << name << ": " << shown.getValue(name).toString(10, false) << endl;
+          } else {
+            cout << "No output named " << name << endl;
+          }
+        }
       } else if (regex_search(input, match, print)) {
         vector<string> instances;
         for (unsigned i = 1; i < match.size() - 1; i++) {
@@ -94,7 +337,7 @@ int main(int argc, char *argv[])
 
     } else { 
       jit.updateState();
-      out = jit.computeOutput();
+      out = jit.computeChangedOutput();
       out.dump();
 
       advance--;
@@ -102,6 +345,24 @@ int main(int argc, char *argv[])
 
   }
 
+  if (!profile_out.empty() && !jit.writeProfile(profile_out)) {
+    cerr << "Unable to write profile " << profile_out << "\n";
+  }
+
+  if (!compile_stats_out.empty() && !jit.writeCompileStats(compile_stats_out)) {
+    cerr << "Unable to write compile stats " << compile_stats_out << "\n";
+  }
+
+  if (jit.isFinalized() && options.time_finalize && options.profile_mode != ProfileMode::Instrument) {
+    const FinalizeStats &stats = jit.getFinalizeStats();
+    cout << "compute_output before finalize: " << stats.ns_before << " ns/call, after: "
+         << stats.ns_after << " ns/call\n";
+  }
+
+  if (options.huge_pages) {
+    cout << "Huge pages in use: " << GetHugePageBytes() / HUGE_PAGE_SIZE << "\n";
+  }
+
   cout << "End State: ";
   for (const uint8_t & x : jit.getState()) {
     cout << (int)x;
@@ -3,6 +3,7 @@
 
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
 #include <llvm/ExecutionEngine/JITSymbol.h>
 #include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
 #include <llvm/ExecutionEngine/RuntimeDyld.h>
@@ -23,6 +24,11 @@
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Scalar/GVN.h>
+#include <jitsim/compile_stats.hpp>
+#include <jitsim/layout.hpp>
+#include <jitsim/memory.hpp>
+#include <jitsim/object_cache.hpp>
+#include <jitsim/optimize.hpp>
 #include <algorithm>
 #include <memory>
 #include <unordered_set>
@@ -33,53 +39,174 @@
 
 namespace JITSim {
 
+struct JITOptions {
+  /* Directory for the persistent object cache, the cache is disabled if empty */
+  std::string cache_dir;
+  uint64_t cache_max_bytes = 1ull << 30;
+  /* Used for every module without its own options set with setOptimizationOptions */
+  OptimizationOptions optimization;
+  /* Code memory from removed modules kept for reuse before being unmapped */
+  uint64_t pool_max_bytes = 64ull << 20;
+  /* Register compiled objects with GDB's JIT interface */
+  bool gdb_listener = false;
+  /* Append the address, size and name of each compiled function to
+   * /tmp/perf-<pid>.map, where perf looks for symbols of JIT'd code */
+  bool perf_map = false;
+  /* Place code on 2MB pages, falling back to transparent huge pages or
+   * normal pages. Code stays writable, since a huge page can't be split
+   * between code and data permissions. */
+  bool huge_pages = false;
+};
+
+/* Links modules from the same context into one module called name, returns
+ * nullptr if they can't be linked */
+std::shared_ptr<llvm::Module> LinkModules(const std::string &name,
+                                          const std::vector<std::shared_ptr<llvm::Module>> &modules);
+
+/* SimpleCompiler that also records the codegen time and code size of each
+ * module it compiles */
+class TimedCompiler {
+private:
+  llvm::orc::SimpleCompiler compiler;
+  CompileStats &stats;
+
+public:
+  TimedCompiler(llvm::TargetMachine &target_machine, llvm::ObjectCache *object_cache,
+                CompileStats &stats);
+
+  llvm::orc::SimpleCompiler::CompileResult operator()(llvm::Module &module);
+};
+
 class JIT {
+public:
+  using ModuleGenerator = std::function<std::shared_ptr<llvm::Module>()>;
+
 private:
   const llvm::DataLayout data_layout;
+  llvm::TargetMachine &target_machine;
+  const std::string target_triple;
+  /* Objects are only reused on machines with the same CPU and features */
+  const std::string target_cpu;
+  OptimizationOptions default_optimization;
+  std::unordered_map<std::string, OptimizationOptions> module_optimizations;
+  CodeLayout code_layout;
+  std::unique_ptr<DiskObjectCache> object_cache;
+  std::shared_ptr<MemoryPool> memory_pool;
+  CompileStats compile_stats;
   std::unique_ptr<llvm::orc::JITCompileCallbackManager> compile_callback_manager;
   std::unique_ptr<llvm::orc::IndirectStubsManager> indirect_stubs_manager;
+  std::vector<llvm::JITEventListener *> event_listeners;
+  std::unique_ptr<llvm::raw_fd_ostream> perf_map;
   using TransformFunction =
       std::function<std::shared_ptr<llvm::Module>(std::shared_ptr<llvm::Module>)>;
 
   /* All the layers used by the JIT. These operate bottom up
    * (so the debug layer is run on top of all the other layers) */
   llvm::orc::RTDyldObjectLinkingLayer object_layer;
-  llvm::orc::IRCompileLayer<decltype(object_layer), llvm::orc::SimpleCompiler> compile_layer;
+  llvm::orc::IRCompileLayer<decltype(object_layer), TimedCompiler> compile_layer;
   llvm::orc::IRTransformLayer<decltype(compile_layer), TransformFunction> optimize_layer;
   llvm::orc::IRTransformLayer<decltype(optimize_layer), TransformFunction> debug_layer;
 
   std::shared_ptr<llvm::Module> optimizeModule(std::shared_ptr<llvm::Module> module);
   std::shared_ptr<llvm::Module> debugModule(std::shared_ptr<llvm::Module> module);
   std::string mangle(const std::string name);
+  std::shared_ptr<llvm::JITSymbolResolver> makeResolver();
+  std::string getObjectKey(const std::string &name, const std::string &cache_key,
+                           const OptimizationOptions &optimization) const;
 
   using ModuleHandle = decltype(debug_layer)::ModuleHandleT;
 
+  /* Objects reported to the event listeners, so they can be told when the
+   * object is freed */
+  std::vector<std::pair<ModuleHandle, llvm::orc::RTDyldObjectLinkingLayer::ObjectPtr>> notified_objects;
+  void notifyObjectLoaded(ModuleHandle handle, const llvm::orc::RTDyldObjectLinkingLayer::ObjectPtr &obj,
+                          const llvm::RuntimeDyld::LoadedObjectInfo &info);
+  void writePerfMap(const llvm::object::ObjectFile &obj, const llvm::RuntimeDyld::LoadedObjectInfo &info);
+
   std::unordered_map<std::string, std::deque<TransformFunction>> debug_functions;
   std::unordered_map<std::string, ModuleHandle> live_modules;
   std::unordered_set<llvm::JITTargetAddress> callback_addrs;
+  std::unordered_map<std::string, llvm::JITTargetAddress> pending_callbacks;
+  /* Functions added with addLazyBundle share a unit, other functions are
+   * their own unit. Generators are kept per unit for finalize. */
+  std::unordered_map<std::string, std::string> module_units;
+  std::unordered_map<std::string, ModuleGenerator> module_generators;
 
   void removeModule(ModuleHandle handle);
+  void removeUnusedModules(const std::vector<ModuleHandle> &handles);
+  bool addObject(const std::vector<std::string> &names, std::unique_ptr<llvm::MemoryBuffer> buffer);
+  void addLazyUnit(const std::string &unit_name, const std::vector<std::string> &names,
+                   ModuleGenerator module_generator, const std::string &cache_key);
+  void releasePendingCallback(const std::string &name);
   llvm::JITTargetAddress updateStub(const std::string &name);
 
   bool debug_print_ir;
 
 public:
 
-  JIT(llvm::TargetMachine &target_machine, const llvm::DataLayout &data_layout);
+  JIT(llvm::TargetMachine &target_machine, const llvm::DataLayout &data_layout,
+      const JITOptions &options = JITOptions());
 
   llvm::JITSymbol findSymbol(const std::string name);
 
   llvm::JITTargetAddress getSymbolAddress(const std::string name);
+  /* Address of the compiled body of name rather than its stub, 0 if it
+   * hasn't been compiled */
+  llvm::JITTargetAddress getFunctionAddress(const std::string &name);
+
+  /* Options for the module named name, which is also the name of the
+   * function passed to addLazyFunction */
+  const OptimizationOptions & getOptimizationOptions(const std::string &name) const;
+  void setOptimizationOptions(const std::string &name, const OptimizationOptions &optimization);
+
+  /* Applied to every module after optimization. Only affects modules
+   * compiled afterwards, and must not be changed while compileObject is
+   * running on other threads. */
+  void setCodeLayout(const CodeLayout &layout) { code_layout = layout; }
+  const CodeLayout & getCodeLayout() const { return code_layout; }
 
   ModuleHandle addModule(std::shared_ptr<llvm::Module> module);
+  /* If cache_key is provided, the compiled object for name is stored in the
+   * object cache and later calls with the same key skip generating the module */
   void addLazyFunction(const std::string &name,
-                       std::function<std::shared_ptr<llvm::Module>()> module_generator);
+                       std::function<std::shared_ptr<llvm::Module>()> module_generator,
+                       const std::string &cache_key = "");
+  /* Adds a stub for each of names, and compiles the modules from all of
+   * module_generators linked into one module named bundle_name the first
+   * time any of them is called. Calls between functions in the bundle are
+   * direct. Options set for bundle_name are used to optimize it. */
+  void addLazyBundle(const std::string &bundle_name, const std::vector<std::string> &names,
+                     const std::vector<ModuleGenerator> &module_generators,
+                     const std::string &cache_key = "");
+
+  /* Generates, optimizes and compiles a module without touching any JIT
+   * state other than the object cache, so it can run on worker threads.
+   * target_machine and the module's context must be owned by the caller's thread. */
+  std::unique_ptr<llvm::MemoryBuffer> compileObject(const std::string &name,
+                                                    const OptimizationOptions &optimization,
+                                                    llvm::TargetMachine &target_machine,
+                                                    std::function<std::shared_ptr<llvm::Module>()> module_generator,
+                                                    const std::string &cache_key = "");
+  /* Links an object produced by compileObject and points the stub for name
+   * at it, replacing any pending lazy compile */
+  void addCompiledFunction(const std::string &name, std::unique_ptr<llvm::MemoryBuffer> buffer);
+  /* Same for an object defining all of names, such as a compiled bundle */
+  void addCompiledBundle(const std::vector<std::string> &names, std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+  /* Regenerates the modules for names and links them into one object, so
+   * the calls between them are direct instead of going through stubs. The
+   * stubs are pointed at the linked object for any remaining callers. */
+  bool finalize(const std::vector<std::string> &names);
+
   std::deque<TransformFunction>::iterator addDebugTransform(const std::string &name,
                                                             TransformFunction debug_transform);
 
   void removeDebugTransform(const std::string &name, std::deque<TransformFunction>::iterator iter);
   bool removeModule(const std::string &name);
 
+  const MemoryPool & getMemoryPool() const { return *memory_pool; }
+  const CompileStats & getCompileStats() const { return compile_stats; }
+
   void precompileIR();
   void precompileDumpIR();
 };
@@ -0,0 +1,71 @@
+#ifndef JITSIM_AOT_HPP_INCLUDED
+#define JITSIM_AOT_HPP_INCLUDED
+
+#include <jitsim/builder.hpp>
+#include <jitsim/circuit.hpp>
+#include <jitsim/optimize.hpp>
+
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace JITSim {
+
+/* An extra copy of the design compiled for the features in required (named
+ * as for __builtin_cpu_supports), picked when the library is loaded on a
+ * machine supporting all of them. cpu names the variant. */
+struct CPUVariant {
+  std::string cpu;
+  std::vector<std::string> required;
+};
+
+/* Looks up one of the x86 variants jitsim knows the feature checks for,
+ * such as "haswell" or "skylake-avx512" */
+bool GetCPUVariant(const std::string &name, CPUVariant &variant);
+
+struct AOTOptions {
+  /* Module passes always run, since they inline the design into the wrappers */
+  OptimizationOptions optimization;
+  /* Variants for newer CPUs, checked in order so the best should come
+   * first. A generic version is always included as the fallback. */
+  std::vector<CPUVariant> cpu_variants;
+  /* Compiler driver used to link the object into a shared library */
+  std::string linker = "cc";
+};
+
+/* Compiles every definition of a circuit ahead of time into a single shared
+ * library exporting compute_output and update_state (with the same signatures
+ * as the JITFrontend wrappers), and writes a C header describing the port
+ * structs and state size. The library doesn't depend on LLVM or CoreIR, and
+ * can be loaded with AOTDesign from runtime/aot_runtime.hpp. */
+class AOTCompiler {
+private:
+  std::unique_ptr<llvm::TargetMachine> target_machine;
+  const llvm::DataLayout data_layout;
+  Builder builder;
+  const Circuit &circuit;
+  const Definition &top;
+  AOTOptions options;
+
+  std::unique_ptr<llvm::Module> linkDesign();
+  void addMetadata(llvm::Module &module);
+  void optimize(llvm::Module &module, llvm::TargetMachine &machine);
+  bool emitObject(llvm::Module &module, llvm::TargetMachine &machine, const std::string &obj_path);
+  bool compileObject(llvm::Module &module, llvm::TargetMachine &machine, std::vector<std::string> &inputs);
+  bool writeDispatcher(std::vector<std::string> &inputs);
+  bool linkLibrary(const std::vector<std::string> &inputs, const std::string &lib_path);
+  std::string makeHeader();
+
+public:
+  AOTCompiler(const Circuit &circuit, const AOTOptions &options = AOTOptions());
+
+  bool exportLibrary(const std::string &lib_path, const std::string &header_path);
+};
+
+}
+
+#endif
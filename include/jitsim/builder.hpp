@@ -12,6 +12,8 @@
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetMachine.h>
 
+#include <jitsim/profile.hpp>
+
 #include <iostream>
 #include <unordered_map>
 #include <memory>
@@ -22,23 +24,78 @@ class Source;
 class Sink;
 class FunctionEnvironment;
 
+/* Which way a branch is expected to go when there is no profile for it */
+enum class BranchHint {
+  None,
+  Likely,  /* Almost always true */
+  Unlikely /* Almost always false */
+};
+
+struct CodegenOptions {
+  ProfileMode profile_mode = ProfileMode::None;
+  /* Counters are stored here when instrumenting and read from here when
+   * annotating, must be set unless profile_mode is None */
+  ProfileData *profile = nullptr;
+  /* Describe each function as a listing of its definition's instances (see
+   * WriteDebugListing) with a line per instance, so debuggers and profilers
+   * can attribute code to instances even after inlining */
+  bool debug_info = false;
+  std::string debug_dir = "/tmp/jitsim";
+  /* Split compute_output and update_state of definitions with more than
+   * this many instances into chunk functions, 0 never splits them */
+  unsigned chunk_size = 0;
+  /* Emit instances of definitions with at most this many primitives in
+   * their whole subtree inline instead of calling their functions, 0
+   * never flattens */
+  unsigned flatten_threshold = 0;
+  /* Gather scattered bits of a bus with pext/pdep. Builder turns this off
+   * for targets without BMI2. */
+  bool use_bmi2 = true;
+  /* Emit add, sub, mul, shifts, logic and compares on values wider than 64
+   * bits as operations on 64 bit limbs with explicit carries, instead of
+   * leaving wide iN types to LLVM's generic legalization */
+  bool wide_limbs = true;
+  /* Compute arithmetic on odd widths like i17 at the next native width,
+   * only masking where the upper bits can change the result */
+  bool promote_widths = true;
+  /* Registers write their next state to a shadow copy of the state, the
+   * second half of the buffer passed to the top's update_state, which is
+   * then committed with a copy of each contiguous run of registers.
+   * Definitions' update_state functions take the shadow pointer after the
+   * state pointer. */
+  bool shadow_state = false;
+};
+
 class ModuleEnvironment {
 private:
   std::shared_ptr<llvm::Module> module;
   llvm::LLVMContext *context;
+  const CodegenOptions *options;
+  unsigned lanes;
   std::unique_ptr<llvm::DIBuilder> di_builder;
+  llvm::DICompileUnit *di_unit;
 
   std::unordered_map<std::string, llvm::Function *> named_functions;
 
   std::unordered_map<const Source *, llvm::Value *> src_value_lookup; 
   std::unordered_map<const Sink *, llvm::Value *> sink_value_lookup; 
 public:
-  ModuleEnvironment(std::unique_ptr<llvm::Module> &&module_, llvm::LLVMContext *context_)
-    : module(move(module_)), context(context_), di_builder(std::make_unique<llvm::DIBuilder>(*module))
-  {}
+  ModuleEnvironment(std::unique_ptr<llvm::Module> &&module_, llvm::LLVMContext *context_,
+                    const CodegenOptions *options_, unsigned lanes_ = 1);
 
   llvm::LLVMContext & getContext() { return *context; }
+  const CodegenOptions & getCodegenOptions() const { return *options; }
+  /* Number of copies of the design simulated at once by this module's
+   * functions. With more than 1, every signal is a vector with an element
+   * per lane, and the state holds each instance's state for every lane. */
+  unsigned getLanes() const { return lanes; }
+  /* iN for a width bit signal, or a vector of them when simulating lanes */
+  llvm::Type * getValueType(unsigned width);
+  /* val as a signal, splatted to every lane */
+  llvm::Constant * getConstant(const llvm::APInt &val);
   llvm::DIBuilder & getDIBuilder() { return *di_builder; }
+  /* nullptr unless debug info is enabled */
+  llvm::DICompileUnit * getDebugUnit() { return di_unit; }
 
   llvm::Function * getFunctionDecl(const std::string &name);
   llvm::Function * makeFunctionDecl(const std::string &name, llvm::FunctionType *function_type);
@@ -65,6 +122,15 @@ private:
   llvm::IRBuilder<> ir_builder;
   llvm::BasicBlock *cur_bb;
 
+  /* Profiled branches are numbered in the order they are generated */
+  unsigned next_profile_site;
+
+  llvm::DISubprogram *di_subprogram;
+
+  llvm::Value * getCounterAddr(uint64_t *counter);
+  void profileEntry(llvm::BasicBlock *entry);
+  llvm::MDNode * profileSite(llvm::Value *cond);
+
 public:
   FunctionEnvironment(llvm::Function *func_, ModuleEnvironment *parent_);
 
@@ -80,6 +146,21 @@ public:
     cur_bb = bb;
     ir_builder.SetInsertPoint(cur_bb);
   }
+  /* CreateCondBr and CreateSelect that count which way cond goes when
+   * instrumenting, or carry the recorded branch weights when using a profile.
+   * Branches without recorded weights are weighted by hint, so the cold
+   * side is placed after the rest of the function. */
+  llvm::BranchInst * createCondBr(llvm::Value *cond, llvm::BasicBlock *true_bb, llvm::BasicBlock *false_bb,
+                                  BranchHint hint = BranchHint::None);
+  llvm::Value * createSelect(llvm::Value *cond, llvm::Value *true_val, llvm::Value *false_val,
+                             const llvm::Twine &name = "");
+
+  /* Describes the function as line 1 of the listing source_name, and gives
+   * following instructions that line until setDebugLine. Does nothing
+   * unless debug info is enabled. */
+  void attachDebugInfo(const std::string &source_name);
+  void setDebugLine(unsigned line);
+
   void addDebugValue(llvm::Value *val, llvm::DILocalVariable *var_info,
                      llvm::DIExpression *expr, const llvm::DILocation *loc)
   { getDIBuilder().insertDbgValueIntrinsic(val, 0, var_info, expr, loc, cur_bb); }
@@ -98,15 +179,23 @@ class Builder {
     llvm::LLVMContext context;
     llvm::DataLayout data_layout;
     std::string triple;
+    bool has_bmi2;
+    unsigned lane_width;
+    CodegenOptions options;
   public:
 
-    Builder(const llvm::DataLayout &dl, const llvm::TargetMachine &target_machine) 
-      : data_layout(dl), triple(target_machine.getTargetTriple().getTriple())
-    {}
+    Builder(const llvm::DataLayout &dl, const llvm::TargetMachine &target_machine,
+            const CodegenOptions &options_ = CodegenOptions());
 
-    ModuleEnvironment makeModule(const std::string &name);
+    ModuleEnvironment makeModule(const std::string &name, unsigned lanes = 1);
 
     llvm::LLVMContext & getContext() { return context; }
+    /* Lanes simulated together when batching, enough 32 bit lanes to fill
+     * the target's widest vector registers */
+    unsigned getLaneWidth() const { return lane_width; }
+    const CodegenOptions & getCodegenOptions() const { return options; }
+    /* Only affects modules generated afterwards */
+    void setCodegenOptions(const CodegenOptions &options_);
 };
 
 } // end namespace JITSim
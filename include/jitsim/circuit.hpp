@@ -226,6 +226,10 @@ private:
   std::unordered_map<std::string, const Instance *> instance_lookup;
 
   SimInfo siminfo;
+
+  std::string structural_hash;
+
+  void calculateStructuralHash();
 public:
   Definition(const std::string &name,
              IFace &&interface,
@@ -244,6 +248,12 @@ public:
   const std::string & getSafeName() const { return safe_name; }
   const SimInfo & getSimInfo() const { return siminfo; }
   const Instance & getInstance(const std::string &name) const;
+  const std::vector<Instance> & getInstances() const { return instances; }
+
+  /* Hash of the interface, instances, wiring and primitive arguments of this
+   * definition and everything it instantiates. Two definitions with the same
+   * hash generate identical code. */
+  const std::string & getStructuralHash() const { return structural_hash; }
 
   void print(const std::string &prefix = "") const;
 };
@@ -6,6 +6,10 @@
 
 #include <llvm/IR/Module.h>
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 namespace JITSim {
 
 ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definition);
@@ -15,6 +19,103 @@ ModuleEnvironment MakeStateDeps(Builder &builder, const Definition &definition);
 ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &defn);
 ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &defn);
 ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn);
+/* One cycle of compute_output followed by update_state, sharing the logic
+ * they have in common */
+ModuleEnvironment MakeStepWrapper(Builder &builder, const Definition &defn);
+/* Runs the given number of cycles of update_state, then compute_output */
+ModuleEnvironment MakeRunWrapper(Builder &builder, const Definition &defn);
+
+/* Where each port of the top is in the input and output buffers of
+ * batch_step. Lanes are simulated Builder::getLaneWidth at a time, and
+ * each group of that many lanes has its own block of the buffer. In a
+ * block the ports follow each other, each an array with the port's value
+ * for every lane of the group, getNumBytes(width) bytes apart. */
+class LaneLayout {
+private:
+  std::vector<uint64_t> offsets;
+  std::vector<unsigned> widths;
+  std::unordered_map<std::string, unsigned> port_indices;
+  unsigned lane_width;
+  uint64_t group_bytes;
+
+  void addPort(const std::string &name, unsigned width);
+  void finish();
+
+public:
+  template <typename T>
+  LaneLayout(const std::vector<T> &ports, unsigned lane_width_)
+    : offsets(), widths(), port_indices(), lane_width(lane_width_), group_bytes(0)
+  {
+    for (const T &port : ports) {
+      addPort(port.getName(), port.getWidth());
+    }
+    finish();
+  }
+
+  bool hasPort(const std::string &name) const { return port_indices.count(name); }
+  unsigned getIndex(const std::string &name) const { return port_indices.find(name)->second; }
+  unsigned getWidth(unsigned idx) const { return widths[idx]; }
+  /* Offset of the port's array in every group's block */
+  uint64_t getOffset(unsigned idx) const { return offsets[idx]; }
+  /* Offset of the port's value for lane in the whole buffer */
+  uint64_t getLaneOffset(unsigned idx, unsigned lane) const;
+  uint64_t getGroupBytes() const { return group_bytes; }
+};
+
+/* Bytes of state for each group of lanes in the state buffer of
+ * batch_step. Each instance's state is laid out as in the single lane
+ * state, with every size multiplied by the lane width, so a register's
+ * lanes are next to each other. A memory keeps the lanes of each word
+ * next to each other, each word being as wide as a memory element. */
+uint64_t GetLaneGroupStateBytes(const Definition &defn, unsigned lane_width, bool shadow_state);
+
+/* Steps many independent copies of the design, the same as step for each
+ * one, with inputs, outputs and state laid out in groups of lanes (see
+ * LaneLayout and GetLaneGroupStateBytes). Each group is simulated at once
+ * with vector instructions, one lane of every vector for each copy, with
+ * the whole design emitted inline. Takes the input, output and state
+ * buffers and the number of groups. */
+ModuleEnvironment MakeBatchStepWrapper(Builder &builder, const Definition &defn);
+
+/* Versions of the compute_output wrapper that only run the instances in
+ * the cones of some ports (see SimInfo::getDemandingSinks and
+ * SimInfo::getInputDeps), leaving the other outputs as they were.
+ * compute_output_demand takes a mask of the sinks to compute.
+ * compute_output_changed takes a mask of the inputs changed since its
+ * last call, with SimInfo::getStateBit set after update_state and the bit
+ * after that set on the first call, and a cache of GetChangeCacheBytes
+ * bytes it keeps the values of the instances in between calls. */
+ModuleEnvironment MakeComputeOutputDemandWrapper(Builder &builder, const Definition &defn);
+ModuleEnvironment MakeComputeOutputChangedWrapper(Builder &builder, const Definition &defn);
+unsigned GetNumMaskWords(const Definition &defn, bool changed);
+uint64_t GetChangeCacheBytes(const Definition &defn);
+
+/* True if instances of definition are emitted inline by its callers (and
+ * the wrappers, for the top definition), so its own compute_output and
+ * update_state are never called */
+bool ShouldFlatten(const Definition &definition, unsigned flatten_threshold);
+
+/* When CodegenOptions::chunk_size is set, compute_output and update_state
+ * of definitions with more instances than that are split into chunk
+ * functions of at most chunk_size instances each. The chunks are separate
+ * modules, so they can be compiled in parallel, and the definition's
+ * function just calls them in order. Returns 0 if the function isn't
+ * split. */
+unsigned GetNumChunks(const Definition &definition, bool update_state, unsigned chunk_size);
+std::string GetChunkName(const Definition &definition, bool update_state, unsigned idx);
+ModuleEnvironment MakeChunk(Builder &builder, const Definition &definition, bool update_state, unsigned idx);
+
+/* Key of the object cache entry for a definition's functions generated
+ * with options, covering every option that changes the code. Empty when
+ * the code can't be reused by another run: profiled code, and code
+ * counting calls for tier up (counted), point at this run's counters. */
+std::string GetCacheKey(const Definition &definition, const CodegenOptions &options, bool code_layout,
+                        bool counted);
+
+/* The debug info for a definition's functions refers to lines of this file,
+ * one per instance, written by WriteDebugListing */
+std::string GetDebugListingName(const Definition &definition);
+bool WriteDebugListing(const Definition &definition, const std::string &dir);
 
 }
 
@@ -0,0 +1,57 @@
+#ifndef JITSIM_COMPILE_STATS_HPP_INCLUDED
+#define JITSIM_COMPILE_STATS_HPP_INCLUDED
+
+#include <llvm/IR/Module.h>
+#include <llvm/Object/ObjectFile.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace JITSim {
+
+/* Totals over every time a module was compiled, so modules recompiled for
+ * debug queries or tier up show their whole cost */
+struct ModuleStats {
+  unsigned num_compiles = 0;
+  unsigned num_cache_hits = 0;
+  double generate_ms = 0;
+  double optimize_ms = 0;
+  double codegen_ms = 0;
+  /* From the most recent compile, after optimization */
+  uint64_t num_instructions = 0;
+  uint64_t code_bytes = 0;
+};
+
+/* Compile cost of each module, keyed by module name. Modules are named
+ * after the function they define (or the bundle), so this can be traced
+ * back to definitions. Updated from compile worker threads. */
+class CompileStats {
+private:
+  std::map<std::string, ModuleStats> modules;
+  mutable std::mutex stats_lock;
+
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static double getElapsedMS(Clock::time_point start);
+  static uint64_t countInstructions(const llvm::Module &module);
+  /* Size of the executable sections */
+  static uint64_t getCodeBytes(const llvm::object::ObjectFile &obj);
+
+  void recordGenerate(const std::string &name, double ms);
+  void recordCacheHit(const std::string &name, uint64_t code_bytes);
+  void recordOptimize(const std::string &name, double ms, uint64_t num_instructions);
+  void recordCodegen(const std::string &name, double ms, uint64_t code_bytes);
+
+  std::map<std::string, ModuleStats> getModuleStats() const;
+
+  /* Modules are listed from most to least total compile time */
+  bool writeJSON(const std::string &path) const;
+};
+
+}
+
+#endif
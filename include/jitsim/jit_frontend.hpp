@@ -5,13 +5,105 @@
 #include <jitsim/builder.hpp>
 #include <jitsim/circuit.hpp>
 #include <jitsim/circuit_llvm.hpp>
+#include <jitsim/memory.hpp>
+#include <jitsim/optimize.hpp>
+#include <jitsim/profile.hpp>
+#include <jitsim/target.hpp>
+#include <jitsim/tiered.hpp>
+
+#include <thread>
+#include <vector>
 
 namespace JITSim {
 
+struct FrontendOptions {
+  JITOptions jit;
+  /* CPU to generate code for, "host" detects the CPU and features of the
+   * machine we are running on */
+  std::string cpu = "host";
+  /* Number of worker threads used to compile every definition up front.
+   * 0 compiles each definition lazily on its first call instead. */
+  unsigned compile_threads = 0;
+  /* Run the up front compile on a background thread so the constructor
+   * returns immediately. Calls into the frontend wait for it to finish. */
+  bool background_compile = false;
+  /* Compile everything at O0 with fast-isel first, then recompile
+   * definitions called more than tier_up_threshold times at O3 */
+  bool tiered = false;
+  uint64_t tier_up_threshold = 100000;
+  /* Instrument branches and function entries, or annotate them with the
+   * counts in profile_file */
+  ProfileMode profile_mode = ProfileMode::None;
+  std::string profile_file;
+  /* Optimization options for definitions matching each pattern, the first
+   * match wins. Other definitions use jit.optimization. When tiered these
+   * replace the O3 pipeline used to recompile hot definitions. */
+  std::vector<OptimizationOverride> optimization_overrides;
+  /* Finalize the JIT after this many cycles, 0 never finalizes automatically */
+  uint64_t finalize_after = 0;
+  /* Time compute_output before and after finalizing (see
+   * JITFrontend::getFinalizeStats), at the cost of a couple of thousand
+   * extra calls. Never done when instrumenting, since the calls would be
+   * counted in the profile. */
+  bool time_finalize = false;
+  /* Throw away the LLVMContext and the IR kept for debugging after this
+   * many getValue calls, since every query leaves constants and metadata
+   * behind in the context. 0 never recycles it. */
+  uint64_t context_recycle_interval = 10000;
+  /* Compile update_state and compute_output for up to this many definitions
+   * as one module, grouping definitions from the same subtree of the
+   * hierarchy. 0 or 1 gives every definition its own modules. Ignored when
+   * tiered, since tier up replaces functions through their stubs. */
+  unsigned bundle_size = 0;
+  /* Generate debug info describing each definition's instances, with
+   * listings written to debug_dir. Useful with jit.gdb_listener and
+   * jit.perf_map. */
+  bool debug_info = false;
+  std::string debug_dir = "/tmp/jitsim";
+  /* Put the simulation state and JIT'd code on huge pages, so large
+   * designs don't thrash the TLB */
+  bool huge_pages = false;
+  /* Place functions in call order (or by profile counts when using a
+   * profile) and move cold code away from the simulation functions */
+  bool code_layout = false;
+  /* Split the simulation functions of definitions with more than this
+   * many instances into chunks that are compiled separately (and in
+   * parallel with compile_threads), 0 never splits them */
+  unsigned chunk_size = 0;
+  /* Flatten the subtrees of the hierarchy with at most this many
+   * primitives into their callers, so small leaf definitions don't cost a
+   * call through a stub each. 0 keeps a function per definition. */
+  unsigned flatten_threshold = 0;
+  /* Lower arithmetic on signals wider than 64 bits onto 64 bit limbs (see
+   * CodegenOptions::wide_limbs) */
+  bool wide_limbs = true;
+  /* Compute odd width signals at the next native width (see
+   * CodegenOptions::promote_widths) */
+  bool promote_widths = true;
+  /* Commit register updates through a shadow copy of the state (see
+   * CodegenOptions::shadow_state). The state buffer is twice as long,
+   * only the first half is the design's state. */
+  bool shadow_state = false;
+  /* Independent copies of the design simulated by stepLanes, each with
+   * its own inputs, outputs and state, as vector lanes (see
+   * MakeBatchStepWrapper). 0 doesn't allocate any. */
+  unsigned lanes = 0;
+};
+
+using StateBuffer = std::vector<uint8_t, HugePageAllocator<uint8_t>>;
+
+/* Average time per compute_output call measured around JITFrontend::finalize */
+struct FinalizeStats {
+  double ns_before = 0;
+  double ns_after = 0;
+};
+
+/* Only keeps the layout of the struct, not its LLVM type, so it stays valid
+ * after the context it was built in is destroyed */
 class LLVMStruct {
 private:
-  llvm::StructType *type;
-  const llvm::StructLayout *layout;
+  std::vector<uint64_t> offsets;
+  std::vector<int> widths;
   std::unordered_map<std::string, int> member_indices;
   std::vector<uint8_t> data;
 
@@ -26,6 +118,7 @@ public:
 
   void setMember(const std::string &name, llvm::APInt val);
 
+  bool hasMember(const std::string &name) const { return member_indices.count(name); }
   llvm::APInt getValue(int idx) const;
   llvm::APInt getValue(const std::string &name) const;
 
@@ -36,10 +129,12 @@ public:
 
 class JITFrontend {
 private:
+  const CPUTarget cpu_target;
   std::unique_ptr<llvm::TargetMachine> target_machine;
   const llvm::DataLayout data_layout;
 
-  Builder builder;
+  ProfileData profile;
+  std::unique_ptr<Builder> builder;
   JIT jit;
   std::unordered_map<std::string, ModuleEnvironment> debug_modules;
   std::unordered_map<std::string, llvm::ValueToValueMapTy> debug_clone_map;
@@ -49,36 +144,148 @@ private:
   LLVMStruct us_in;
   LLVMStruct gv_in;
 
-  std::vector<uint8_t> state;
+  StateBuffer state;
+
+  /* Masks of sinks for computeOutputs and of the inputs changed since the
+   * last computeChangedOutput, and the values it keeps between calls */
+  std::vector<uint64_t> demand_mask;
+  std::vector<uint64_t> changed_mask;
+  std::vector<uint64_t> change_cache;
+
+  /* Buffers of stepLanes, laid out in groups of Builder::getLaneWidth lanes */
+  const LaneLayout lane_in_layout;
+  const LaneLayout lane_out_layout;
+  unsigned num_lanes;
+  uint64_t num_lane_groups;
+  std::vector<uint8_t> lane_in;
+  std::vector<uint8_t> lane_out;
+  StateBuffer lane_state;
 
   using WrapperUpdateStateFn = void (*)(const uint8_t *input, uint8_t *state);
   using WrapperComputeOutputFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state);
   using WrapperGetValuesFn = void (*)(const uint8_t *input, uint8_t *state);
+  using WrapperComputeOutputDemandFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state,
+                                                const uint64_t *demand);
+  using WrapperComputeOutputChangedFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state,
+                                                 const uint64_t *changed, uint64_t *cache);
+  using WrapperStepFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state);
+  using WrapperRunFn = void (*)(const uint8_t *us_input, const uint8_t *co_input, uint8_t *output,
+                                uint8_t *state, uint64_t num_cycles);
+  using WrapperBatchStepFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state,
+                                      uint64_t num_groups);
 
   WrapperComputeOutputFn compute_output_ptr;
   WrapperUpdateStateFn update_state_ptr;
   WrapperGetValuesFn get_values_ptr;
+  WrapperComputeOutputDemandFn compute_output_demand_ptr;
+  WrapperComputeOutputChangedFn compute_output_changed_ptr;
+  WrapperRunFn run_ptr;
+  WrapperStepFn step_ptr;
+  WrapperBatchStepFn batch_step_ptr;
 
+  const Circuit &circuit;
   const Definition *top;
 
+  std::thread compile_thread;
+  std::unique_ptr<TierManager> tiers;
+  std::vector<std::vector<const Definition *>> bundles;
+
+  uint64_t finalize_after;
+  uint64_t num_cycles;
+  bool finalized;
+  bool time_finalize;
+  FinalizeStats finalize_stats;
+  uint64_t context_recycle_interval;
+  uint64_t num_queries;
+
+  double timeComputeOutput();
+  void finishCycle();
+
+  std::shared_ptr<llvm::Module> countCalls(ModuleEnvironment &&env, const Definition &defn,
+                                           const std::string &fn_name);
+  std::string getCacheKey(const Definition &defn, bool counted) const;
+  void applyOptimizationOverrides(const std::vector<OptimizationOverride> &overrides);
+  void addSimulationFunctions(const Definition &defn);
+  std::vector<std::string> getChunkNames(const Definition &defn) const;
+  void addChunkFunctions(const Definition &defn);
+  void formBundles(unsigned bundle_size);
+  std::string getBundleName(unsigned idx) const;
+  std::string getBundleCacheKey(unsigned idx) const;
+  std::vector<std::string> getBundleFunctions(unsigned idx) const;
+  void addSimulationBundle(unsigned idx);
+  CodeLayout makeCodeLayout() const;
   void addDefinitionFunctions(const Definition &defn);
   void addWrappers(const Definition &top);
+  void precompileParallel(unsigned num_threads);
+  void waitForCompile();
+  ModuleEnvironment & getDebugModule(const Definition &defn, bool output_deps);
+  void recycleContext();
   std::vector<uint8_t> allocateDebugStorage(const Instance *inst, const std::string &input);
 
-  JITFrontend(const Circuit &circuit, const Definition &top);
+  JITFrontend(const Circuit &circuit, const Definition &top, const FrontendOptions &options);
 public:
-  JITFrontend(const Circuit &circuit);
+  JITFrontend(const Circuit &circuit, const FrontendOptions &options = FrontendOptions());
+  ~JITFrontend();
 
   void setInput(const std::string &name, uint64_t val);
   void setInput(const std::string &name, llvm::APInt val);
 
-  const std::vector<uint8_t> & getState() const { return state; }
+  const StateBuffer & getState() const { return state; }
 
   void updateState();
   const LLVMStruct & computeOutput();
+  /* Only computes the named outputs, running just the instances in their
+   * fan-in cones. The other outputs keep the values they had. */
+  const LLVMStruct & computeOutputs(const std::vector<std::string> &names);
+  /* Only recomputes the outputs downstream of inputs set, or of state
+   * updated, since the last call, reusing the values of the rest of the
+   * design from that call */
+  const LLVMStruct & computeChangedOutput();
+  /* Same as computeOutput followed by updateState, but logic needed by
+   * both is only evaluated once. The outputs are those of the cycle before
+   * the state was updated. */
+  const LLVMStruct & step();
+  /* Same as that many calls to updateState followed by computeOutput, but
+   * the cycles run in one JIT'd loop that keeps the inputs constant and
+   * only writes the state back at the end. Tier up and finalize_after are
+   * only checked once the loop is done. */
+  const LLVMStruct & run(uint64_t cycles);
+
+  /* The lanes (see FrontendOptions::lanes) are set and read one at a time,
+   * and all stepped together by stepLanes, which does the same as step()
+   * for each of them. Outputs are those of the last stepLanes. */
+  unsigned getNumLanes() const { return num_lanes; }
+  void setLaneInput(unsigned lane, const std::string &name, uint64_t val);
+  void setLaneInput(unsigned lane, const std::string &name, llvm::APInt val);
+  void stepLanes();
+  llvm::APInt getLaneOutput(unsigned lane, const std::string &name) const;
+  /* Lanes of a signal are next to each other, see GetLaneGroupStateBytes */
+  const StateBuffer & getLaneState() const { return lane_state; }
 
   llvm::APInt getValue(const std::vector<std::string> &inst_names, const std::string &input);
 
+  /* Recompiles update_state and compute_output for every definition using
+   * the counts collected so far by an instrumented run */
+  void reoptimizeWithProfile();
+
+  /* Relinks update_state and compute_output for every definition and the
+   * top level wrappers into one object, so calls on the hot path are direct
+   * instead of going through the JIT's stubs. Not supported when tiered,
+   * since tier up swaps functions through the stubs. */
+  bool finalize();
+  bool isFinalized() const { return finalized; }
+  /* Zero unless FrontendOptions::time_finalize is set */
+  const FinalizeStats & getFinalizeStats() const { return finalize_stats; }
+  bool writeProfile(const std::string &path) const { return profile.write(path); }
+
+  /* Compiles every function that hasn't been compiled yet */
+  void precompile();
+  /* Bytes of executable and data memory held by compiled code */
+  uint64_t getCodeBytes() const;
+  /* Time spent generating, optimizing and compiling each module so far */
+  const CompileStats & getCompileStats() const { return jit.getCompileStats(); }
+  bool writeCompileStats(const std::string &path) const { return jit.getCompileStats().writeJSON(path); }
+
   void dumpIR();
 };
 
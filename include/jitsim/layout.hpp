@@ -0,0 +1,41 @@
+#ifndef JITSIM_LAYOUT_HPP_INCLUDED
+#define JITSIM_LAYOUT_HPP_INCLUDED
+
+#include <llvm/IR/Module.h>
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace JITSim {
+
+/* Order in which functions should be placed in memory. Functions are
+ * placed in the order they were added, so functions calling each other
+ * every cycle end up on the same pages. Cold functions are moved to
+ * .text.unlikely, which PooledMemoryManager keeps in separate blocks from
+ * the hot code. */
+class CodeLayout {
+private:
+  std::unordered_map<std::string, unsigned> ranks;
+  std::unordered_set<std::string> cold_functions;
+
+public:
+  /* Places name after every function added before it, does nothing if it
+   * was already added */
+  void addFunction(const std::string &name);
+  void addColdFunction(const std::string &name);
+
+  bool empty() const { return ranks.empty() && cold_functions.empty(); }
+  /* Functions that weren't added are ranked after all the others */
+  unsigned getRank(const std::string &name) const;
+  bool isCold(const std::string &name) const { return cold_functions.count(name) > 0; }
+
+  /* Sorts the functions defined in module by rank and marks the cold
+   * ones. Only reads the layout, so it is safe to call from compile
+   * worker threads. */
+  void apply(llvm::Module &module) const;
+};
+
+}
+
+#endif
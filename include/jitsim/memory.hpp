@@ -0,0 +1,149 @@
+#ifndef JITSIM_MEMORY_HPP_INCLUDED
+#define JITSIM_MEMORY_HPP_INCLUDED
+
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm/Support/Memory.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace JITSim {
+
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+/* Maps size bytes (a multiple of HUGE_PAGE_SIZE) aligned to a huge page.
+ * Uses MAP_HUGETLB when huge pages are reserved, and otherwise asks for
+ * transparent huge pages, falling back to normal pages if those are
+ * disabled. Returns nullptr only if the mapping fails. */
+void * MapHugePages(size_t size, bool executable);
+void UnmapHugePages(void *addr, size_t size);
+/* Bytes of this process backed by huge pages of either kind, according
+ * to /proc/self/smaps. Always 0 on systems without it. */
+uint64_t GetHugePageBytes();
+
+/* Allocator putting buffers of at least half a huge page on huge pages
+ * when enabled, so large buffers like the simulation state don't take a
+ * TLB entry per 4KB */
+template <typename T>
+class HugePageAllocator {
+private:
+  bool huge_pages;
+
+  bool useHugePages(size_t n) const { return huge_pages && n * sizeof(T) >= HUGE_PAGE_SIZE / 2; }
+  static size_t getMappedSize(size_t n) { return (n * sizeof(T) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE; }
+
+public:
+  using value_type = T;
+
+  HugePageAllocator(bool huge_pages_ = false) : huge_pages(huge_pages_) {}
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U> &other) : huge_pages(other.usesHugePages()) {}
+
+  bool usesHugePages() const { return huge_pages; }
+
+  T * allocate(size_t n)
+  {
+    if (!useHugePages(n)) {
+      return std::allocator<T>().allocate(n);
+    }
+
+    void *addr = MapHugePages(getMappedSize(n), false);
+    if (!addr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(addr);
+  }
+
+  void deallocate(T *ptr, size_t n)
+  {
+    if (!useHugePages(n)) {
+      std::allocator<T>().deallocate(ptr, n);
+      return;
+    }
+
+    UnmapHugePages(ptr, getMappedSize(n));
+  }
+
+  template <typename U>
+  bool operator==(const HugePageAllocator<U> &other) const { return huge_pages == other.usesHugePages(); }
+  template <typename U>
+  bool operator!=(const HugePageAllocator<U> &other) const { return !(*this == other); }
+};
+
+/* Page aligned blocks of memory that are kept after the object using them
+ * is removed, so a long session keeps reusing the same pages instead of
+ * mapping new ones for every recompile. Idle blocks past max_free_bytes are
+ * unmapped. With huge_pages, blocks are carved out of huge page regions
+ * that stay mapped (and writable and executable) for the pool's lifetime. */
+class MemoryPool {
+private:
+  std::multimap<size_t, llvm::sys::MemoryBlock> free_blocks;
+  uint64_t free_bytes;
+  uint64_t max_free_bytes;
+  uint64_t mapped_bytes;
+
+  bool huge_pages;
+  std::vector<llvm::sys::MemoryBlock> huge_regions;
+  uintptr_t region_ptr;
+  size_t region_free;
+
+  std::mutex pool_lock;
+
+  llvm::sys::MemoryBlock allocateFromRegion(size_t size);
+
+public:
+  MemoryPool(uint64_t max_free_bytes, bool huge_pages = false);
+  MemoryPool(const MemoryPool &) = delete;
+  ~MemoryPool();
+
+  /* Returns a readable and writable block of at least size bytes, or an
+   * empty block if mapping failed */
+  llvm::sys::MemoryBlock allocate(size_t size);
+  void release(llvm::sys::MemoryBlock block);
+
+  uint64_t getFreeBytes() const { return free_bytes; }
+  uint64_t getMappedBytes() const { return mapped_bytes; }
+  bool usesHugePages() const { return huge_pages; }
+};
+
+/* Memory manager for a single object linked by RuntimeDyld. Sections are
+ * packed into blocks from the pool, and the blocks go back to the pool when
+ * the object is removed from the JIT. */
+class PooledMemoryManager : public llvm::RTDyldMemoryManager {
+private:
+  /* Sections needing the same final permissions share blocks */
+  struct Arena {
+    std::vector<llvm::sys::MemoryBlock> blocks;
+    uintptr_t free_ptr;
+    uintptr_t free_size;
+    unsigned permissions;
+  };
+
+  std::shared_ptr<MemoryPool> pool;
+  Arena code;
+  Arena ro_data;
+  Arena rw_data;
+  Arena cold_code;
+
+  uint8_t *allocate(Arena &arena, uintptr_t size, unsigned alignment);
+  bool protect(Arena &arena, std::string *err_msg);
+
+public:
+  PooledMemoryManager(std::shared_ptr<MemoryPool> pool);
+  ~PooledMemoryManager() override;
+
+  uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment, unsigned section_id,
+                               llvm::StringRef section_name) override;
+  uint8_t *allocateDataSection(uintptr_t size, unsigned alignment, unsigned section_id,
+                               llvm::StringRef section_name, bool is_read_only) override;
+
+  bool finalizeMemory(std::string *err_msg = nullptr) override;
+};
+
+}
+
+#endif
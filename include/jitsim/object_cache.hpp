@@ -0,0 +1,49 @@
+#ifndef JITSIM_OBJECT_CACHE_HPP_INCLUDED
+#define JITSIM_OBJECT_CACHE_HPP_INCLUDED
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace JITSim {
+
+/* Stores compiled objects on disk so they can be reused by later runs.
+ * Objects are only written for modules that have been registered with
+ * setModuleKey, since the module name alone doesn't describe its contents.
+ * Least recently used objects are evicted once the directory grows past
+ * max_bytes. */
+class DiskObjectCache : public llvm::ObjectCache {
+private:
+  std::string cache_dir;
+  uint64_t max_bytes;
+  uint64_t cur_bytes;
+
+  std::unordered_map<std::string, std::string> module_keys;
+  std::mutex cache_lock;
+
+  std::string getObjectPath(const std::string &key) const;
+  uint64_t calculateSize() const;
+  void evict();
+
+public:
+  DiskObjectCache(const std::string &cache_dir, uint64_t max_bytes);
+
+  void setModuleKey(const std::string &module_name, const std::string &key);
+
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const std::string &key);
+
+  void notifyObjectCompiled(const llvm::Module *module, llvm::MemoryBufferRef obj) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *module) override;
+
+  uint64_t getSize() const { return cur_bytes; }
+};
+
+} // end namespace JITSim
+
+#endif // JITSIM_OBJECT_CACHE_HPP_INCLUDED
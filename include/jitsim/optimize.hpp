@@ -0,0 +1,39 @@
+#ifndef JITSIM_OPTIMIZE_HPP_INCLUDED
+#define JITSIM_OPTIMIZE_HPP_INCLUDED
+
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <string>
+
+namespace JITSim {
+
+struct OptimizationOptions {
+  unsigned opt_level = 2;
+  unsigned size_level = 0;
+  bool loop_vectorize = false;
+  bool slp_vectorize = false;
+  /* Also run the module pipeline (inliner, IPSCCP, GlobalDCE, ...) after
+   * the function passes */
+  bool module_passes = false;
+
+  /* Unique string for these options, used in object cache keys */
+  std::string getKey() const;
+};
+
+/* Options for the definitions whose name matches pattern (an ECMAScript regex) */
+struct OptimizationOverride {
+  std::string pattern;
+  OptimizationOptions options;
+};
+
+/* Runs the optimization pipeline selected by options over module. If
+ * target_machine is given its cost model is used, which the vectorizers need.
+ * Only touches the module's own context, so it is safe to call on different
+ * modules from different threads as long as they don't share a context. */
+void OptimizeModule(llvm::Module &module, const OptimizationOptions &options,
+                    llvm::TargetMachine *target_machine = nullptr);
+
+}
+
+#endif
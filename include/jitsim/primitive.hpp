@@ -3,6 +3,7 @@
 
 #include <functional>
 #include <unordered_set>
+#include <string>
 #include <jitsim/builder.hpp>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Function.h>
@@ -15,7 +16,11 @@ struct Primitive {
 public:
   bool is_stateful;
   bool has_definition;
+  /* update_state writes all of the state every cycle, so the writes can
+   * go to a shadow copy (see CodegenOptions::shadow_state) */
+  bool overwrites_state;
   unsigned int num_state_bytes;
+  std::string gen_args; /* Canonical form of the generator arguments, used for hashing */
   std::unordered_set<std::string> state_deps;
   std::unordered_set<std::string> output_deps;
   
@@ -40,7 +45,9 @@ public:
             ModuleGen make_def_)
     : is_stateful(is_stateful_),
       has_definition(true),
+      overwrites_state(false),
       num_state_bytes(num_state_bytes_),
+      gen_args(),
       state_deps(state_deps_),
       output_deps(output_deps_),
       make_compute_output(make_compute_output_),
@@ -57,7 +64,9 @@ public:
             UpdateStateGen make_update_state_)
     : is_stateful(is_stateful_),
       has_definition(false),
+      overwrites_state(false),
       num_state_bytes(num_state_bytes_),
+      gen_args(),
       state_deps(state_deps_),
       output_deps(output_deps_),
       make_compute_output(make_compute_output_),
@@ -69,7 +78,9 @@ public:
   Primitive(ComputeOutputGen make_compute_output_)
     : is_stateful(false),
       has_definition(false),
+      overwrites_state(false),
       num_state_bytes(0),
+      gen_args(),
       state_deps(),
       output_deps(),
       make_compute_output(make_compute_output_),
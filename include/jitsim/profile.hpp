@@ -0,0 +1,48 @@
+#ifndef JITSIM_PROFILE_HPP_INCLUDED
+#define JITSIM_PROFILE_HPP_INCLUDED
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace JITSim {
+
+enum class ProfileMode {
+  None,
+  Instrument, /* Count function entries and branch directions */
+  Use         /* Annotate branches and functions with previously collected counts */
+};
+
+/* Execution counts for generated functions. Each function has an entry
+ * counter followed by a (false, true) pair for every profiled branch, in
+ * the order the branches are generated. Codegen is deterministic, so the
+ * same site numbers are seen when the function is regenerated. */
+class ProfileData {
+private:
+  /* Deques so counters can be appended without moving the ones already
+   * baked into generated code */
+  std::unordered_map<std::string, std::deque<uint64_t>> counters;
+  mutable std::mutex profile_lock;
+
+  std::deque<uint64_t> & getFunctionCounters(const std::string &fn_name);
+
+public:
+  ProfileData() = default;
+  ProfileData(const ProfileData &) = delete;
+
+  uint64_t * getEntryCounter(const std::string &fn_name);
+  uint64_t * getSiteCounters(const std::string &fn_name, unsigned site);
+
+  bool getEntryCount(const std::string &fn_name, uint64_t &count) const;
+  bool getSiteCounts(const std::string &fn_name, unsigned site,
+                     uint64_t &false_count, uint64_t &true_count) const;
+
+  bool write(const std::string &path) const;
+  bool read(const std::string &path);
+};
+
+}
+
+#endif
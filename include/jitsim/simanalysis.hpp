@@ -13,28 +13,59 @@ namespace JITSim {
 class Instance;
 class IFace;
 
+/* A set of a definition's ports, by their index in its IFace */
+class PortMask
+{
+private:
+  /* Never has trailing zero words, so equal sets have equal words */
+  std::vector<uint64_t> words;
+public:
+  void set(unsigned idx);
+  bool test(unsigned idx) const;
+  void merge(const PortMask &other);
+  unsigned count() const;
+
+  const std::vector<uint64_t> & getWords() const { return words; }
+};
+
+/* Bytes [offset, offset + bytes) of a definition's state */
+struct StateRange {
+  unsigned offset;
+  unsigned bytes;
+};
+
 class SimInfo
 {
 private:
   std::vector<const Instance *> stateful_insts;
   std::vector<const Instance *> state_deps;
   std::vector<const Instance *> output_deps;
+  std::vector<const Instance *> step_deps;
   std::unordered_set<const Instance *> state_deps_lookup;
   std::unordered_set<const Instance *> output_deps_lookup;
   std::unordered_map<const Instance *, unsigned> offset_map;
   std::unordered_map<const Instance *, unsigned> inst_nums;
+  std::unordered_map<const Instance *, PortMask> demanding_sinks;
+  std::unordered_map<const Instance *, PortMask> input_deps;
+  std::vector<PortMask> sink_input_deps;
+  unsigned state_bit;
   optional<Primitive> primitive;
 
   bool is_stateful;
   unsigned int num_state_bytes;
+  unsigned int state_align;
+  std::vector<StateRange> commit_ranges;
 
   std::vector<const Source *> state_dep_srcs; /* These input sources are directly necessary to update the state */
   std::vector<const Source *> output_dep_srcs; /* These input sources are directly necessary to compute the output */
 
   void calculateStateOffsets();
+  void calculateCommitRanges();
   void calculateInstanceNumbers(const std::vector<Instance> &instances);
   void analyzeStateDeps(const IFace &);
   void analyzeOutputDeps(const IFace &);
+  void analyzeCones(const IFace &);
+  void analyzeStepDeps();
 public:
   SimInfo(const IFace &defn_iface, const std::vector<Instance> &instances);
   SimInfo(const IFace &defn_iface, const Primitive &primitive);
@@ -48,14 +79,38 @@ public:
   bool isOutputDep(const Instance *inst) const { return output_deps_lookup.count(inst); }
   const std::vector<const Instance *> & getStateDeps() const { return state_deps; }
   const std::vector<const Instance *> & getOutputDeps() const { return output_deps; }
+  /* Union of the state and output deps in topological order, so a cycle
+   * computes everything it needs from each instance once */
+  const std::vector<const Instance *> & getStepDeps() const { return step_deps; }
   const std::vector<const Instance *> & getStatefulInstances() const { return stateful_insts; }
   const std::vector<const Source *> & getStateSources() const { return state_dep_srcs; }
   const std::vector<const Source *> & getOutputSources() const { return output_dep_srcs; }
 
+  /* Cones of the definition's ports, for the instances in getOutputDeps.
+   * The sinks whose fan-in cone includes inst, and the inputs (plus
+   * getStateBit when it reads state, directly or through other instances)
+   * whose fan-out cone does. */
+  const PortMask & getDemandingSinks(const Instance *inst) const { return demanding_sinks.find(inst)->second; }
+  const PortMask & getInputDeps(const Instance *inst) const { return input_deps.find(inst)->second; }
+  const PortMask & getSinkInputDeps(unsigned sink_idx) const { return sink_input_deps[sink_idx]; }
+  unsigned getStateBit() const { return state_bit; }
+  /* Instances computing a sink, or downstream of an input, in the order of
+   * getOutputDeps */
+  std::vector<const Instance *> getSinkCone(unsigned sink_idx) const;
+  std::vector<const Instance *> getInputCone(unsigned input_bit) const;
+
   unsigned getOffset(const Instance *inst) const { return offset_map.find(inst)->second; }
   unsigned getInstNum(const Instance *inst) const { return inst_nums.find(inst)->second; }
 
   unsigned int getNumStateBytes() const { return num_state_bytes; }
+  /* Every offset is a multiple of its instance's alignment, so the state
+   * of each primitive is aligned like a load of its width */
+  unsigned int getStateAlign() const { return state_align; }
+  /* The state written in full by every update_state, in order and with
+   * adjacent ranges (and the padding between them) merged. With a shadow
+   * state these are what gets copied back after each update, the rest is
+   * updated in place. */
+  const std::vector<StateRange> & getCommitRanges() const { return commit_ranges; }
   const Primitive& getPrimitive() const { return *primitive; }
 
 
@@ -0,0 +1,32 @@
+#ifndef JITSIM_TARGET_HPP_INCLUDED
+#define JITSIM_TARGET_HPP_INCLUDED
+
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <string>
+#include <vector>
+
+namespace JITSim {
+
+/* The CPU to generate code for */
+struct CPUTarget {
+  std::string cpu;
+  /* Subtarget features in LLVM's "+feature" / "-feature" form */
+  std::vector<std::string> features;
+};
+
+/* The CPU of the machine we are running on, with every feature it reports */
+CPUTarget GetHostCPUTarget();
+
+/* cpu is either "host" to detect the current machine, or an LLVM CPU name
+ * whose default features are used */
+CPUTarget GetCPUTarget(const std::string &cpu);
+
+/* Selects a TargetMachine for the current process's triple, for use by the JIT */
+llvm::TargetMachine * SelectTarget(const CPUTarget &target,
+                                   llvm::CodeGenOpt::Level opt_level = llvm::CodeGenOpt::Default);
+
+}
+
+#endif
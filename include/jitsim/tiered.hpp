@@ -0,0 +1,83 @@
+#ifndef JITSIM_TIERED_HPP_INCLUDED
+#define JITSIM_TIERED_HPP_INCLUDED
+
+#include <jitsim/JIT.hpp>
+#include <jitsim/builder.hpp>
+#include <jitsim/circuit.hpp>
+#include <jitsim/optimize.hpp>
+#include <jitsim/target.hpp>
+
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace JITSim {
+
+/* Tracks how often each definition is called from the quickly compiled first
+ * tier and recompiles hot definitions at O3 on a background thread. The
+ * recompiled code is swapped in through the JIT's stubs by tierUp, which
+ * must only be called between cycles. */
+class TierManager {
+private:
+  struct TierJob {
+    std::string name;
+    std::function<ModuleEnvironment(Builder &, const Definition &)> make_module;
+    const Definition *defn;
+    OptimizationOptions optimization;
+  };
+
+  JIT &jit;
+  const llvm::DataLayout &data_layout;
+  const CPUTarget cpu_target;
+  const CodegenOptions codegen_options;
+  uint64_t threshold;
+
+  /* Filled in up front so instrumentation can look up counters from
+   * compile worker threads without modifying the map */
+  std::unordered_map<const Definition *, uint64_t> call_counts;
+  std::unordered_set<const Definition *> promoted;
+  std::unordered_map<const Definition *, OptimizationOptions> tier_up_optimizations;
+  uint64_t cycles_since_check;
+
+  std::deque<TierJob> queue;
+  std::vector<std::pair<std::string, std::unique_ptr<llvm::MemoryBuffer>>> finished;
+  std::atomic<bool> has_finished;
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable queue_cv;
+  std::thread worker;
+
+  void workerLoop();
+
+public:
+  TierManager(JIT &jit, const llvm::DataLayout &data_layout, const CPUTarget &cpu_target,
+              const CodegenOptions &codegen_options, const Circuit &circuit, uint64_t threshold);
+  ~TierManager();
+
+  /* Increments defn's call counter on every call to fn_name */
+  void addCallCounter(llvm::Module &module, const std::string &fn_name, const Definition &defn);
+
+  /* Replaces the default O3 pipeline used when defn is recompiled */
+  void setTierUpOptions(const Definition &defn, const OptimizationOptions &optimization);
+
+  /* Called after running cycles cycles, the counters are checked once
+   * enough cycles have passed however they were batched */
+  void tierUp(uint64_t cycles = 1);
+
+  unsigned getNumPromoted() const { return promoted.size(); }
+};
+
+}
+
+#endif
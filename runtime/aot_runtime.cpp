@@ -0,0 +1,164 @@
+#include "aot_runtime.hpp"
+
+#include <cstring>
+#include <iostream>
+
+#include <dlfcn.h>
+
+namespace JITSim {
+
+using namespace std;
+
+/* Matches struct jitsim_port in the generated header */
+struct ExportedPort {
+  const char *name;
+  uint32_t offset;
+  uint32_t width;
+};
+
+static unsigned getNumBytes(unsigned bits)
+{
+  return (bits + 7) / 8;
+}
+
+AOTDesign::AOTDesign(const string &lib_path)
+  : handle(nullptr),
+    error(),
+    update_state_ptr(nullptr),
+    compute_output_ptr(nullptr),
+    co_in(),
+    co_out(),
+    us_in(),
+    state()
+{
+  handle = dlopen(lib_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    error = dlerror();
+    return;
+  }
+
+  update_state_ptr = (UpdateStateFn)lookup("update_state");
+  compute_output_ptr = (ComputeOutputFn)lookup("compute_output");
+  auto state_size = (const uint64_t *)lookup("jitsim_state_size");
+  if (!update_state_ptr || !compute_output_ptr || !state_size) {
+    return;
+  }
+
+  if (!loadPorts(co_in, "compute_output_inputs") ||
+      !loadPorts(co_out, "compute_output_outputs") ||
+      !loadPorts(us_in, "update_state_inputs")) {
+    return;
+  }
+
+  state.resize(*state_size, 0);
+}
+
+AOTDesign::~AOTDesign()
+{
+  if (handle) {
+    dlclose(handle);
+  }
+}
+
+void * AOTDesign::lookup(const string &name)
+{
+  void *sym = dlsym(handle, name.c_str());
+  if (!sym && error.empty()) {
+    error = "Missing symbol " + name;
+  }
+
+  return sym;
+}
+
+bool AOTDesign::loadPorts(PortStruct &ports, const string &prefix)
+{
+  auto table = (const ExportedPort *)lookup("jitsim_" + prefix + "_ports");
+  auto num_ports = (const uint32_t *)lookup("jitsim_" + prefix + "_num_ports");
+  auto size = (const uint64_t *)lookup("jitsim_" + prefix + "_size");
+  if (!table || !num_ports || !size) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < *num_ports; i++) {
+    ports.ports[table[i].name] = { table[i].offset, table[i].width };
+  }
+  ports.data.resize(*size, 0);
+
+  return true;
+}
+
+/* Copies bytes into the port, zeroing any bits above the port's width
+ * since the generated code loads the whole storage unit */
+void AOTDesign::setPort(PortStruct &ports, const string &name, const uint8_t *bytes, unsigned num_bytes)
+{
+  auto iter = ports.ports.find(name);
+  if (iter == ports.ports.end()) {
+    return;
+  }
+  const Port &port = iter->second;
+
+  unsigned port_bytes = getNumBytes(port.width);
+  uint8_t *dst = ports.data.data() + port.offset;
+  memset(dst, 0, port_bytes);
+  memcpy(dst, bytes, min(num_bytes, port_bytes));
+
+  if (port.width % 8 != 0) {
+    dst[port_bytes - 1] &= (1 << (port.width % 8)) - 1;
+  }
+}
+
+void AOTDesign::setInput(const string &name, uint64_t val)
+{
+  uint8_t bytes[sizeof(val)];
+  memcpy(bytes, &val, sizeof(val));
+
+  setPort(co_in, name, bytes, sizeof(val));
+  setPort(us_in, name, bytes, sizeof(val));
+}
+
+void AOTDesign::setInput(const string &name, const vector<uint8_t> &bytes)
+{
+  setPort(co_in, name, bytes.data(), bytes.size());
+  setPort(us_in, name, bytes.data(), bytes.size());
+}
+
+void AOTDesign::updateState()
+{
+  update_state_ptr(us_in.data.data(), state.data());
+}
+
+void AOTDesign::computeOutput()
+{
+  compute_output_ptr(co_in.data.data(), co_out.data.data(), state.data());
+}
+
+vector<uint8_t> AOTDesign::getOutputBytes(const string &name) const
+{
+  auto iter = co_out.ports.find(name);
+  if (iter == co_out.ports.end()) {
+    return vector<uint8_t>();
+  }
+  const Port &port = iter->second;
+
+  const uint8_t *src = co_out.data.data() + port.offset;
+  return vector<uint8_t>(src, src + getNumBytes(port.width));
+}
+
+uint64_t AOTDesign::getOutput(const string &name) const
+{
+  vector<uint8_t> bytes = getOutputBytes(name);
+
+  uint64_t val = 0;
+  memcpy(&val, bytes.data(), min<size_t>(bytes.size(), sizeof(val)));
+
+  return val;
+}
+
+void AOTDesign::dump() const
+{
+  for (const auto &port : co_out.ports) {
+    cout << port.first << ": " << getOutput(port.first) << endl;
+  }
+}
+
+}
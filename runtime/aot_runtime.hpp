@@ -0,0 +1,72 @@
+#ifndef JITSIM_AOT_RUNTIME_HPP_INCLUDED
+#define JITSIM_AOT_RUNTIME_HPP_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace JITSim {
+
+/* Loads a design exported by AOTCompiler and simulates it. Only depends on
+ * libdl, so test hosts don't need LLVM or CoreIR. */
+class AOTDesign {
+private:
+  struct Port {
+    uint32_t offset;
+    uint32_t width;
+  };
+
+  /* One of the structs passed to the exported functions, laid out from the
+   * port table the library exports for it */
+  struct PortStruct {
+    std::unordered_map<std::string, Port> ports;
+    std::vector<uint8_t> data;
+  };
+
+  using UpdateStateFn = void (*)(const uint8_t *input, uint8_t *state);
+  using ComputeOutputFn = void (*)(const uint8_t *input, uint8_t *output, uint8_t *state);
+
+  void *handle;
+  std::string error;
+
+  UpdateStateFn update_state_ptr;
+  ComputeOutputFn compute_output_ptr;
+
+  PortStruct co_in;
+  PortStruct co_out;
+  PortStruct us_in;
+
+  std::vector<uint8_t> state;
+
+  void *lookup(const std::string &name);
+  bool loadPorts(PortStruct &ports, const std::string &prefix);
+
+  static void setPort(PortStruct &ports, const std::string &name, const uint8_t *bytes, unsigned num_bytes);
+
+public:
+  AOTDesign(const std::string &lib_path);
+  AOTDesign(const AOTDesign &) = delete;
+  ~AOTDesign();
+
+  bool isLoaded() const { return error.empty(); }
+  const std::string & getError() const { return error; }
+
+  void setInput(const std::string &name, uint64_t val);
+  /* For ports wider than 64 bits, bytes are little endian */
+  void setInput(const std::string &name, const std::vector<uint8_t> &bytes);
+
+  void updateState();
+  void computeOutput();
+
+  uint64_t getOutput(const std::string &name) const;
+  std::vector<uint8_t> getOutputBytes(const std::string &name) const;
+
+  const std::vector<uint8_t> & getState() const { return state; }
+
+  void dump() const;
+};
+
+}
+
+#endif
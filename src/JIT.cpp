@@ -1,9 +1,18 @@
 #include <jitsim/JIT.hpp>
+#include <jitsim/optimize.hpp>
 #include <iostream>
 #include <tuple>
 
+#include <unistd.h>
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MD5.h>
 #include <llvm/Support/raw_os_ostream.h>
-#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 namespace JITSim {
 
@@ -17,14 +26,29 @@ static __attribute__((constructor)) void initializeLLVM()
   LLVMInitializeNativeAsmParser();
 }
 
-JIT::JIT(TargetMachine &target_machine, const DataLayout &dl)
+JIT::JIT(TargetMachine &target_machine_, const DataLayout &dl, const JITOptions &options)
   : data_layout(dl),
+    target_machine(target_machine_),
+    target_triple(target_machine_.getTargetTriple().getTriple()),
+    target_cpu((target_machine_.getTargetCPU() + ":" + target_machine_.getTargetFeatureString()).str()),
+    default_optimization(options.optimization),
+    module_optimizations(),
+    code_layout(),
+    object_cache(options.cache_dir.empty() ? nullptr :
+                 llvm::make_unique<DiskObjectCache>(options.cache_dir, options.cache_max_bytes)),
+    memory_pool(std::make_shared<MemoryPool>(options.pool_max_bytes, options.huge_pages)),
+    compile_stats(),
     compile_callback_manager(
-      createLocalCompileCallbackManager(target_machine.getTargetTriple(), 0)),
+      createLocalCompileCallbackManager(target_machine_.getTargetTriple(), 0)),
     indirect_stubs_manager(
-      createLocalIndirectStubsManagerBuilder(target_machine.getTargetTriple())()),
-    object_layer([]() { return std::make_shared<SectionMemoryManager>(); }),
-    compile_layer(object_layer, SimpleCompiler(target_machine)),
+      createLocalIndirectStubsManagerBuilder(target_machine_.getTargetTriple())()),
+    object_layer([this]() { return std::make_shared<PooledMemoryManager>(memory_pool); },
+                 [this](RTDyldObjectLinkingLayer::ObjHandleT handle,
+                        const RTDyldObjectLinkingLayer::ObjectPtr &obj,
+                        const RuntimeDyld::LoadedObjectInfo &info) {
+                   notifyObjectLoaded(handle, obj, info);
+                 }),
+    compile_layer(object_layer, TimedCompiler(target_machine_, object_cache.get(), compile_stats)),
     optimize_layer(compile_layer,
                   [this](std::shared_ptr<Module> module) {
                     return optimizeModule(std::move(module));
@@ -36,17 +60,116 @@ JIT::JIT(TargetMachine &target_machine, const DataLayout &dl)
     debug_print_ir(false)
 {
   llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+
+  if (options.gdb_listener) {
+    event_listeners.push_back(JITEventListener::createGDBRegistrationListener());
+  }
+
+  if (options.perf_map) {
+    std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    std::error_code err;
+    perf_map = llvm::make_unique<raw_fd_ostream>(path, err, sys::fs::F_Append | sys::fs::F_Text);
+    if (err) {
+      errs() << "Unable to open " << path << ": " << err.message() << "\n";
+      perf_map.reset();
+    }
+  }
 }
 
-JIT::ModuleHandle JIT::addModule(std::shared_ptr<Module> module) {
-  assert(module->getDataLayout() == data_layout);
+void JIT::notifyObjectLoaded(ModuleHandle handle, const RTDyldObjectLinkingLayer::ObjectPtr &obj,
+                             const RuntimeDyld::LoadedObjectInfo &info)
+{
+  const object::ObjectFile &obj_file = *obj->getBinary();
+
+  for (JITEventListener *listener : event_listeners) {
+    listener->NotifyObjectEmitted(obj_file, info);
+  }
+  if (!event_listeners.empty()) {
+    notified_objects.emplace_back(handle, obj);
+  }
+
+  if (perf_map) {
+    writePerfMap(obj_file, info);
+  }
+}
+
+/* Functions generated for a definition are shown as the definition's safe
+ * name and the kind of function, the wrappers keep their own names */
+static std::string getPerfName(StringRef name)
+{
+  for (StringRef kind : { "update_state", "compute_output", "state_deps", "output_deps" }) {
+    if (name.size() > kind.size() + 1 && name.endswith(kind) && name[name.size() - kind.size() - 1] == '_') {
+      return (name.drop_back(kind.size() + 1) + " [" + kind + "]").str();
+    }
+  }
+
+  return name.str();
+}
+
+void JIT::writePerfMap(const object::ObjectFile &obj, const RuntimeDyld::LoadedObjectInfo &info)
+{
+  /* Symbols in the debug object are already at their load addresses */
+  object::OwningBinary<object::ObjectFile> debug_obj = info.getObjectForDebug(obj);
+  if (!debug_obj.getBinary()) {
+    return;
+  }
+
+  for (const auto &sym_size : object::computeSymbolSizes(*debug_obj.getBinary())) {
+    const object::SymbolRef &sym = sym_size.first;
+    if (sym.getType() != object::SymbolRef::ST_Function) {
+      continue;
+    }
+
+    Expected<StringRef> name = sym.getName();
+    Expected<uint64_t> addr = sym.getAddress();
+    if (!name || !addr) {
+      consumeError(name.takeError());
+      consumeError(addr.takeError());
+      continue;
+    }
+
+    *perf_map << format_hex_no_prefix(*addr, 1) << " " << format_hex_no_prefix(sym_size.second, 1)
+              << " " << getPerfName(*name) << "\n";
+  }
+  perf_map->flush();
+}
+
+TimedCompiler::TimedCompiler(TargetMachine &target_machine, ObjectCache *object_cache,
+                             CompileStats &stats_)
+  : compiler(target_machine, object_cache),
+    stats(stats_)
+{}
+
+SimpleCompiler::CompileResult TimedCompiler::operator()(Module &module)
+{
+  auto start = CompileStats::Clock::now();
+  auto obj = compiler(module);
+  double ms = CompileStats::getElapsedMS(start);
+
+  uint64_t code_bytes = obj.getBinary() ? CompileStats::getCodeBytes(*obj.getBinary()) : 0;
+  stats.recordCodegen(module.getModuleIdentifier(), ms, code_bytes);
+
+  return obj;
+}
+
+static uint64_t getObjectCodeBytes(const MemoryBuffer &buffer)
+{
+  auto obj = object::ObjectFile::createObjectFile(buffer.getMemBufferRef());
+  if (!obj) {
+    consumeError(obj.takeError());
+    return 0;
+  }
+
+  return CompileStats::getCodeBytes(**obj);
+}
 
+std::shared_ptr<JITSymbolResolver> JIT::makeResolver() {
   // Build our symbol resolver:
   // Lambda 1: Look back into the JIT itself to find symbols that are part of
   //           the same "logical dylib".
   // Lambda 2: Search for external symbols in the host process.
-  auto resolver = createLambdaResolver(
-    [&](const std::string &name) {
+  return createLambdaResolver(
+    [this](const std::string &name) {
       if (auto sym = indirect_stubs_manager->findStub(name, false)) {
         return sym;
       } else if (auto sym = debug_layer.findSymbol(name, false)) {
@@ -59,14 +182,83 @@ JIT::ModuleHandle JIT::addModule(std::shared_ptr<Module> module) {
         return JITSymbol(sym_addr, JITSymbolFlags::Exported);
       return JITSymbol(nullptr);
     }); 
+}
+
+JIT::ModuleHandle JIT::addModule(std::shared_ptr<Module> module) {
+  assert(module->getDataLayout() == data_layout);
 
   // Add the set to the JIT with the resolver we created above and a newly
-  // return created SectionMemoryManager.
-  ModuleHandle handle = cantFail(debug_layer.addModule(std::move(module), std::move(resolver)));
+  // created PooledMemoryManager.
+  ModuleHandle handle = cantFail(debug_layer.addModule(std::move(module), makeResolver()));
 
   return handle;
 }
 
+/* Loads an already compiled object straight into the object layer, skipping
+ * module generation, optimization and codegen */
+bool JIT::addObject(const std::vector<std::string> &names, std::unique_ptr<MemoryBuffer> buffer)
+{
+  auto obj = object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+  if (!obj) {
+    logAllUnhandledErrors(obj.takeError(), errs(), "Error loading cached object: ");
+    return false;
+  }
+
+  auto owning_obj =
+    std::make_shared<object::OwningBinary<object::ObjectFile>>(std::move(*obj), std::move(buffer));
+  ModuleHandle handle = cantFail(object_layer.addObject(std::move(owning_obj), makeResolver()));
+  for (const std::string &name : names) {
+    live_modules[name] = handle;
+  }
+
+  return true;
+}
+
+std::shared_ptr<Module> LinkModules(const std::string &name,
+                                    const std::vector<std::shared_ptr<Module>> &modules)
+{
+  assert(!modules.empty());
+
+  const Module &first = *modules.front();
+  auto linked = std::make_shared<Module>(name, first.getContext());
+  linked->setDataLayout(first.getDataLayout());
+  linked->setTargetTriple(first.getTargetTriple());
+
+  Linker linker(*linked);
+  for (const std::shared_ptr<Module> &module : modules) {
+    if (linker.linkInModule(CloneModule(module.get()))) {
+      errs() << "Unable to link " << module->getModuleIdentifier() << " into " << name << "\n";
+      return nullptr;
+    }
+  }
+
+  return linked;
+}
+
+/* Bumped whenever codegen changes what it emits for the same definition,
+ * such as the layout of the state, so stale cached objects aren't loaded */
+static const char *CODEGEN_VERSION = "5";
+
+std::string JIT::getObjectKey(const std::string &name, const std::string &cache_key,
+                              const OptimizationOptions &optimization) const
+{
+  MD5 hash;
+  hash.update(name);
+  hash.update(cache_key);
+  hash.update(target_triple);
+  hash.update(target_cpu);
+  hash.update(optimization.getKey());
+  hash.update(LLVM_VERSION_STRING);
+  hash.update(CODEGEN_VERSION);
+
+  MD5::MD5Result result;
+  hash.final(result);
+  SmallString<32> str;
+  MD5::stringifyResult(result, str);
+
+  return str.str();
+}
+
 JITSymbol JIT::findSymbol(const std::string name) {
   if (auto sym = indirect_stubs_manager->findStub(mangle(name), true)) {
     return sym;
@@ -81,7 +273,33 @@ JITTargetAddress JIT::getSymbolAddress(const std::string name) {
   return cantFail(findSymbol(name).getAddress());
 } 
 
+JITTargetAddress JIT::getFunctionAddress(const std::string &name)
+{
+  auto iter = live_modules.find(name);
+  if (iter == live_modules.end()) {
+    return 0;
+  }
+
+  /* Look in the module for name specifically, in case an older copy is still loaded */
+  auto symbol = debug_layer.findSymbolIn(iter->second, mangle(name), false);
+  if (!symbol) {
+    return 0;
+  }
+
+  return cantFail(symbol.getAddress());
+}
+
 void JIT::removeModule(ModuleHandle handle) {
+  for (auto iter = notified_objects.begin(); iter != notified_objects.end(); ++iter) {
+    if (iter->first == handle) {
+      for (JITEventListener *listener : event_listeners) {
+        listener->NotifyFreeingObject(*iter->second->getBinary());
+      }
+      notified_objects.erase(iter);
+      break;
+    }
+  }
+
   cantFail(debug_layer.removeModule(handle));
 }
 
@@ -90,32 +308,41 @@ bool JIT::removeModule(const std::string &name) {
   if (iter == live_modules.end()) {
     return false;
   }
-  removeModule(iter->second);
+  ModuleHandle handle = iter->second;
   live_modules.erase(iter);
+
+  /* Finalized objects are shared by several names */
+  for (const auto &live : live_modules) {
+    if (live.second == handle) {
+      return true;
+    }
+  }
+  removeModule(handle);
   
   return true;
 }
 
+const OptimizationOptions & JIT::getOptimizationOptions(const std::string &name) const
+{
+  auto iter = module_optimizations.find(name);
+  if (iter == module_optimizations.end()) {
+    return default_optimization;
+  }
+
+  return iter->second;
+}
+
+void JIT::setOptimizationOptions(const std::string &name, const OptimizationOptions &optimization)
+{
+  module_optimizations[name] = optimization;
+}
+
 std::shared_ptr<Module> JIT::optimizeModule(std::shared_ptr<Module> module) {
-  // Create a function pass manager.
-  auto fpm = make_unique<legacy::FunctionPassManager>(module.get());
-
-  /* FIXME revisit this */
-  PassManagerBuilder manager_builder;
-  manager_builder.OptLevel = 2;
-  manager_builder.populateFunctionPassManager(*fpm);
-
-  // Add some optimizations.
-  //fpm->add(createInstructionCombiningPass(true));
-  //fpm->add(createReassociatePass());
-  //fpm->add(createGVNPass());
-  //fpm->add(createCFGSimplificationPass());
-  fpm->doInitialization();
-
-  // Run the optimizations over all functions in the module being added to
-  // the JIT.
-  for (auto &fn : *module)
-    fpm->run(fn);
+  auto start = CompileStats::Clock::now();
+  OptimizeModule(*module, getOptimizationOptions(module->getModuleIdentifier()), &target_machine);
+  code_layout.apply(*module);
+  compile_stats.recordOptimize(module->getModuleIdentifier(), CompileStats::getElapsedMS(start),
+                               CompileStats::countInstructions(*module));
 
   return module;
 }
@@ -149,10 +376,9 @@ std::string JIT::mangle(const std::string name) {
 
 JITTargetAddress JIT::updateStub(const std::string &name)
 {
-  auto symbol = debug_layer.findSymbol(mangle(name), false);
-  assert(symbol && "Couldn't find compiled function?");
+  JITTargetAddress addr = getFunctionAddress(name);
+  assert(addr && "Couldn't find compiled function?");
 
-  JITTargetAddress addr = cantFail(symbol.getAddress());
   if (auto err = indirect_stubs_manager->updatePointer(mangle(name), addr)) {
     logAllUnhandledErrors(std::move(err), errs(),
                           "Error updating function pointer: ");
@@ -162,31 +388,272 @@ JITTargetAddress JIT::updateStub(const std::string &name)
 }
 
 void JIT::addLazyFunction(const std::string &name,
-                          std::function<std::shared_ptr<Module>()> module_generator)
+                          std::function<std::shared_ptr<Module>()> module_generator,
+                          const std::string &cache_key)
+{
+  addLazyUnit(name, { name }, std::move(module_generator), cache_key);
+}
+
+void JIT::addLazyBundle(const std::string &bundle_name, const std::vector<std::string> &names,
+                        const std::vector<ModuleGenerator> &generators,
+                        const std::string &cache_key)
 {
-  auto compile_callback = compile_callback_manager->getCompileCallback();
-  JITTargetAddress callback_address = compile_callback.getAddress();
+  addLazyUnit(bundle_name, names, [bundle_name, generators]() {
+    std::vector<std::shared_ptr<Module>> modules;
+    for (const ModuleGenerator &generator : generators) {
+      modules.push_back(generator());
+    }
+
+    return LinkModules(bundle_name, modules);
+  }, cache_key);
+}
 
+/* Every name gets its own callback, since the callback has to return the
+ * address of the function that was called, but they all compile the same
+ * unit. The first one to run releases the others. */
+void JIT::addLazyUnit(const std::string &unit_name, const std::vector<std::string> &names,
+                      ModuleGenerator module_generator, const std::string &cache_key)
+{
+  module_generators[unit_name] = module_generator;
+
+  for (const std::string &name : names) {
+    auto compile_callback = compile_callback_manager->getCompileCallback();
+    JITTargetAddress callback_address = compile_callback.getAddress();
+
+    releasePendingCallback(name);
+    pending_callbacks[name] = callback_address;
+    module_units[name] = unit_name;
+
+    // Support redefining an existing stub
+    if (indirect_stubs_manager->findStub(mangle(name), true)) {
+      cantFail(indirect_stubs_manager->updatePointer(mangle(name), callback_address));
+    } else {
+      cantFail(indirect_stubs_manager->createStub(mangle(name),
+                                                  callback_address,
+                                                  JITSymbolFlags::Exported));
+    }
+
+    compile_callback.setCompileAction([this, unit_name, names, name, module_generator, cache_key, callback_address]() {
+      /* Debug transforms change the generated code, so those modules bypass the cache */
+      auto debug_iter = debug_functions.find(unit_name);
+      bool cacheable = object_cache && !cache_key.empty() &&
+                       (debug_iter == debug_functions.end() || debug_iter->second.empty());
+
+      std::string object_key;
+      bool loaded = false;
+      if (cacheable) {
+        object_key = getObjectKey(unit_name, cache_key, getOptimizationOptions(unit_name));
+        if (auto cached = object_cache->getObject(object_key)) {
+          uint64_t code_bytes = getObjectCodeBytes(*cached);
+          loaded = addObject(names, std::move(cached));
+          if (loaded) {
+            compile_stats.recordCacheHit(unit_name, code_bytes);
+          }
+        }
+      }
 
-  // Support redefining an existing stub
-  if (indirect_stubs_manager->findStub(mangle(name), true)) {
-    cantFail(indirect_stubs_manager->updatePointer(mangle(name), callback_address));
-  } else {
-    cantFail(indirect_stubs_manager->createStub(mangle(name),
-                                                callback_address,
-                                                JITSymbolFlags::Exported));
+      if (!loaded) {
+        auto gen_start = CompileStats::Clock::now();
+        auto module = module_generator();
+        compile_stats.recordGenerate(module->getModuleIdentifier(), CompileStats::getElapsedMS(gen_start));
+        if (cacheable) {
+          object_cache->setModuleKey(module->getModuleIdentifier(), object_key);
+        }
+        auto compiled_handle = addModule(module);
+        for (const std::string &unit_member : names) {
+          live_modules[unit_member] = compiled_handle;
+        }
+      }
+
+      /* This callback was already released by the callback manager */
+      callback_addrs.erase(callback_address);
+      pending_callbacks.erase(name);
+
+      for (const std::string &unit_member : names) {
+        if (unit_member != name) {
+          releasePendingCallback(unit_member);
+          updateStub(unit_member);
+        }
+      }
+
+      return updateStub(name);
+    });
+    callback_addrs.insert(callback_address);
+  }
+}
+
+std::unique_ptr<MemoryBuffer> JIT::compileObject(const std::string &name,
+                                                 const OptimizationOptions &optimization,
+                                                 TargetMachine &object_target_machine,
+                                                 std::function<std::shared_ptr<Module>()> module_generator,
+                                                 const std::string &cache_key)
+{
+  std::string object_key;
+  if (object_cache && !cache_key.empty()) {
+    object_key = getObjectKey(name, cache_key, optimization);
+    if (auto cached = object_cache->getObject(object_key)) {
+      compile_stats.recordCacheHit(name, getObjectCodeBytes(*cached));
+      return cached;
+    }
+  }
+
+  auto start = CompileStats::Clock::now();
+  std::shared_ptr<Module> module = module_generator();
+  compile_stats.recordGenerate(module->getModuleIdentifier(), CompileStats::getElapsedMS(start));
+  if (!object_key.empty()) {
+    object_cache->setModuleKey(module->getModuleIdentifier(), object_key);
+  }
+
+  start = CompileStats::Clock::now();
+  OptimizeModule(*module, optimization, &object_target_machine);
+  code_layout.apply(*module);
+  compile_stats.recordOptimize(module->getModuleIdentifier(), CompileStats::getElapsedMS(start),
+                               CompileStats::countInstructions(*module));
+
+  TimedCompiler compiler(object_target_machine, object_cache.get(), compile_stats);
+  auto obj = compiler(*module);
+
+  return obj.takeBinary().second;
+}
+
+void JIT::addCompiledFunction(const std::string &name, std::unique_ptr<MemoryBuffer> buffer)
+{
+  addCompiledBundle({ name }, std::move(buffer));
+}
+
+void JIT::addCompiledBundle(const std::vector<std::string> &names, std::unique_ptr<MemoryBuffer> buffer)
+{
+  if (!buffer) {
+    /* Leave the lazy compile in place so it can still be generated on demand */
+    return;
   }
 
-  compile_callback.setCompileAction([this, name, module_generator, callback_address]() {
-    auto module = module_generator();
-    auto compiled_handle = addModule(module);
-    live_modules[name] = compiled_handle;
+  std::vector<ModuleHandle> old_handles;
+  for (const std::string &name : names) {
+    auto old_module = live_modules.find(name);
+    if (old_module != live_modules.end() &&
+        std::find(old_handles.begin(), old_handles.end(), old_module->second) == old_handles.end()) {
+      old_handles.push_back(old_module->second);
+    }
+  }
+
+  if (!addObject(names, std::move(buffer))) {
+    return;
+  }
+
+  for (const std::string &name : names) {
+    releasePendingCallback(name);
+    updateStub(name);
+  }
+
+  removeUnusedModules(old_handles);
+}
+
+void JIT::releasePendingCallback(const std::string &name)
+{
+  auto pending = pending_callbacks.find(name);
+  if (pending == pending_callbacks.end()) {
+    return;
+  }
+
+  callback_addrs.erase(pending->second);
+  compile_callback_manager->releaseCompileCallback(pending->second);
+  pending_callbacks.erase(pending);
+}
+
+/* Unloads any of handles that no name refers to anymore */
+void JIT::removeUnusedModules(const std::vector<ModuleHandle> &handles)
+{
+  for (ModuleHandle handle : handles) {
+    bool still_live = false;
+    for (const auto &live : live_modules) {
+      still_live = still_live || live.second == handle;
+    }
+
+    if (!still_live) {
+      removeModule(handle);
+    }
+  }
+}
+
+bool JIT::finalize(const std::vector<std::string> &names)
+{
+  /* Each unit is optimized with its own options before linking, the
+   * default options then decide whether calls are inlined across them */
+  std::vector<std::string> units;
+  for (const std::string &name : names) {
+    auto unit = module_units.find(name);
+    if (unit == module_units.end()) {
+      errs() << "Can't finalize " << name << ", it was never added\n";
+      return false;
+    }
+
+    if (std::find(units.begin(), units.end(), unit->second) == units.end()) {
+      units.push_back(unit->second);
+    }
+  }
+
+  /* Stats for the whole relink are recorded under the linked module */
+  double generate_ms = 0;
+  double optimize_ms = 0;
+  std::vector<std::shared_ptr<Module>> modules;
+  for (const std::string &unit : units) {
+    auto start = CompileStats::Clock::now();
+    std::shared_ptr<Module> module = module_generators[unit]();
+    generate_ms += CompileStats::getElapsedMS(start);
+
+    start = CompileStats::Clock::now();
+    OptimizeModule(*module, getOptimizationOptions(unit), &target_machine);
+    optimize_ms += CompileStats::getElapsedMS(start);
+    modules.push_back(module);
+  }
+
+  if (modules.empty()) {
+    return false;
+  }
+
+  std::shared_ptr<Module> linked = LinkModules("finalized", modules);
+  if (!linked) {
+    return false;
+  }
 
-    callback_addrs.erase(callback_address);
+  auto start = CompileStats::Clock::now();
+  if (default_optimization.module_passes) {
+    OptimizeModule(*linked, default_optimization, &target_machine);
+  }
+  /* Linking concatenates the units, so this is what packs the hot bodies
+   * of the whole design together */
+  code_layout.apply(*linked);
+  optimize_ms += CompileStats::getElapsedMS(start);
+
+  compile_stats.recordGenerate(linked->getModuleIdentifier(), generate_ms);
+  compile_stats.recordOptimize(linked->getModuleIdentifier(), optimize_ms,
+                               CompileStats::countInstructions(*linked));
+
+  TimedCompiler compiler(target_machine, nullptr, compile_stats);
+  auto obj = compiler(*linked);
+
+  std::vector<ModuleHandle> old_handles;
+  for (const std::string &name : names) {
+    auto old_module = live_modules.find(name);
+    if (old_module != live_modules.end() &&
+        std::find(old_handles.begin(), old_handles.end(), old_module->second) == old_handles.end()) {
+      old_handles.push_back(old_module->second);
+    }
+  }
+
+  if (!addObject(names, obj.takeBinary().second)) {
+    return false;
+  }
 
-    return updateStub(name);
-  });
-  callback_addrs.insert(callback_address);
+  for (const std::string &name : names) {
+    releasePendingCallback(name);
+    updateStub(name);
+  }
+
+  removeUnusedModules(old_handles);
+
+  return true;
 }
 
 std::deque<JIT::TransformFunction>::iterator JIT::addDebugTransform(const std::string &name,
@@ -206,7 +673,10 @@ void JIT::precompileIR()
 {
   std::unordered_set<JITTargetAddress> addrs_cpy(callback_addrs);
   for (const JITTargetAddress &addr : addrs_cpy) {
-    compile_callback_manager->executeCompileCallback(addr);
+    /* Compiling a bundle releases the callbacks for the rest of it */
+    if (callback_addrs.count(addr)) {
+      compile_callback_manager->executeCompileCallback(addr);
+    }
   }
 }
 
@@ -0,0 +1,491 @@
+#include <jitsim/aot.hpp>
+#include <jitsim/circuit_llvm.hpp>
+#include <jitsim/optimize.hpp>
+#include "llvm_utils.hpp"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+namespace JITSim {
+
+using namespace llvm;
+
+/* Feature checks for the CPUs that can be used as variants, newest first.
+ * A variant is compiled for exactly these features rather than the whole
+ * -mcpu set, so a CPU passing the checks can run it. Features llvm implies
+ * from them (sse levels, f16c from avx512f) are older or only used for
+ * floating point, which the design never has. */
+static const std::vector<CPUVariant> KNOWN_VARIANTS = {
+  { "skylake-avx512", { "avx512f", "avx512bw", "avx512dq", "avx512vl", "avx2", "fma", "bmi", "bmi2", "popcnt" } },
+  { "haswell", { "avx2", "fma", "bmi", "bmi2", "popcnt" } },
+  { "sandybridge", { "avx", "popcnt" } },
+  { "nehalem", { "sse4.2", "popcnt" } }
+};
+
+bool GetCPUVariant(const std::string &name, CPUVariant &variant)
+{
+  for (const CPUVariant &known : KNOWN_VARIANTS) {
+    if (known.cpu == name) {
+      variant = known;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* The library is loaded at an arbitrary address on another machine, so it
+ * needs position independent code */
+static TargetMachine * createLibraryTargetMachine(unsigned opt_level, const std::string &cpu = "generic",
+                                                  const std::string &features = "")
+{
+  std::string triple = sys::getProcessTriple();
+  std::string err;
+  const Target *target = TargetRegistry::lookupTarget(triple, err);
+  if (!target) {
+    errs() << "Unable to find target for " << triple << ": " << err << "\n";
+    return nullptr;
+  }
+
+  CodeGenOpt::Level cg_opt_level = static_cast<CodeGenOpt::Level>(std::min(opt_level, 3u));
+
+  return target->createTargetMachine(triple, cpu, features, TargetOptions(),
+                                     Optional<Reloc::Model>(Reloc::PIC_),
+                                     CodeModel::Default, cg_opt_level);
+}
+
+/* The -mattr string enabling only the features a variant checks for */
+static std::string getVariantFeatures(const CPUVariant &variant)
+{
+  std::string features;
+  for (const std::string &feature : variant.required) {
+    if (!features.empty()) {
+      features += ",";
+    }
+    features += "+" + feature;
+  }
+
+  return features;
+}
+
+static std::string getCName(const std::string &name)
+{
+  std::string c_name = name;
+  for (char &c : c_name) {
+    if (!isalnum(c)) {
+      c = '_';
+    }
+  }
+
+  if (c_name.empty() || isdigit(c_name[0])) {
+    c_name = "_" + c_name;
+  }
+
+  return c_name;
+}
+
+AOTCompiler::AOTCompiler(const Circuit &circuit_, const AOTOptions &options_)
+  : target_machine(createLibraryTargetMachine(options_.optimization.opt_level)),
+    data_layout(target_machine->createDataLayout()),
+    builder(data_layout, *target_machine),
+    circuit(circuit_),
+    top(circuit_.getTopDefinition()),
+    options(options_)
+{
+}
+
+/* Links the update_state and compute_output functions of every definition
+ * together with the top level wrappers */
+std::unique_ptr<Module> AOTCompiler::linkDesign()
+{
+  std::vector<std::shared_ptr<Module>> modules;
+  for (const Definition &defn : circuit.getDefinitions()) {
+    if (defn.getSimInfo().isPrimitive()) {
+      continue;
+    }
+
+    modules.push_back(MakeUpdateState(builder, defn).getModule());
+    modules.push_back(MakeComputeOutput(builder, defn).getModule());
+  }
+  modules.push_back(MakeComputeOutputWrapper(builder, top).getModule());
+  modules.push_back(MakeUpdateStateWrapper(builder, top).getModule());
+
+  auto design = llvm::make_unique<Module>(top.getSafeName(), builder.getContext());
+  design->setDataLayout(data_layout);
+  design->setTargetTriple(target_machine->getTargetTriple().getTriple());
+
+  Linker linker(*design);
+  for (const auto &module : modules) {
+    if (linker.linkInModule(CloneModule(module.get()))) {
+      errs() << "Unable to link " << module->getName() << " into " << top.getName() << "\n";
+      return nullptr;
+    }
+  }
+
+  /* Only the wrappers are part of the library's interface */
+  for (Function &fn : *design) {
+    if (fn.isDeclaration() || fn.getName() == "compute_output" || fn.getName() == "update_state") {
+      continue;
+    }
+    fn.setLinkage(GlobalValue::InternalLinkage);
+  }
+
+  return design;
+}
+
+/* Exports a table of { name, byte offset, width } for the members of the
+ * struct built from members, so the runtime can find ports by name */
+template <typename T>
+static void addPortTable(Module &module, const std::string &prefix, const std::vector<T> &members,
+                         const DataLayout &data_layout)
+{
+  LLVMContext &context = module.getContext();
+  StructType *type = ConstructStructType(members, context);
+  const StructLayout *layout = data_layout.getStructLayout(type);
+
+  Type *i8_ptr = Type::getInt8PtrTy(context);
+  Type *i32 = Type::getInt32Ty(context);
+  Type *i64 = Type::getInt64Ty(context);
+  StructType *port_type = StructType::get(i8_ptr, i32, i32);
+
+  std::vector<Constant *> ports;
+  for (unsigned i = 0; i < members.size(); i++) {
+    const auto &m = condDeref(members[i]);
+
+    Constant *name = ConstantDataArray::getString(context, m.getName());
+    GlobalVariable *name_var = new GlobalVariable(module, name->getType(), true,
+                                                  GlobalValue::PrivateLinkage, name,
+                                                  prefix + "_name");
+
+    ports.push_back(ConstantStruct::get(port_type, {
+      ConstantExpr::getPointerCast(name_var, i8_ptr),
+      ConstantInt::get(i32, layout->getElementOffset(i)),
+      ConstantInt::get(i32, m.getWidth())
+    }));
+  }
+
+  ArrayType *table_type = ArrayType::get(port_type, ports.size());
+  new GlobalVariable(module, table_type, true, GlobalValue::ExternalLinkage,
+                     ConstantArray::get(table_type, ports), "jitsim_" + prefix + "_ports");
+  new GlobalVariable(module, i32, true, GlobalValue::ExternalLinkage,
+                     ConstantInt::get(i32, ports.size()), "jitsim_" + prefix + "_num_ports");
+  new GlobalVariable(module, i64, true, GlobalValue::ExternalLinkage,
+                     ConstantInt::get(i64, layout->getSizeInBytes()), "jitsim_" + prefix + "_size");
+}
+
+void AOTCompiler::addMetadata(Module &module)
+{
+  const SimInfo &sim_info = top.getSimInfo();
+  Type *i64 = Type::getInt64Ty(module.getContext());
+
+  new GlobalVariable(module, i64, true, GlobalValue::ExternalLinkage,
+                     ConstantInt::get(i64, sim_info.getNumStateBytes()), "jitsim_state_size");
+
+  addPortTable(module, "compute_output_inputs", sim_info.getOutputSources(), data_layout);
+  addPortTable(module, "compute_output_outputs", top.getIFace().getSinks(), data_layout);
+  addPortTable(module, "update_state_inputs", sim_info.getStateSources(), data_layout);
+}
+
+void AOTCompiler::optimize(Module &module, TargetMachine &machine)
+{
+  /* Everything but the wrappers is internal, so the whole design can be
+   * inlined into them */
+  OptimizationOptions optimization = options.optimization;
+  optimization.module_passes = true;
+
+  OptimizeModule(module, optimization, &machine);
+}
+
+bool AOTCompiler::emitObject(Module &module, TargetMachine &machine, const std::string &obj_path)
+{
+  std::error_code ec;
+  raw_fd_ostream out(obj_path, ec, sys::fs::F_None);
+  if (ec) {
+    errs() << "Unable to open " << obj_path << ": " << ec.message() << "\n";
+    return false;
+  }
+
+  legacy::PassManager pm;
+  if (machine.addPassesToEmitFile(pm, out, TargetMachine::CGFT_ObjectFile)) {
+    errs() << "Target can't emit object files\n";
+    return false;
+  }
+
+  pm.run(module);
+  out.flush();
+
+  return true;
+}
+
+static bool createTemporary(const std::string &prefix, const std::string &suffix,
+                            std::vector<std::string> &inputs)
+{
+  SmallString<128> tmp_path;
+  if (auto ec = sys::fs::createTemporaryFile(prefix, suffix, tmp_path)) {
+    errs() << "Unable to create temporary file: " << ec.message() << "\n";
+    return false;
+  }
+  inputs.emplace_back(tmp_path.begin(), tmp_path.end());
+
+  return true;
+}
+
+/* Optimizes and compiles module for machine, adding the object to inputs */
+bool AOTCompiler::compileObject(Module &module, TargetMachine &machine, std::vector<std::string> &inputs)
+{
+  optimize(module, machine);
+
+  if (verifyModule(module, &errs())) {
+    errs() << "Linked design has errors\n";
+    return false;
+  }
+
+  if (!createTemporary("jitsim-" + top.getSafeName(), "o", inputs)) {
+    return false;
+  }
+
+  return emitObject(module, machine, inputs.back());
+}
+
+/* Each variant's wrappers are renamed with the CPU as a suffix, this picks
+ * the best one the machine supports when the library is loaded */
+bool AOTCompiler::writeDispatcher(std::vector<std::string> &inputs)
+{
+  if (!createTemporary("jitsim-dispatch", "c", inputs)) {
+    return false;
+  }
+
+  std::ofstream out(inputs.back());
+  out << "/* Generated by jitsim, picks the best compute_output/update_state for this CPU */\n\n";
+  out << "#include <stdint.h>\n\n";
+  out << "typedef void (*compute_output_fn)(const void *, void *, uint8_t *);\n";
+  out << "typedef void (*update_state_fn)(const void *, uint8_t *);\n\n";
+
+  std::vector<std::string> suffixes = { "generic" };
+  for (const CPUVariant &variant : options.cpu_variants) {
+    suffixes.push_back(getCName(variant.cpu));
+  }
+  for (const std::string &suffix : suffixes) {
+    out << "void compute_output_" << suffix << "(const void *, void *, uint8_t *);\n";
+    out << "void update_state_" << suffix << "(const void *, uint8_t *);\n";
+  }
+
+  out << "\nstatic compute_output_fn compute_output_impl = compute_output_generic;\n";
+  out << "static update_state_fn update_state_impl = update_state_generic;\n\n";
+
+  out << "__attribute__((constructor)) static void select_variant(void)\n";
+  out << "{\n";
+  out << "  __builtin_cpu_init();\n";
+  for (const CPUVariant &variant : options.cpu_variants) {
+    out << "  if (1";
+    for (const std::string &feature : variant.required) {
+      out << " && __builtin_cpu_supports(\"" << feature << "\")";
+    }
+    out << ") {\n";
+    out << "    compute_output_impl = compute_output_" << getCName(variant.cpu) << ";\n";
+    out << "    update_state_impl = update_state_" << getCName(variant.cpu) << ";\n";
+    out << "    return;\n";
+    out << "  }\n";
+  }
+  out << "}\n\n";
+
+  out << "void compute_output(const void *inputs, void *outputs, uint8_t *state)\n";
+  out << "{\n";
+  out << "  compute_output_impl(inputs, outputs, state);\n";
+  out << "}\n\n";
+  out << "void update_state(const void *inputs, uint8_t *state)\n";
+  out << "{\n";
+  out << "  update_state_impl(inputs, state);\n";
+  out << "}\n";
+
+  return !!out;
+}
+
+bool AOTCompiler::linkLibrary(const std::vector<std::string> &inputs, const std::string &lib_path)
+{
+  auto linker_path = sys::findProgramByName(options.linker);
+  if (!linker_path) {
+    errs() << "Unable to find linker " << options.linker << "\n";
+    return false;
+  }
+
+  std::vector<const char *> args = { linker_path->c_str(), "-O2", "-fPIC", "-shared", "-o", lib_path.c_str() };
+  for (const std::string &input : inputs) {
+    args.push_back(input.c_str());
+  }
+  args.push_back(nullptr);
+
+  std::string err;
+  int ret = sys::ExecuteAndWait(*linker_path, args.data(), nullptr, nullptr, 0, 0, &err);
+  if (ret != 0) {
+    errs() << "Linking " << lib_path << " failed: " << err << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Writes a packed C struct with explicit padding, so the layout matches the
+ * LLVM struct regardless of the C compiler's own rules */
+template <typename T>
+static void writeStruct(std::ostream &out, const std::string &struct_name, const std::vector<T> &members,
+                        const DataLayout &data_layout, LLVMContext &context)
+{
+  StructType *type = ConstructStructType(members, context);
+  const StructLayout *layout = data_layout.getStructLayout(type);
+
+  out << "struct " << struct_name << " {\n";
+
+  uint64_t pos = 0;
+  unsigned num_pads = 0;
+  for (unsigned i = 0; i < members.size(); i++) {
+    const auto &m = condDeref(members[i]);
+    uint64_t offset = layout->getElementOffset(i);
+    if (offset > pos) {
+      out << "  uint8_t _pad" << num_pads++ << "[" << offset - pos << "];\n";
+    }
+
+    Type *elem_type = type->getElementType(i);
+    uint64_t store_size = data_layout.getTypeStoreSize(elem_type);
+    uint64_t alloc_size = data_layout.getTypeAllocSize(elem_type);
+
+    std::string name = getCName(m.getName());
+    if (store_size == alloc_size && (store_size == 1 || store_size == 2 || store_size == 4 || store_size == 8)) {
+      out << "  uint" << store_size * 8 << "_t " << name << ";";
+    } else {
+      out << "  uint8_t " << name << "[" << alloc_size << "];";
+    }
+    out << " /* " << m.getWidth() << " bits */\n";
+
+    pos = offset + alloc_size;
+  }
+
+  if (layout->getSizeInBytes() > pos) {
+    out << "  uint8_t _pad" << num_pads++ << "[" << layout->getSizeInBytes() - pos << "];\n";
+  }
+
+  /* C doesn't allow empty structs, the generated code never reads this */
+  if (members.empty()) {
+    out << "  uint8_t _empty;\n";
+  }
+
+  out << "} __attribute__((packed));\n\n";
+}
+
+std::string AOTCompiler::makeHeader()
+{
+  const SimInfo &sim_info = top.getSimInfo();
+  std::string name = getCName(top.getSafeName());
+  std::string guard = name;
+  std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+
+  std::ostringstream out;
+  out << "/* Generated by jitsim for " << top.getName() << ", do not edit */\n\n";
+  out << "#ifndef JITSIM_" << guard << "_H\n";
+  out << "#define JITSIM_" << guard << "_H\n\n";
+  out << "#include <stdint.h>\n\n";
+  out << "#ifdef __cplusplus\n";
+  out << "extern \"C\" {\n";
+  out << "#endif\n\n";
+
+  out << "#define " << guard << "_STATE_SIZE " << sim_info.getNumStateBytes() << "\n";
+  out << "/* The state buffer must be aligned to at least this */\n";
+  out << "#define " << guard << "_STATE_ALIGN " << sim_info.getStateAlign() << "\n\n";
+
+  LLVMContext &context = builder.getContext();
+  writeStruct(out, name + "_compute_output_inputs", sim_info.getOutputSources(), data_layout, context);
+  writeStruct(out, name + "_compute_output_outputs", top.getIFace().getSinks(), data_layout, context);
+  writeStruct(out, name + "_update_state_inputs", sim_info.getStateSources(), data_layout, context);
+
+  out << "void compute_output(const struct " << name << "_compute_output_inputs *inputs,\n"
+      << "                    struct " << name << "_compute_output_outputs *outputs,\n"
+      << "                    uint8_t *state);\n";
+  out << "void update_state(const struct " << name << "_update_state_inputs *inputs,\n"
+      << "                  uint8_t *state);\n\n";
+
+  out << "struct jitsim_port {\n"
+      << "  const char *name;\n"
+      << "  uint32_t offset;\n"
+      << "  uint32_t width;\n"
+      << "};\n\n";
+
+  out << "extern const uint64_t jitsim_state_size;\n";
+  for (const std::string prefix : { "compute_output_inputs", "compute_output_outputs", "update_state_inputs" }) {
+    out << "extern const struct jitsim_port jitsim_" << prefix << "_ports[];\n";
+    out << "extern const uint32_t jitsim_" << prefix << "_num_ports;\n";
+    out << "extern const uint64_t jitsim_" << prefix << "_size;\n";
+  }
+
+  out << "\n#ifdef __cplusplus\n";
+  out << "}\n";
+  out << "#endif\n\n";
+  out << "#endif\n";
+
+  return out.str();
+}
+
+static void renameEntryPoints(Module &module, const std::string &suffix)
+{
+  for (const std::string name : { "compute_output", "update_state" }) {
+    module.getFunction(name)->setName(name + "_" + suffix);
+  }
+}
+
+bool AOTCompiler::exportLibrary(const std::string &lib_path, const std::string &header_path)
+{
+  std::unique_ptr<Module> design = linkDesign();
+  if (!design) {
+    return false;
+  }
+
+  std::vector<std::string> inputs;
+  bool compiled = true;
+  for (const CPUVariant &variant : options.cpu_variants) {
+    std::unique_ptr<TargetMachine> variant_machine(
+      createLibraryTargetMachine(options.optimization.opt_level, "x86-64", getVariantFeatures(variant)));
+    std::unique_ptr<Module> variant_design = CloneModule(design.get());
+    renameEntryPoints(*variant_design, getCName(variant.cpu));
+
+    compiled = compiled && variant_machine && compileObject(*variant_design, *variant_machine, inputs);
+  }
+
+  if (!options.cpu_variants.empty()) {
+    renameEntryPoints(*design, "generic");
+    compiled = compiled && writeDispatcher(inputs);
+  }
+
+  /* The metadata is only needed once, so it goes in the baseline object */
+  addMetadata(*design);
+  compiled = compiled && compileObject(*design, *target_machine, inputs);
+
+  bool linked = compiled && linkLibrary(inputs, lib_path);
+  for (const std::string &input : inputs) {
+    sys::fs::remove(input);
+  }
+  if (!linked) {
+    return false;
+  }
+
+  std::ofstream header(header_path);
+  header << makeHeader();
+
+  return !!header;
+}
+
+}
@@ -1,5 +1,10 @@
 #include <jitsim/builder.hpp>
 
+#include <llvm/BinaryFormat/Dwarf.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+
+#include <algorithm>
 #include <iostream>
 
 extern "C" {
@@ -12,21 +17,161 @@ namespace JITSim {
 
 using namespace llvm;
 
+ModuleEnvironment::ModuleEnvironment(std::unique_ptr<Module> &&module_, LLVMContext *context_,
+                                     const CodegenOptions *options_, unsigned lanes_)
+  : module(move(module_)), context(context_), options(options_), lanes(lanes_),
+    di_builder(std::make_unique<DIBuilder>(*module)), di_unit(nullptr)
+{
+  if (options->debug_info) {
+    module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+    DIFile *file = di_builder->createFile(module->getName(), options->debug_dir);
+    di_unit = di_builder->createCompileUnit(dwarf::DW_LANG_C, file, "jitsim", true, "", 0);
+  }
+}
+
 FunctionEnvironment::FunctionEnvironment(Function *func_, ModuleEnvironment *parent_)
-  : func(func_), parent(parent_), context(&parent->getContext()), ir_builder(*context)
+  : func(func_), parent(parent_), context(&parent->getContext()), ir_builder(*context),
+    next_profile_site(0), di_subprogram(nullptr)
 {
 }
 
+void FunctionEnvironment::attachDebugInfo(const std::string &source_name)
+{
+  DICompileUnit *unit = parent->getDebugUnit();
+  if (!unit) {
+    return;
+  }
+
+  DIBuilder &di_builder = getDIBuilder();
+  DIFile *file = di_builder.createFile(source_name, unit->getDirectory());
+  DISubroutineType *type = di_builder.createSubroutineType(di_builder.getOrCreateTypeArray(None));
+  di_subprogram = di_builder.createFunction(file, func->getName(), func->getName(), file, 1, type,
+                                            false, true, 1, DINode::FlagZero, true);
+  func->setSubprogram(di_subprogram);
+  /* No variables are described, so the subprogram is already complete */
+  di_builder.finalizeSubprogram(di_subprogram);
+
+  setDebugLine(1);
+}
+
+void FunctionEnvironment::setDebugLine(unsigned line)
+{
+  if (di_subprogram) {
+    ir_builder.SetCurrentDebugLocation(DebugLoc::get(line, 0, di_subprogram));
+  }
+}
+
 BasicBlock * FunctionEnvironment::addBasicBlock(const std::string &name, bool setEntry)
 {
+  bool is_entry = func->empty();
+
   BasicBlock *bb = BasicBlock::Create(*context, name, func);
   if (setEntry) {
     ir_builder.SetInsertPoint(bb);
   }
 
+  if (is_entry) {
+    profileEntry(bb);
+  }
+
   return bb;
 }
 
+Value * FunctionEnvironment::getCounterAddr(uint64_t *counter)
+{
+  Type *count_type = Type::getInt64Ty(*context);
+  return Constant::getIntegerValue(count_type->getPointerTo(), APInt(64, (uint64_t)counter));
+}
+
+void FunctionEnvironment::profileEntry(BasicBlock *entry)
+{
+  const CodegenOptions &options = parent->getCodegenOptions();
+  if (options.profile_mode == ProfileMode::Instrument) {
+    IRBuilder<> entry_builder(entry);
+    Value *addr = getCounterAddr(options.profile->getEntryCounter(func->getName().str()));
+    Value *count = entry_builder.CreateLoad(addr, "entry_count");
+    count = entry_builder.CreateAdd(count, ConstantInt::get(Type::getInt64Ty(*context), 1));
+    entry_builder.CreateStore(count, addr);
+  } else if (options.profile_mode == ProfileMode::Use) {
+    uint64_t count;
+    if (options.profile->getEntryCount(func->getName().str(), count)) {
+      func->setEntryCount(count);
+    }
+  }
+}
+
+/* Returns the branch weights to attach to the branch on cond, if any */
+MDNode * FunctionEnvironment::profileSite(Value *cond)
+{
+  const CodegenOptions &options = parent->getCodegenOptions();
+  if (options.profile_mode == ProfileMode::None) {
+    return nullptr;
+  }
+
+  unsigned site = next_profile_site++;
+
+  if (options.profile_mode == ProfileMode::Instrument) {
+    /* counters[cond] += 1 */
+    Type *count_type = Type::getInt64Ty(*context);
+    Value *counters = getCounterAddr(options.profile->getSiteCounters(func->getName().str(), site));
+    Value *idx = ir_builder.CreateZExt(cond, count_type);
+    Value *addr = ir_builder.CreateInBoundsGEP(counters, idx, "site_addr");
+    Value *count = ir_builder.CreateLoad(addr, "site_count");
+    count = ir_builder.CreateAdd(count, ConstantInt::get(count_type, 1));
+    ir_builder.CreateStore(count, addr);
+
+    return nullptr;
+  }
+
+  uint64_t false_count, true_count;
+  if (!options.profile->getSiteCounts(func->getName().str(), site, false_count, true_count) ||
+      false_count + true_count == 0) {
+    return nullptr;
+  }
+
+  /* Weights are 32 bit. Scale both down together to keep the ratio, and
+   * keep them non zero so a branch never seen in training isn't treated
+   * as unreachable. */
+  while (std::max(false_count, true_count) >= UINT32_MAX) {
+    false_count >>= 1;
+    true_count >>= 1;
+  }
+
+  return MDBuilder(*context).createBranchWeights(true_count + 1, false_count + 1);
+}
+
+BranchInst * FunctionEnvironment::createCondBr(Value *cond, BasicBlock *true_bb, BasicBlock *false_bb,
+                                               BranchHint hint)
+{
+  MDNode *weights = profileSite(cond);
+  /* Same weights as __builtin_expect */
+  if (!weights && hint == BranchHint::Likely) {
+    weights = MDBuilder(*context).createBranchWeights(2000, 1);
+  } else if (!weights && hint == BranchHint::Unlikely) {
+    weights = MDBuilder(*context).createBranchWeights(1, 2000);
+  }
+
+  return ir_builder.CreateCondBr(cond, true_bb, false_bb, weights);
+}
+
+Value * FunctionEnvironment::createSelect(Value *cond, Value *true_val, Value *false_val, const Twine &name)
+{
+  /* Lanes go their own ways, there is no single branch to count */
+  if (cond->getType()->isVectorTy()) {
+    return ir_builder.CreateSelect(cond, true_val, false_val, name);
+  }
+
+  MDNode *weights = profileSite(cond);
+  Value *result = ir_builder.CreateSelect(cond, true_val, false_val, name);
+  if (weights) {
+    if (auto *select = dyn_cast<SelectInst>(result)) {
+      select->setMetadata(LLVMContext::MD_prof, weights);
+    }
+  }
+
+  return result;
+}
+
 DIBuilder & FunctionEnvironment::getDIBuilder()
 {
   return parent->getDIBuilder();
@@ -52,6 +197,21 @@ void ModuleEnvironment::addValue(const Sink *key, llvm::Value *val)
   sink_value_lookup[key] = val;
 }
 
+Type * ModuleEnvironment::getValueType(unsigned width)
+{
+  Type *type = Type::getIntNTy(*context, width);
+  if (lanes == 1) {
+    return type;
+  }
+
+  return VectorType::get(type, lanes);
+}
+
+Constant * ModuleEnvironment::getConstant(const APInt &val)
+{
+  return ConstantInt::get(getValueType(val.getBitWidth()), val);
+}
+
 Function * ModuleEnvironment::getFunctionDecl(const std::string &name)
 {
   auto iter = named_functions.find(name);
@@ -87,13 +247,48 @@ std::string ModuleEnvironment::getIRStr() const
   return str;
 }
 
-ModuleEnvironment Builder::makeModule(const std::string &name)
+static bool hasBMI2(const TargetMachine &target_machine)
+{
+  return target_machine.getTargetTriple().getArch() == Triple::x86_64 &&
+         target_machine.getMCSubtargetInfo()->checkFeatures("+bmi2");
+}
+
+/* Narrower signals leave part of each vector unused, wider ones are split
+ * across registers by legalization */
+static unsigned getVectorLanes(const TargetMachine &target_machine)
+{
+  const MCSubtargetInfo *subtarget = target_machine.getMCSubtargetInfo();
+  if (target_machine.getTargetTriple().getArch() != Triple::x86_64) {
+    return 4;
+  } else if (subtarget->checkFeatures("+avx512f")) {
+    return 16;
+  } else if (subtarget->checkFeatures("+avx2")) {
+    return 8;
+  }
+
+  return 4;
+}
+
+Builder::Builder(const DataLayout &dl, const TargetMachine &target_machine, const CodegenOptions &options_)
+  : data_layout(dl), triple(target_machine.getTargetTriple().getTriple()),
+    has_bmi2(hasBMI2(target_machine)), lane_width(getVectorLanes(target_machine)), options()
+{
+  setCodegenOptions(options_);
+}
+
+void Builder::setCodegenOptions(const CodegenOptions &options_)
+{
+  options = options_;
+  options.use_bmi2 = options.use_bmi2 && has_bmi2;
+}
+
+ModuleEnvironment Builder::makeModule(const std::string &name, unsigned lanes)
 {
   std::unique_ptr<Module> module = make_unique<Module>(StringRef(name), context);
   module->setDataLayout(data_layout);
   module->setTargetTriple(triple);
 
-  return ModuleEnvironment(move(module), &context);
+  return ModuleEnvironment(move(module), &context, &options, lanes);
 }
 
 bool FunctionEnvironment::verify() const
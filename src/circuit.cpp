@@ -9,6 +9,8 @@
 #include <numeric>
 
 #include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/MD5.h>
 
 namespace JITSim {
 
@@ -234,6 +236,8 @@ Definition::Definition(const string &name_,
   for (const Instance &inst : instances) {
     instance_lookup[inst.getName()] = &inst;
   }
+
+  calculateStructuralHash();
 }
 
 Definition::Definition(const string &name_,
@@ -246,6 +250,51 @@ Definition::Definition(const string &name_,
     instance_lookup(),
     siminfo(interface, primitive)
 {
+  calculateStructuralHash();
+}
+
+static void hashIFace(llvm::MD5 &hash, const IFace &iface)
+{
+  hash.update(iface.getName());
+  for (const Source &src : iface.getSources()) {
+    hash.update("src:" + src.getName() + ":" + to_string(src.getWidth()) + ";");
+  }
+
+  for (const Sink &sink : iface.getSinks()) {
+    hash.update("sink:" + sink.getName() + ":" + to_string(sink.getWidth()));
+    if (sink.isConnected()) {
+      const Select &sel = sink.getSelect();
+      for (const SourceSlice &slice : sel.getSlices()) {
+        /* repr doesn't include the width of constants */
+        hash.update("=" + slice.repr() + ":" + to_string(slice.getWidth()));
+      }
+    }
+    hash.update(";");
+  }
+}
+
+void Definition::calculateStructuralHash()
+{
+  llvm::MD5 hash;
+  hash.update(name);
+  hashIFace(hash, interface);
+
+  if (siminfo.isPrimitive()) {
+    hash.update("primitive:" + siminfo.getPrimitive().gen_args);
+  }
+
+  /* Instantiated definitions are always constructed before this one */
+  for (const Instance &inst : instances) {
+    hash.update("inst:" + inst.getName() + ":" + inst.getDefinition().getStructuralHash());
+    hashIFace(hash, inst.getIFace());
+  }
+
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  llvm::SmallString<32> str;
+  llvm::MD5::stringifyResult(result, str);
+
+  structural_hash = str.str();
 }
 
 const Instance & Definition::getInstance(const std::string &name) const
@@ -1,5 +1,14 @@
 #include <jitsim/circuit_llvm.hpp>
+#include "lane_lowering.hpp"
 #include "llvm_utils.hpp"
+#include "select_lowering.hpp"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MathExtras.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
 
 namespace JITSim {
 
@@ -15,6 +24,67 @@ std::vector<Type *> getArgTypes(const std::vector<const Source *> &sources, Modu
   return arg_types;
 }
 
+std::string GetCacheKey(const Definition &definition, const CodegenOptions &options, bool code_layout,
+                        bool counted)
+{
+  /* Annotated code also depends on the profile */
+  if (options.profile_mode != ProfileMode::None || counted) {
+    return "";
+  }
+
+  std::string cache_key = definition.getStructuralHash();
+  if (options.debug_info) {
+    cache_key += "/debug";
+  }
+  /* The layout only depends on the design without a profile */
+  if (code_layout) {
+    cache_key += "/layout";
+  }
+  /* Split functions call chunks that unsplit ones don't have */
+  if (options.chunk_size) {
+    cache_key += "/chunk" + std::to_string(options.chunk_size);
+  }
+  if (options.flatten_threshold) {
+    cache_key += "/flat" + std::to_string(options.flatten_threshold);
+  }
+  if (!options.wide_limbs) {
+    cache_key += "/nolimbs";
+  }
+  if (!options.promote_widths) {
+    cache_key += "/nopromote";
+  }
+  if (options.shadow_state) {
+    cache_key += "/shadow";
+  }
+
+  return cache_key;
+}
+
+std::string GetDebugListingName(const Definition &definition)
+{
+  return definition.getSafeName() + ".jitsim";
+}
+
+/* Line 1 of the listing is the definition itself, followed by a line for
+ * each instance */
+static unsigned getDebugLine(const Definition &definition, const Instance *inst)
+{
+  return 2 + (inst - definition.getInstances().data());
+}
+
+bool WriteDebugListing(const Definition &definition, const std::string &dir)
+{
+  sys::fs::create_directories(dir);
+
+  std::ofstream out(dir + "/" + GetDebugListingName(definition));
+  out << definition.getName() << "\n";
+  for (const Instance &inst : definition.getInstances()) {
+    out << inst.getName() << " : " << inst.getDefinition().getName() << "\n";
+  }
+
+  return !!out;
+}
+
 std::string getComputeOutputName(const Definition &definition)
 {
   return Twine(definition.getSafeName(), "_compute_output").str();
@@ -27,8 +97,7 @@ std::string getUpdateStateName(const Definition &definition)
 
 static StructType *makeReturnType(const Definition &definition, ModuleEnvironment &mod_env)
 {
-  std::string out_type_name = definition.getSafeName() + "_output_type";
-  return ConstructStructType(definition.getIFace().getSinks(), mod_env.getContext(), out_type_name);
+  return ConstructStructType(definition.getIFace().getSinks(), mod_env.getContext());
 }
 
 static FunctionType * makeComputeOutputType(const Definition &definition, ModuleEnvironment &mod_env) 
@@ -60,6 +129,9 @@ static FunctionType * makeUpdateStateType(const Definition &definition, ModuleEn
 
   std::vector<Type *> arg_types = getArgTypes(definition.getSimInfo().getStateSources(), mod_env);
   arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  if (mod_env.getCodegenOptions().shadow_state) {
+    arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  }
 
   return FunctionType::get(Type::getVoidTy(mod_env.getContext()), arg_types, false);
 }
@@ -96,14 +168,56 @@ static FunctionType * makeStateDepsType(const Definition &definition, ModuleEnvi
   return FunctionType::get(Type::getVoidTy(mod_env.getContext()), arg_types, false);
 }
 
-static Value * createSlice(Value *whole, int offset, int width, FunctionEnvironment &env)
+/* Each pointer argument is a separate buffer (or a separate block of the
+ * state buffer), so LLVM can keep values loaded from it in registers
+ * across stores through the others */
+static void addPointerAttributes(Function *func, unsigned arg_no, uint64_t num_bytes, unsigned align)
 {
-  Value *cur = whole;
-  if (offset > 0) {
-    cur = env.getIRBuilder().CreateLShr(cur, offset);
+  func->addParamAttr(arg_no, Attribute::NoAlias);
+  if (num_bytes == 0) {
+    return;
   }
 
-  return env.getIRBuilder().CreateTrunc(cur, Type::getIntNTy(env.getContext(), width));
+  func->addParamAttr(arg_no, Attribute::NonNull);
+  func->addDereferenceableParamAttr(arg_no, num_bytes);
+  func->addParamAttr(arg_no, Attribute::getWithAlignment(func->getContext(), align));
+}
+
+static void addStateAttributes(Function *func, unsigned arg_no, const Definition &definition)
+{
+  const SimInfo &sim_info = definition.getSimInfo();
+  addPointerAttributes(func, arg_no, sim_info.getNumStateBytes(), sim_info.getStateAlign());
+}
+
+/* The state pointer is the only pointer argument of the functions
+ * generated for a definition */
+static void addStateAttributes(Function *func, const Definition &definition)
+{
+  for (Argument &arg : func->args()) {
+    if (arg.getType()->isPointerTy()) {
+      addStateAttributes(func, arg.getArgNo(), definition);
+    }
+  }
+}
+
+static Function * makeDefinitionDecl(const std::string &name, FunctionType *type, const Definition &definition,
+                                     ModuleEnvironment &mod_env)
+{
+  Function *decl = mod_env.makeFunctionDecl(name, type);
+  addStateAttributes(decl, definition);
+
+  return decl;
+}
+
+/* Wrapper arguments point at the frontend's LLVMStructs, which are laid
+ * out by the same DataLayout */
+static void addStructAttributes(Function *func, unsigned arg_no, ModuleEnvironment &mod_env)
+{
+  Type *struct_type = func->getFunctionType()->getParamType(arg_no)->getPointerElementType();
+  const DataLayout &data_layout = mod_env.getModule()->getDataLayout();
+
+  addPointerAttributes(func, arg_no, data_layout.getTypeAllocSize(struct_type),
+                       data_layout.getABITypeAlignment(struct_type));
 }
 
 /* Builds a larger integer out of a list of smaller slices of other integers */
@@ -114,47 +228,116 @@ static Value * makeValueReference(const Select &select, FunctionEnvironment &env
     const SourceSlice &slice = select.getDirect();
     if (slice.isConstant()) {
       const APInt &const_int = slice.getConstant();
-      return ConstantInt::get(env.getContext(), const_int);
+      return env.getModule().getConstant(const_int);
     }
     else {
       return env.lookupValue(slice.getSource());
     }
   } else {
-    Value *acc = nullptr;
-    int total_width = 0;
-    for (const SourceSlice &slice : select.getSlices()) {
-      Value *sliced_val;
-      if (slice.isConstant()) {
-        sliced_val = ConstantInt::get(env.getContext(), slice.getConstant());
-      } else {
-        Value *whole_val = env.lookupValue(slice.getSource());
-        sliced_val = createSlice(whole_val, slice.getOffset(), slice.getWidth(), env);
-      }
-      total_width += slice.getWidth();
+    return LowerConcat(select, env);
+  }
+}
 
-      if (!acc) {
-        acc = sliced_val;
-      } else {
-        Value *src = env.getIRBuilder().CreateZExt(sliced_val, Type::getIntNTy(env.getContext(), total_width), "src");
-        Value *dest = env.getIRBuilder().CreateZExt(acc, Type::getIntNTy(env.getContext(), total_width), "dst");
+/* Offsets into a flattened instance's state are folded into one GEP from
+ * the function's state argument, so all of its state has constant offsets */
+static Value * incrementStatePtr(Value *cur_ptr, int incr, FunctionEnvironment &env)
+{
+  if (incr == 0) {
+    return cur_ptr;
+  }
 
-        src = env.getIRBuilder().CreateShl(src, total_width - slice.getWidth(), "src_shift");
-        dest = env.getIRBuilder().CreateOr(dest, src, "concat");
+  auto *gep = dyn_cast<GetElementPtrInst>(cur_ptr);
+  if (gep && gep->isInBounds() && gep->getNumIndices() == 1 && gep->hasAllConstantIndices()) {
+    incr += cast<ConstantInt>(gep->getOperand(1))->getSExtValue();
+    cur_ptr = gep->getPointerOperand();
+  }
 
-        acc = dest;
-      }
+  return env.getIRBuilder().CreateConstInBoundsGEP1_64(cur_ptr, incr);
+}
+
+static unsigned countPrimitives(const Definition &definition, unsigned limit)
+{
+  unsigned num_primitives = 0;
+  for (const Instance &inst : definition.getInstances()) {
+    const Definition &inst_defn = inst.getDefinition();
+    if (inst_defn.getSimInfo().isPrimitive()) {
+      num_primitives++;
+    } else {
+      num_primitives += countPrimitives(inst_defn, limit - std::min(limit, num_primitives));
     }
-    assert(acc);
-    return acc ;
+
+    /* Only whether the subtree is under the threshold matters */
+    if (num_primitives > limit) {
+      break;
+    }
+  }
+
+  return num_primitives;
+}
+
+bool ShouldFlatten(const Definition &definition, unsigned flatten_threshold)
+{
+  return flatten_threshold > 0 && !definition.getSimInfo().isPrimitive() &&
+         countPrimitives(definition, flatten_threshold) <= flatten_threshold;
+}
+
+/* The definitions' own functions simulate a single lane, so a module
+ * simulating several emits everything inline */
+static bool shouldInline(const Definition &definition, ModuleEnvironment &mod_env)
+{
+  return mod_env.getLanes() > 1 || ShouldFlatten(definition, mod_env.getCodegenOptions().flatten_threshold);
+}
+
+/* Each instance's state holds a copy for every lane */
+static int getStateOffset(const SimInfo &defn_info, const Instance *inst, FunctionEnvironment &env)
+{
+  return defn_info.getOffset(inst) * env.getModule().getLanes();
+}
+
+static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_info, FunctionEnvironment &env,
+                                      Value *base_state);
+static void makeInstanceUpdateState(const Instance *inst, const SimInfo &defn_info, FunctionEnvironment &env,
+                                    Value *base_state, Value *base_shadow);
+
+/* Emits definition's compute_output in place, returning the values of its
+ * sinks. The instances inside keep the debug line of the flattened
+ * instance, since their own lines are in another listing. */
+static std::vector<Value *> makeFlatComputeOutput(const Definition &definition, const std::vector<Value *> &args,
+                                                  Value *state_ptr, FunctionEnvironment &env)
+{
+  const SimInfo &defn_info = definition.getSimInfo();
+  const std::vector<const Source *> &sources = defn_info.getOutputSources();
+  for (unsigned i = 0; i < sources.size(); i++) {
+    env.addValue(sources[i], args[i]);
+  }
+
+  for (const Instance *inst : defn_info.getOutputDeps()) {
+    makeInstanceComputeOutput(inst, defn_info, env, state_ptr);
+  }
+
+  std::vector<Value *> ret_values;
+  for (const Sink &sink : definition.getIFace().getSinks()) {
+    ret_values.push_back(makeValueReference(sink.getSelect(), env));
   }
+
+  return ret_values;
 }
 
-static Value * incrementStatePtr(Value *cur_ptr, int incr, FunctionEnvironment &env)
+static void makeFlatUpdateState(const Definition &definition, const std::vector<Value *> &args,
+                                Value *state_ptr, Value *shadow_ptr, FunctionEnvironment &env)
 {
-  if (incr == 0) {
-    return cur_ptr;
-  } else {
-    return env.getIRBuilder().CreateConstInBoundsGEP1_64(cur_ptr, incr);
+  const SimInfo &defn_info = definition.getSimInfo();
+  const std::vector<const Source *> &sources = defn_info.getStateSources();
+  for (unsigned i = 0; i < sources.size(); i++) {
+    env.addValue(sources[i], args[i]);
+  }
+
+  for (const Instance *inst : defn_info.getStateDeps()) {
+    makeInstanceComputeOutput(inst, defn_info, env, state_ptr);
+  }
+
+  for (const Instance *inst : defn_info.getStatefulInstances()) {
+    makeInstanceUpdateState(inst, defn_info, env, state_ptr, shadow_ptr);
   }
 }
 
@@ -174,7 +357,7 @@ static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_
   }
 
   if (inst_info.isStateful()) {
-    Value *state_ptr = incrementStatePtr(base_state, defn_info.getOffset(inst), env);
+    Value *state_ptr = incrementStatePtr(base_state, getStateOffset(defn_info, inst, env), env);
     argument_values.push_back(state_ptr);
   }
 
@@ -182,11 +365,15 @@ static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_
   if (inst_info.isPrimitive()) {
     const Primitive &prim = inst_info.getPrimitive();
     ret_values = prim.make_compute_output(env, argument_values, *inst);
+  } else if (shouldInline(inst->getDefinition(), env.getModule())) {
+    Value *state_ptr = inst_info.isStateful() ? argument_values.back() : nullptr;
+    ret_values = makeFlatComputeOutput(inst->getDefinition(), argument_values, state_ptr, env);
   } else {
     std::string inst_comp_output = getComputeOutputName(inst->getDefinition());
     Function *inst_func = env.getModule().getFunctionDecl(inst_comp_output);
     if (inst_func == nullptr) {
-      inst_func = env.getModule().makeFunctionDecl(inst_comp_output, makeComputeOutputType(inst->getDefinition(), env.getModule()));
+      inst_func = makeDefinitionDecl(inst_comp_output, makeComputeOutputType(inst->getDefinition(), env.getModule()),
+                                     inst->getDefinition(), env.getModule());
     }
 
     Value *ret_struct = env.getIRBuilder().CreateCall(inst_func, argument_values, inst->getName() + "_output");
@@ -201,7 +388,9 @@ static void makeInstanceComputeOutput(const Instance *inst, const SimInfo &defn_
   }
 }
 
-static void makeInstanceUpdateState(const Instance *inst, const SimInfo &defn_info, FunctionEnvironment &env, Value *base_state)
+/* base_shadow is null unless CodegenOptions::shadow_state is set */
+static void makeInstanceUpdateState(const Instance *inst, const SimInfo &defn_info, FunctionEnvironment &env,
+                                    Value *base_state, Value *base_shadow)
 {
   const SimInfo &inst_info = inst->getDefinition().getSimInfo();
   const InstanceIFace &iface = inst->getIFace();
@@ -215,23 +404,335 @@ static void makeInstanceUpdateState(const Instance *inst, const SimInfo &defn_in
     argument_values.push_back(arg_val);
   }
 
-  Value *state_ptr = incrementStatePtr(base_state, defn_info.getOffset(inst), env);
+  Value *state_ptr = incrementStatePtr(base_state, getStateOffset(defn_info, inst, env), env);
   argument_values.push_back(state_ptr);
+  Value *shadow_ptr = nullptr;
+  if (base_shadow) {
+    shadow_ptr = incrementStatePtr(base_shadow, getStateOffset(defn_info, inst, env), env);
+    argument_values.push_back(shadow_ptr);
+  }
 
   if (inst_info.isPrimitive()) {
     const Primitive &prim = inst_info.getPrimitive();
     prim.make_update_state(env, argument_values, *inst);
+  } else if (shouldInline(inst->getDefinition(), env.getModule())) {
+    makeFlatUpdateState(inst->getDefinition(), argument_values, state_ptr, shadow_ptr, env);
   } else {
     std::string inst_update_state = getUpdateStateName(inst->getDefinition());
     Function *inst_func = env.getModule().getFunctionDecl(inst_update_state);
     if (inst_func == nullptr) {
-      inst_func = env.getModule().makeFunctionDecl(inst_update_state, makeUpdateStateType(inst->getDefinition(), env.getModule()));
+      inst_func = makeDefinitionDecl(inst_update_state, makeUpdateStateType(inst->getDefinition(), env.getModule()),
+                                     inst->getDefinition(), env.getModule());
     }
 
     env.getIRBuilder().CreateCall(inst_func, argument_values);
   }
 }
 
+/* One instance's part of compute_output or update_state */
+struct ChunkStep {
+  const Instance *inst;
+  bool update_state;
+};
+
+/* How a function's instances are split between chunks. Values crossing a
+ * chunk boundary go through a spill buffer on the stack of the definition's
+ * function, each at a fixed offset. Built the same way for the function
+ * and for every chunk, so they agree on the layout without sharing IR. */
+struct ChunkPlan {
+  std::vector<std::vector<ChunkStep>> chunks;
+  /* Loaded from the spill buffer when a chunk starts, and stored to it
+   * when the chunk finishes */
+  std::vector<std::vector<const Source *>> inputs;
+  std::vector<std::vector<const Source *>> outputs;
+  /* Arguments of the definition's function needed by the chunks, and
+   * values it needs back from them */
+  std::vector<const Source *> args;
+  std::vector<const Source *> results;
+  std::unordered_map<const Source *, uint64_t> offsets;
+  uint64_t spill_bytes = 0;
+};
+
+static std::vector<ChunkStep> getSteps(const Definition &definition, bool update_state)
+{
+  const SimInfo &defn_info = definition.getSimInfo();
+
+  std::vector<ChunkStep> steps;
+  if (!update_state) {
+    for (const Instance *inst : defn_info.getOutputDeps()) {
+      steps.push_back({ inst, false });
+    }
+    return steps;
+  }
+
+  for (const Instance *inst : defn_info.getStateDeps()) {
+    steps.push_back({ inst, false });
+  }
+  for (const Instance *inst : defn_info.getStatefulInstances()) {
+    steps.push_back({ inst, true });
+  }
+
+  return steps;
+}
+
+static void addSelectSources(const Select &select, std::vector<const Source *> &used)
+{
+  for (const SourceSlice &slice : select.getSlices()) {
+    if (!slice.isConstant()) {
+      used.push_back(slice.getSource());
+    }
+  }
+}
+
+/* Sources read by the sinks a step passes to the instance's function */
+static std::vector<const Source *> getUsedSources(const ChunkStep &step)
+{
+  const SimInfo &inst_info = step.inst->getDefinition().getSimInfo();
+  const InstanceIFace &iface = step.inst->getIFace();
+
+  std::vector<const Source *> used;
+  for (const Source *src : step.update_state ? inst_info.getStateSources() : inst_info.getOutputSources()) {
+    addSelectSources(iface.getSink(src)->getSelect(), used);
+  }
+
+  return used;
+}
+
+static ChunkPlan makeChunkPlan(const Definition &definition, bool update_state, unsigned chunk_size)
+{
+  ChunkPlan plan;
+  std::vector<ChunkStep> steps = getSteps(definition, update_state);
+  if (chunk_size == 0 || steps.size() <= chunk_size) {
+    return plan;
+  }
+
+  for (unsigned i = 0; i < steps.size(); i += chunk_size) {
+    plan.chunks.emplace_back(steps.begin() + i, steps.begin() + std::min<size_t>(i + chunk_size, steps.size()));
+  }
+  plan.inputs.resize(plan.chunks.size());
+  plan.outputs.resize(plan.chunks.size());
+
+  /* Chunk producing each value, -1 for the function's arguments */
+  std::unordered_map<const Source *, int> producers;
+  const SimInfo &defn_info = definition.getSimInfo();
+  for (const Source *src : update_state ? defn_info.getStateSources() : defn_info.getOutputSources()) {
+    producers[src] = -1;
+  }
+
+  auto spill = [&plan, &producers](const Source *src) {
+    if (plan.offsets.count(src)) {
+      return;
+    }
+
+    plan.offsets[src] = plan.spill_bytes;
+    plan.spill_bytes += (src->getWidth() + 63) / 64 * 8;
+
+    int producer = producers.find(src)->second;
+    if (producer < 0) {
+      plan.args.push_back(src);
+    } else {
+      plan.outputs[producer].push_back(src);
+    }
+  };
+
+  for (unsigned c = 0; c < plan.chunks.size(); c++) {
+    for (const ChunkStep &step : plan.chunks[c]) {
+      for (const Source *src : getUsedSources(step)) {
+        auto producer = producers.find(src);
+        assert(producer != producers.end() && "Instance used before its inputs were computed");
+        if (producer->second != (int)c &&
+            std::find(plan.inputs[c].begin(), plan.inputs[c].end(), src) == plan.inputs[c].end()) {
+          plan.inputs[c].push_back(src);
+          spill(src);
+        }
+      }
+
+      if (!step.update_state) {
+        for (const Source &src : step.inst->getIFace().getSources()) {
+          producers[&src] = c;
+        }
+      }
+    }
+  }
+
+  if (!update_state) {
+    std::vector<const Source *> used;
+    for (const Sink &sink : definition.getIFace().getSinks()) {
+      addSelectSources(sink.getSelect(), used);
+    }
+
+    for (const Source *src : used) {
+      auto producer = producers.find(src);
+      if (producer != producers.end() && producer->second >= 0 &&
+          std::find(plan.results.begin(), plan.results.end(), src) == plan.results.end()) {
+        plan.results.push_back(src);
+        spill(src);
+      }
+    }
+  }
+
+  return plan;
+}
+
+static Value * getSlotAddr(uint64_t offset, const Source *src, Value *buffer, FunctionEnvironment &env)
+{
+  Value *addr = env.getIRBuilder().CreateConstInBoundsGEP1_64(buffer, offset);
+  return env.getIRBuilder().CreateBitCast(addr, Type::getIntNPtrTy(env.getContext(), src->getWidth()));
+}
+
+static Value * getSpillAddr(const ChunkPlan &plan, const Source *src, Value *spill, FunctionEnvironment &env)
+{
+  return getSlotAddr(plan.offsets.find(src)->second, src, spill, env);
+}
+
+static void storeSpill(const ChunkPlan &plan, const Source *src, Value *spill, FunctionEnvironment &env)
+{
+  env.getIRBuilder().CreateAlignedStore(env.lookupValue(src), getSpillAddr(plan, src, spill, env), 8);
+}
+
+static void loadSpill(const ChunkPlan &plan, const Source *src, Value *spill, FunctionEnvironment &env)
+{
+  env.addValue(src, env.getIRBuilder().CreateAlignedLoad(getSpillAddr(plan, src, spill, env), 8,
+                                                         src->getName()));
+}
+
+/* Chunks of update_state also take the shadow state when there is one */
+static bool chunkHasShadow(bool update_state, ModuleEnvironment &mod_env)
+{
+  return update_state && mod_env.getCodegenOptions().shadow_state;
+}
+
+static FunctionType * makeChunkType(bool update_state, ModuleEnvironment &mod_env)
+{
+  Type *ptr_type = Type::getInt8PtrTy(mod_env.getContext());
+  std::vector<Type *> arg_types = { ptr_type, ptr_type };
+  if (chunkHasShadow(update_state, mod_env)) {
+    arg_types.push_back(ptr_type);
+  }
+
+  return FunctionType::get(Type::getVoidTy(mod_env.getContext()), arg_types, false);
+}
+
+/* The spill buffer is a stack slot of the caller, and the state pointer is
+ * null when the definition has no state */
+static void addChunkAttributes(Function *func, const Definition &definition, const ChunkPlan &plan)
+{
+  addPointerAttributes(func, 0, plan.spill_bytes, 8);
+
+  const SimInfo &sim_info = definition.getSimInfo();
+  for (unsigned arg_no = 1; arg_no < func->arg_size(); arg_no++) {
+    addPointerAttributes(func, arg_no, sim_info.isStateful() ? sim_info.getNumStateBytes() : 0,
+                         sim_info.getStateAlign());
+  }
+}
+
+unsigned GetNumChunks(const Definition &definition, bool update_state, unsigned chunk_size)
+{
+  size_t num_steps = getSteps(definition, update_state).size();
+  if (chunk_size == 0 || num_steps <= chunk_size) {
+    return 0;
+  }
+
+  return (num_steps + chunk_size - 1) / chunk_size;
+}
+
+std::string GetChunkName(const Definition &definition, bool update_state, unsigned idx)
+{
+  return (update_state ? getUpdateStateName(definition) : getComputeOutputName(definition)) +
+         "_chunk" + std::to_string(idx);
+}
+
+ModuleEnvironment MakeChunk(Builder &builder, const Definition &definition, bool update_state, unsigned idx)
+{
+  const std::string name = GetChunkName(definition, update_state, idx);
+  ModuleEnvironment mod_env = builder.makeModule(name);
+
+  const SimInfo &defn_info = definition.getSimInfo();
+  ChunkPlan plan = makeChunkPlan(definition, update_state, builder.getCodegenOptions().chunk_size);
+  assert(idx < plan.chunks.size());
+
+  FunctionEnvironment chunk = mod_env.makeFunction(name, makeChunkType(update_state, mod_env));
+  addChunkAttributes(chunk.getFunction(), definition, plan);
+  chunk.attachDebugInfo(GetDebugListingName(definition));
+  chunk.addBasicBlock("entry");
+
+  Value *spill = chunk.getFunction()->arg_begin();
+  spill->setName("spill");
+  Value *state_ptr = chunk.getFunction()->arg_begin() + 1;
+  state_ptr->setName("state_ptr");
+  Value *shadow_ptr = nullptr;
+  if (chunkHasShadow(update_state, mod_env)) {
+    shadow_ptr = chunk.getFunction()->arg_begin() + 2;
+    shadow_ptr->setName("shadow_ptr");
+  }
+
+  for (const Source *src : plan.inputs[idx]) {
+    loadSpill(plan, src, spill, chunk);
+  }
+
+  for (const ChunkStep &step : plan.chunks[idx]) {
+    chunk.setDebugLine(getDebugLine(definition, step.inst));
+    if (step.update_state) {
+      makeInstanceUpdateState(step.inst, defn_info, chunk, state_ptr, shadow_ptr);
+    } else {
+      makeInstanceComputeOutput(step.inst, defn_info, chunk, state_ptr);
+    }
+  }
+
+  chunk.setDebugLine(1);
+  for (const Source *src : plan.outputs[idx]) {
+    storeSpill(plan, src, spill, chunk);
+  }
+
+  chunk.getIRBuilder().CreateRetVoid();
+  assert(!chunk.verify());
+
+  return mod_env;
+}
+
+/* Calls each chunk of a split function, leaving the values the function
+ * needs afterwards in env */
+static void makeChunkCalls(const ChunkPlan &plan, const Definition &definition, bool update_state,
+                           FunctionEnvironment &env, Value *state_ptr, Value *shadow_ptr)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Type *i8_type = Type::getInt8Ty(env.getContext());
+
+  /* Chunks are bounded, so this only holds the values live across them */
+  AllocaInst *spill = ir_builder.CreateAlloca(i8_type, ConstantInt::get(Type::getInt64Ty(env.getContext()),
+                                                                        std::max<uint64_t>(plan.spill_bytes, 8)),
+                                              "spill");
+  spill->setAlignment(8);
+
+  for (const Source *src : plan.args) {
+    storeSpill(plan, src, spill, env);
+  }
+
+  if (!state_ptr) {
+    state_ptr = ConstantPointerNull::get(Type::getInt8PtrTy(env.getContext()));
+  }
+
+  FunctionType *chunk_type = makeChunkType(update_state, env.getModule());
+  for (unsigned i = 0; i < plan.chunks.size(); i++) {
+    const std::string chunk_name = GetChunkName(definition, update_state, i);
+    Function *chunk_func = env.getModule().getFunctionDecl(chunk_name);
+    if (!chunk_func) {
+      chunk_func = env.getModule().makeFunctionDecl(chunk_name, chunk_type);
+      addChunkAttributes(chunk_func, definition, plan);
+    }
+
+    if (shadow_ptr) {
+      ir_builder.CreateCall(chunk_func, { spill, state_ptr, shadow_ptr });
+    } else {
+      ir_builder.CreateCall(chunk_func, { spill, state_ptr });
+    }
+  }
+
+  for (const Source *src : plan.results) {
+    loadSpill(plan, src, spill, env);
+  }
+}
+
 ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definition)
 {
   ModuleEnvironment mod_env = builder.makeModule(definition.getSafeName() + "_compute_output");
@@ -240,6 +741,8 @@ ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definiti
 
   FunctionType *co_type = makeComputeOutputType(definition, mod_env);
   FunctionEnvironment compute_output = mod_env.makeFunction(getComputeOutputName(definition), co_type);
+  addStateAttributes(compute_output.getFunction(), definition);
+  compute_output.attachDebugInfo(GetDebugListingName(definition));
   compute_output.addBasicBlock("entry");
 
   const std::vector<const Source *> &sources = defn_info.getOutputSources();
@@ -259,11 +762,18 @@ ModuleEnvironment MakeComputeOutput(Builder &builder, const Definition &definiti
     state_ptr->setName("state_ptr");
   }
 
-  const std::vector<const Instance *> &output_deps = defn_info.getOutputDeps();
-  for (const Instance *inst : output_deps) {
-    makeInstanceComputeOutput(inst, defn_info, compute_output, state_ptr);
+  ChunkPlan plan = makeChunkPlan(definition, false, builder.getCodegenOptions().chunk_size);
+  if (!plan.chunks.empty()) {
+    makeChunkCalls(plan, definition, false, compute_output, state_ptr, nullptr);
+  } else {
+    const std::vector<const Instance *> &output_deps = defn_info.getOutputDeps();
+    for (const Instance *inst : output_deps) {
+      compute_output.setDebugLine(getDebugLine(definition, inst));
+      makeInstanceComputeOutput(inst, defn_info, compute_output, state_ptr);
+    }
   }
 
+  compute_output.setDebugLine(1);
   const std::vector<JITSim::Sink> & sinks = definition.getIFace().getSinks();
   Value *ret_val = UndefValue::get(co_type->getReturnType());
 
@@ -290,11 +800,14 @@ ModuleEnvironment MakeUpdateState(Builder &builder, const Definition &definition
 
   FunctionType *us_type = makeUpdateStateType(definition, mod_env);
   FunctionEnvironment update_state = mod_env.makeFunction(getUpdateStateName(definition), us_type);
+  addStateAttributes(update_state.getFunction(), definition);
+  update_state.attachDebugInfo(GetDebugListingName(definition));
   update_state.addBasicBlock("entry");
 
+  const bool shadow_state = builder.getCodegenOptions().shadow_state;
   const std::vector<const Source *> & sources = defn_info.getStateSources();
   auto arg = update_state.getFunction()->arg_begin();
-  assert(update_state.getFunction()->arg_size() == sources.size() + 1);
+  assert(update_state.getFunction()->arg_size() == sources.size() + 1 + shadow_state);
 
   for (unsigned i = 0; i < sources.size(); i++, arg++) {
     const Source *src = sources[i];
@@ -303,17 +816,30 @@ ModuleEnvironment MakeUpdateState(Builder &builder, const Definition &definition
     arg->setName("self." + src->getName());
   }
 
-  Value *state_ptr = update_state.getFunction()->arg_end() - 1;
+  Value *state_ptr = arg++;
   state_ptr->setName("state_ptr");
-
-  for (const Instance *inst : defn_info.getStateDeps()) {
-    makeInstanceComputeOutput(inst, defn_info, update_state, state_ptr);
+  Value *shadow_ptr = nullptr;
+  if (shadow_state) {
+    shadow_ptr = arg++;
+    shadow_ptr->setName("shadow_ptr");
   }
 
-  for (const Instance *inst : defn_info.getStatefulInstances()) {
-    makeInstanceUpdateState(inst, defn_info, update_state, state_ptr);
+  ChunkPlan plan = makeChunkPlan(definition, true, builder.getCodegenOptions().chunk_size);
+  if (!plan.chunks.empty()) {
+    makeChunkCalls(plan, definition, true, update_state, state_ptr, shadow_ptr);
+  } else {
+    for (const Instance *inst : defn_info.getStateDeps()) {
+      update_state.setDebugLine(getDebugLine(definition, inst));
+      makeInstanceComputeOutput(inst, defn_info, update_state, state_ptr);
+    }
+
+    for (const Instance *inst : defn_info.getStatefulInstances()) {
+      update_state.setDebugLine(getDebugLine(definition, inst));
+      makeInstanceUpdateState(inst, defn_info, update_state, state_ptr, shadow_ptr);
+    }
   }
 
+  update_state.setDebugLine(1);
   update_state.getIRBuilder().CreateRetVoid();
   assert(!update_state.verify());
   assert(!mod_env.verify());
@@ -352,7 +878,8 @@ static void makeInstanceOutputDeps(const Instance *inst, const SimInfo &defn_inf
     std::string inst_output_deps = inst->getDefinition().getSafeName() + "_output_deps";
     Function *inst_func = env.getModule().getFunctionDecl(inst_output_deps);
     if (inst_func == nullptr) {
-      inst_func = env.getModule().makeFunctionDecl(inst_output_deps, makeOutputDepsType(inst->getDefinition(), env.getModule()));
+      inst_func = makeDefinitionDecl(inst_output_deps, makeOutputDepsType(inst->getDefinition(), env.getModule()),
+                                     inst->getDefinition(), env.getModule());
     }
 
     Value *ret_struct = env.getIRBuilder().CreateCall(inst_func, argument_values, inst->getName() + "_output");
@@ -396,7 +923,8 @@ static void makeInstanceStateDeps(const Instance *inst, const SimInfo &defn_info
   std::string inst_state_deps = inst->getDefinition().getSafeName() + "_state_deps";
   Function *inst_func = env.getModule().getFunctionDecl(inst_state_deps);
   if (inst_func == nullptr) {
-    inst_func = env.getModule().makeFunctionDecl(inst_state_deps, makeStateDepsType(inst->getDefinition(), env.getModule()));
+    inst_func = makeDefinitionDecl(inst_state_deps, makeStateDepsType(inst->getDefinition(), env.getModule()),
+                                   inst->getDefinition(), env.getModule());
   }
 
   env.getIRBuilder().CreateCall(inst_func, argument_values);
@@ -411,6 +939,8 @@ ModuleEnvironment MakeOutputDeps(Builder &builder, const Definition &definition)
 
   FunctionType *od_type = makeOutputDepsType(definition, mod_env);
   FunctionEnvironment output_deps = mod_env.makeFunction(definition.getSafeName() + "_output_deps", od_type);
+  addStateAttributes(output_deps.getFunction(), definition);
+  output_deps.attachDebugInfo(GetDebugListingName(definition));
   output_deps.addBasicBlock("entry");
 
   const std::vector<const Source *> &sources = defn_info.getOutputSources();
@@ -435,9 +965,11 @@ ModuleEnvironment MakeOutputDeps(Builder &builder, const Definition &definition)
 
   const std::vector<const Instance *> &output_instances = defn_info.getOutputDeps();
   for (const Instance *inst : output_instances) {
+    output_deps.setDebugLine(getDebugLine(definition, inst));
     makeInstanceOutputDeps(inst, defn_info, output_deps, state_ptr, inst_offset);
   }
 
+  output_deps.setDebugLine(1);
   BasicBlock *ret_block = output_deps.addBasicBlock("return", false);
   output_deps.getIRBuilder().CreateBr(ret_block);
   output_deps.setCurBasicBlock(ret_block);
@@ -468,6 +1000,8 @@ ModuleEnvironment MakeStateDeps(Builder &builder, const Definition &definition)
 
   FunctionType *sd_type = makeStateDepsType(definition, mod_env);
   FunctionEnvironment state_deps = mod_env.makeFunction(definition.getSafeName() + "_state_deps", sd_type);
+  addStateAttributes(state_deps.getFunction(), definition);
+  state_deps.attachDebugInfo(GetDebugListingName(definition));
   state_deps.addBasicBlock("entry");
 
   const std::vector<const Source *> & sources = defn_info.getStateSources();
@@ -489,13 +1023,16 @@ ModuleEnvironment MakeStateDeps(Builder &builder, const Definition &definition)
   arg++;
 
   for (const Instance *inst : defn_info.getStateDeps()) {
+    state_deps.setDebugLine(getDebugLine(definition, inst));
     makeInstanceOutputDeps(inst, defn_info, state_deps, state_ptr, inst_offset);
   }
 
   for (const Instance *inst : defn_info.getStatefulInstances()) {
+    state_deps.setDebugLine(getDebugLine(definition, inst));
     makeInstanceStateDeps(inst, defn_info, state_deps, state_ptr, inst_offset);
   }
 
+  state_deps.setDebugLine(1);
   BasicBlock *ret_block = state_deps.addBasicBlock("return", false);
   state_deps.getIRBuilder().CreateBr(ret_block);
   state_deps.setCurBasicBlock(ret_block);
@@ -507,6 +1044,102 @@ ModuleEnvironment MakeStateDeps(Builder &builder, const Definition &definition)
   return mod_env;
 }
 
+static std::vector<Value *> loadStructArgs(Value *inputs, unsigned num_args, FunctionEnvironment &func)
+{
+  std::vector<Value *> args;
+  for (unsigned i = 0; i < num_args; i++) {
+    Value *arg = func.getIRBuilder().CreateStructGEP(inputs->getType()->getPointerElementType(), inputs, i);
+    arg = func.getIRBuilder().CreateLoad(arg);
+    args.push_back(arg);
+  }
+
+  return args;
+}
+
+/* A design small enough to flatten completely is emitted right into the
+ * wrapper, otherwise the wrapper calls its compute_output */
+static std::vector<Value *> makeTopComputeOutput(Builder &builder, const Definition &defn, std::vector<Value *> args,
+                                                 Value *state, FunctionEnvironment &func)
+{
+  if (ShouldFlatten(defn, builder.getCodegenOptions().flatten_threshold)) {
+    return makeFlatComputeOutput(defn, args, state, func);
+  }
+
+  FunctionType *co_type = makeComputeOutputType(defn, func.getModule());
+  Function *underlying = makeDefinitionDecl(defn.getSafeName() + "_compute_output", co_type, defn, func.getModule());
+
+  if (defn.getSimInfo().isStateful()) {
+    args.push_back(state);
+  }
+
+  std::vector<Value *> output_vals;
+  Value *output_struct = func.getIRBuilder().CreateCall(underlying, args);
+  for (unsigned i = 0; i < defn.getIFace().getSinks().size(); i++) {
+    output_vals.push_back(func.getIRBuilder().CreateExtractValue(output_struct, { i }));
+  }
+
+  return output_vals;
+}
+
+/* With a shadow state the top's state buffer is twice as long, the second
+ * half mirroring the layout of the first */
+static Value * getTopShadow(const Definition &defn, Value *state, FunctionEnvironment &func)
+{
+  if (!func.getModule().getCodegenOptions().shadow_state) {
+    return nullptr;
+  }
+
+  uint64_t state_bytes = defn.getSimInfo().getNumStateBytes() * func.getModule().getLanes();
+  return func.getIRBuilder().CreateConstInBoundsGEP1_64(state, state_bytes, "shadow");
+}
+
+/* Each range is one fixed size copy, which LLVM expands to vector moves */
+static void commitShadow(const Definition &defn, Value *state, Value *shadow, FunctionEnvironment &func)
+{
+  if (!shadow) {
+    return;
+  }
+
+  const SimInfo &defn_info = defn.getSimInfo();
+  const unsigned lanes = func.getModule().getLanes();
+  IRBuilder<> &ir_builder = func.getIRBuilder();
+  for (const StateRange &range : defn_info.getCommitRanges()) {
+    uint64_t offset = range.offset * lanes;
+    ir_builder.CreateMemCpy(ir_builder.CreateConstInBoundsGEP1_64(state, offset),
+                            ir_builder.CreateConstInBoundsGEP1_64(shadow, offset),
+                            range.bytes * lanes, MinAlign(offset, defn_info.getStateAlign()));
+  }
+}
+
+static void makeTopUpdateState(Builder &builder, const Definition &defn, std::vector<Value *> args,
+                               Value *state, FunctionEnvironment &func)
+{
+  Value *shadow = getTopShadow(defn, state, func);
+
+  if (ShouldFlatten(defn, builder.getCodegenOptions().flatten_threshold)) {
+    makeFlatUpdateState(defn, args, state, shadow, func);
+  } else {
+    FunctionType *us_type = makeUpdateStateType(defn, func.getModule());
+    Function *underlying = makeDefinitionDecl(defn.getSafeName() + "_update_state", us_type, defn, func.getModule());
+
+    args.push_back(state);
+    if (shadow) {
+      args.push_back(shadow);
+    }
+    func.getIRBuilder().CreateCall(underlying, args);
+  }
+
+  commitShadow(defn, state, shadow, func);
+}
+
+static void storeOutputs(const std::vector<Value *> &output_vals, Value *outputs, FunctionEnvironment &func)
+{
+  for (unsigned i = 0; i < output_vals.size(); i++) {
+    Value *addr = func.getIRBuilder().CreateStructGEP(outputs->getType()->getPointerElementType(), outputs, i);
+    func.getIRBuilder().CreateStore(output_vals[i], addr);
+  }
+}
+
 ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &defn)
 {
   ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_compute_output_wrapper");
@@ -516,35 +1149,25 @@ ModuleEnvironment MakeComputeOutputWrapper(Builder &builder, const Definition &d
 
   FunctionType *wrapper_type =
     FunctionType::get(Type::getVoidTy(mod_env.getContext()),
-                      {ConstructStructType(sources, mod_env.getContext(), "co_wrapper_input")->getPointerTo(),
-                       ConstructStructType(sinks, mod_env.getContext(), "co_wrapper_output")->getPointerTo(),
+                      {ConstructStructType(sources, mod_env.getContext())->getPointerTo(),
+                       ConstructStructType(sinks, mod_env.getContext())->getPointerTo(),
                        Type::getInt8PtrTy(mod_env.getContext())}, false);
 
   FunctionEnvironment func = mod_env.makeFunction("compute_output", wrapper_type);
+  addStructAttributes(func.getFunction(), 0, mod_env);
+  addStructAttributes(func.getFunction(), 1, mod_env);
+  if (defn.getSimInfo().isStateful()) {
+    addStateAttributes(func.getFunction(), 2, defn);
+  }
+  func.attachDebugInfo(GetDebugListingName(defn));
   func.addBasicBlock("entry");
 
   Value *inputs = func.getFunction()->arg_begin();
   Value *outputs = func.getFunction()->arg_begin() + 1;
   Value *state = func.getFunction()->arg_begin() + 2;
 
-  FunctionType *co_type = makeComputeOutputType(defn, mod_env);
-  Function *underlying = mod_env.makeFunctionDecl(defn.getSafeName() + "_compute_output", co_type);
-
-  std::vector<Value *> args;
-  for (unsigned i = 0; i < sources.size(); i++) {
-    Value *arg = func.getIRBuilder().CreateStructGEP(inputs->getType()->getPointerElementType(), inputs, i);
-    arg = func.getIRBuilder().CreateLoad(arg);
-    args.push_back(arg);
-  }
-  args.push_back(state);
-
-  Value *output_struct = func.getIRBuilder().CreateCall(underlying, args);
-
-  for (unsigned i = 0; i < sinks.size(); i++) {
-    Value *val = func.getIRBuilder().CreateExtractValue(output_struct, { i });
-    Value *addr = func.getIRBuilder().CreateStructGEP(outputs->getType()->getPointerElementType(), outputs, i);
-    func.getIRBuilder().CreateStore(val, addr);
-  }
+  std::vector<Value *> args = loadStructArgs(inputs, sources.size(), func);
+  storeOutputs(makeTopComputeOutput(builder, defn, args, state, func), outputs, func);
 
   func.getIRBuilder().CreateRetVoid();
 
@@ -561,27 +1184,101 @@ ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &def
 
   FunctionType *wrapper_type =
     FunctionType::get(Type::getVoidTy(mod_env.getContext()),
-                      {ConstructStructType(sources, mod_env.getContext(), "us_wrapper_input")->getPointerTo(), 
+                      {ConstructStructType(sources, mod_env.getContext())->getPointerTo(), 
                        Type::getInt8PtrTy(mod_env.getContext())}, false);
 
   FunctionEnvironment func = mod_env.makeFunction("update_state", wrapper_type);
+  addStructAttributes(func.getFunction(), 0, mod_env);
+  if (defn.getSimInfo().isStateful()) {
+    addStateAttributes(func.getFunction(), 1, defn);
+  }
+  func.attachDebugInfo(GetDebugListingName(defn));
   func.addBasicBlock("entry");
 
   Value *inputs = func.getFunction()->arg_begin();
   Value *state = func.getFunction()->arg_begin() + 1;
 
-  FunctionType *us_type = makeUpdateStateType(defn, mod_env);
-  Function *underlying = mod_env.makeFunctionDecl(defn.getSafeName() + "_update_state", us_type);
+  std::vector<Value *> args = loadStructArgs(inputs, sources.size(), func);
+  makeTopUpdateState(builder, defn, args, state, func);
 
-  std::vector<Value *> args;
+  func.getIRBuilder().CreateRetVoid();
+  func.verify();
+
+  return mod_env;
+}
+
+/* Computes the outputs from the current state and then commits the next
+ * state, evaluating each instance in the step deps once for both. A top
+ * split into chunks calls its compute_output and update_state instead, so
+ * the step doesn't become one huge function. */
+ModuleEnvironment MakeStepWrapper(Builder &builder, const Definition &defn)
+{
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_step_wrapper");
+
+  const SimInfo &defn_info = defn.getSimInfo();
+  const std::vector<Source> & sources = defn.getIFace().getSources();
+  const std::vector<Sink> & sinks = defn.getIFace().getSinks();
+
+  FunctionType *wrapper_type =
+    FunctionType::get(Type::getVoidTy(mod_env.getContext()),
+                      {ConstructStructType(sources, mod_env.getContext())->getPointerTo(),
+                       ConstructStructType(sinks, mod_env.getContext())->getPointerTo(),
+                       Type::getInt8PtrTy(mod_env.getContext())}, false);
+
+  FunctionEnvironment func = mod_env.makeFunction("step", wrapper_type);
+  addStructAttributes(func.getFunction(), 0, mod_env);
+  addStructAttributes(func.getFunction(), 1, mod_env);
+  if (defn_info.isStateful()) {
+    addStateAttributes(func.getFunction(), 2, defn);
+  }
+  func.attachDebugInfo(GetDebugListingName(defn));
+  func.addBasicBlock("entry");
+
+  Value *inputs = func.getFunction()->arg_begin();
+  Value *outputs = func.getFunction()->arg_begin() + 1;
+  Value *state = func.getFunction()->arg_begin() + 2;
+
+  std::vector<Value *> input_vals = loadStructArgs(inputs, sources.size(), func);
   for (unsigned i = 0; i < sources.size(); i++) {
-    Value *arg = func.getIRBuilder().CreateStructGEP(inputs->getType()->getPointerElementType(), inputs, i);
-    arg = func.getIRBuilder().CreateLoad(arg);
-    args.push_back(arg);
+    func.addValue(&sources[i], input_vals[i]);
   }
-  args.push_back(state);
 
-  func.getIRBuilder().CreateCall(underlying, args);
+  auto getArgs = [&func](const std::vector<const Source *> &arg_sources) {
+    std::vector<Value *> args;
+    for (const Source *src : arg_sources) {
+      args.push_back(func.lookupValue(src));
+    }
+    return args;
+  };
+
+  const unsigned chunk_size = builder.getCodegenOptions().chunk_size;
+  if (GetNumChunks(defn, false, chunk_size) > 0 || GetNumChunks(defn, true, chunk_size) > 0) {
+    storeOutputs(makeTopComputeOutput(builder, defn, getArgs(defn_info.getOutputSources()), state, func),
+                 outputs, func);
+    if (defn_info.isStateful()) {
+      makeTopUpdateState(builder, defn, getArgs(defn_info.getStateSources()), state, func);
+    }
+  } else {
+    for (const Instance *inst : defn_info.getStepDeps()) {
+      func.setDebugLine(getDebugLine(defn, inst));
+      makeInstanceComputeOutput(inst, defn_info, func, state);
+    }
+
+    func.setDebugLine(1);
+    std::vector<Value *> output_vals;
+    for (const Sink &sink : sinks) {
+      output_vals.push_back(makeValueReference(sink.getSelect(), func));
+    }
+    storeOutputs(output_vals, outputs, func);
+
+    Value *shadow = getTopShadow(defn, state, func);
+    for (const Instance *inst : defn_info.getStatefulInstances()) {
+      func.setDebugLine(getDebugLine(defn, inst));
+      makeInstanceUpdateState(inst, defn_info, func, state, shadow);
+    }
+    func.setDebugLine(1);
+    commitShadow(defn, state, shadow, func);
+  }
 
   func.getIRBuilder().CreateRetVoid();
   func.verify();
@@ -589,6 +1286,250 @@ ModuleEnvironment MakeUpdateStateWrapper(Builder &builder, const Definition &def
   return mod_env;
 }
 
+/* Past this the copy of the state takes too much of the stack, and is too
+ * big to be kept in registers anyway */
+static const uint64_t max_local_state_bytes = 4096;
+
+/* Whether every stateful primitive under definition writes all of its state
+ * at fixed offsets, like a register. A memory indexes its state with a
+ * variable GEP, which stops SROA splitting up the copy it lives in. */
+static bool hasOnlyRegisterState(const Definition &definition)
+{
+  for (const Instance &inst : definition.getInstances()) {
+    const SimInfo &inst_info = inst.getDefinition().getSimInfo();
+    if (inst_info.isPrimitive()) {
+      if (inst_info.isStateful() && !inst_info.getPrimitive().overwrites_state) {
+        return false;
+      }
+    } else if (!hasOnlyRegisterState(inst.getDefinition())) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Runs update_state in a loop and compute_output once at the end. The
+ * inputs are loaded once. When the update is flattened into the loop and
+ * only has registers, the state is copied to the stack for the loop so
+ * SROA can turn it into phis and only the final state is written back.
+ * Otherwise the state escapes into calls or indexed loads anyway, and the
+ * loop runs on the buffer itself. */
+ModuleEnvironment MakeRunWrapper(Builder &builder, const Definition &defn)
+{
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_run_wrapper");
+  LLVMContext &context = mod_env.getContext();
+
+  const SimInfo &defn_info = defn.getSimInfo();
+  const std::vector<const Source *> & us_sources = defn_info.getStateSources();
+  const std::vector<const Source *> & co_sources = defn_info.getOutputSources();
+  const std::vector<Sink> & sinks = defn.getIFace().getSinks();
+
+  FunctionType *wrapper_type =
+    FunctionType::get(Type::getVoidTy(context),
+                      {ConstructStructType(us_sources, context)->getPointerTo(),
+                       ConstructStructType(co_sources, context)->getPointerTo(),
+                       ConstructStructType(sinks, context)->getPointerTo(),
+                       Type::getInt8PtrTy(context),
+                       Type::getInt64Ty(context)}, false);
+
+  FunctionEnvironment func = mod_env.makeFunction("run", wrapper_type);
+  addStructAttributes(func.getFunction(), 0, mod_env);
+  addStructAttributes(func.getFunction(), 1, mod_env);
+  addStructAttributes(func.getFunction(), 2, mod_env);
+  if (defn_info.isStateful()) {
+    addStateAttributes(func.getFunction(), 3, defn);
+  }
+  func.attachDebugInfo(GetDebugListingName(defn));
+  BasicBlock *entry_bb = func.addBasicBlock("entry");
+  func.setCurBasicBlock(entry_bb);
+
+  IRBuilder<> &ir_builder = func.getIRBuilder();
+  Value *us_inputs = func.getFunction()->arg_begin();
+  Value *co_inputs = func.getFunction()->arg_begin() + 1;
+  Value *outputs = func.getFunction()->arg_begin() + 2;
+  Value *state = func.getFunction()->arg_begin() + 3;
+  Value *num_cycles = func.getFunction()->arg_begin() + 4;
+  num_cycles->setName("num_cycles");
+
+  /* update_state of a stateless design does nothing */
+  if (defn_info.isStateful()) {
+    std::vector<Value *> us_args = loadStructArgs(us_inputs, us_sources.size(), func);
+
+    const uint64_t state_bytes = defn_info.getNumStateBytes();
+    const unsigned state_align = defn_info.getStateAlign();
+    Value *sim_state = state;
+    if (state_bytes <= max_local_state_bytes &&
+        ShouldFlatten(defn, builder.getCodegenOptions().flatten_threshold) && hasOnlyRegisterState(defn)) {
+      /* Room for the shadow too, which never needs copying in or out */
+      const uint64_t local_bytes = builder.getCodegenOptions().shadow_state ? 2 * state_bytes : state_bytes;
+      AllocaInst *local_state = ir_builder.CreateAlloca(ArrayType::get(Type::getInt8Ty(context), local_bytes),
+                                                        nullptr, "local_state");
+      local_state->setAlignment(state_align);
+      sim_state = ir_builder.CreateConstInBoundsGEP2_64(local_state, 0, 0);
+      ir_builder.CreateMemCpy(sim_state, state, state_bytes, state_align);
+    }
+
+    Type *cycle_type = Type::getInt64Ty(context);
+    BasicBlock *loop_bb = func.addBasicBlock("loop", false);
+    BasicBlock *done_bb = func.addBasicBlock("done", false);
+    ir_builder.CreateCondBr(ir_builder.CreateICmpEQ(num_cycles, ConstantInt::get(cycle_type, 0)), done_bb, loop_bb);
+
+    func.setCurBasicBlock(loop_bb);
+    PHINode *cycle = ir_builder.CreatePHI(cycle_type, 2, "cycle");
+    cycle->addIncoming(ConstantInt::get(cycle_type, 0), entry_bb);
+
+    makeTopUpdateState(builder, defn, us_args, sim_state, func);
+
+    Value *next_cycle = ir_builder.CreateAdd(cycle, ConstantInt::get(cycle_type, 1), "next_cycle");
+    cycle->addIncoming(next_cycle, ir_builder.GetInsertBlock());
+    func.createCondBr(ir_builder.CreateICmpEQ(next_cycle, num_cycles), done_bb, loop_bb, BranchHint::Unlikely);
+
+    func.setCurBasicBlock(done_bb);
+    if (sim_state != state) {
+      ir_builder.CreateMemCpy(state, sim_state, state_bytes, state_align);
+    }
+  }
+
+  std::vector<Value *> co_args = loadStructArgs(co_inputs, co_sources.size(), func);
+  storeOutputs(makeTopComputeOutput(builder, defn, co_args, state, func), outputs, func);
+
+  ir_builder.CreateRetVoid();
+  func.verify();
+
+  return mod_env;
+}
+
+/* Groups start on cache lines, relative to the start of the buffer */
+static const uint64_t lane_group_align = 64;
+
+static uint64_t alignTo(uint64_t bytes, uint64_t align)
+{
+  return (bytes + align - 1) / align * align;
+}
+
+void LaneLayout::addPort(const std::string &name, unsigned width)
+{
+  uint64_t lane_bytes = getNumBytes(width);
+  uint64_t offset = alignTo(group_bytes, getAlignForBytes(lane_bytes));
+
+  port_indices[name] = offsets.size();
+  offsets.push_back(offset);
+  widths.push_back(width);
+  group_bytes = offset + lane_bytes * lane_width;
+}
+
+void LaneLayout::finish()
+{
+  group_bytes = alignTo(group_bytes, lane_group_align);
+}
+
+uint64_t LaneLayout::getLaneOffset(unsigned idx, unsigned lane) const
+{
+  return (lane / lane_width) * group_bytes + offsets[idx] + (lane % lane_width) * getNumBytes(widths[idx]);
+}
+
+uint64_t GetLaneGroupStateBytes(const Definition &defn, unsigned lane_width, bool shadow_state)
+{
+  uint64_t state_bytes = defn.getSimInfo().getNumStateBytes() * lane_width;
+  if (shadow_state) {
+    state_bytes *= 2;
+  }
+
+  return alignTo(state_bytes, lane_group_align);
+}
+
+/* Loops over the groups, each iteration being one step of the design
+ * for every lane in the group */
+ModuleEnvironment MakeBatchStepWrapper(Builder &builder, const Definition &defn)
+{
+  const unsigned lane_width = builder.getLaneWidth();
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_batch_step_wrapper", lane_width);
+  LLVMContext &context = mod_env.getContext();
+
+  const SimInfo &defn_info = defn.getSimInfo();
+  const std::vector<Source> & sources = defn.getIFace().getSources();
+  const std::vector<Sink> & sinks = defn.getIFace().getSinks();
+  const LaneLayout input_layout(sources, lane_width);
+  const LaneLayout output_layout(sinks, lane_width);
+  const uint64_t state_group_bytes =
+    GetLaneGroupStateBytes(defn, lane_width, builder.getCodegenOptions().shadow_state);
+
+  Type *group_type = Type::getInt64Ty(context);
+  FunctionType *wrapper_type =
+    FunctionType::get(Type::getVoidTy(context),
+                      {Type::getInt8PtrTy(context),
+                       Type::getInt8PtrTy(context),
+                       Type::getInt8PtrTy(context),
+                       group_type}, false);
+
+  FunctionEnvironment func = mod_env.makeFunction("batch_step", wrapper_type);
+  /* The buffers' sizes depend on the number of groups */
+  for (unsigned i = 0; i < 3; i++) {
+    addPointerAttributes(func.getFunction(), i, 0, 1);
+  }
+  func.attachDebugInfo(GetDebugListingName(defn));
+  BasicBlock *entry_bb = func.addBasicBlock("entry");
+  func.setCurBasicBlock(entry_bb);
+
+  IRBuilder<> &ir_builder = func.getIRBuilder();
+  Value *inputs = func.getFunction()->arg_begin();
+  Value *outputs = func.getFunction()->arg_begin() + 1;
+  Value *state = func.getFunction()->arg_begin() + 2;
+  Value *num_groups = func.getFunction()->arg_begin() + 3;
+  num_groups->setName("num_groups");
+
+  BasicBlock *loop_bb = func.addBasicBlock("loop", false);
+  BasicBlock *done_bb = func.addBasicBlock("done", false);
+  ir_builder.CreateCondBr(ir_builder.CreateICmpEQ(num_groups, ConstantInt::get(group_type, 0)), done_bb, loop_bb);
+
+  func.setCurBasicBlock(loop_bb);
+  PHINode *group = ir_builder.CreatePHI(group_type, 2, "group");
+  group->addIncoming(ConstantInt::get(group_type, 0), entry_bb);
+
+  auto getGroupBlock = [&](Value *buffer, uint64_t group_bytes, const Twine &name) {
+    Value *offset = ir_builder.CreateMul(group, ConstantInt::get(group_type, group_bytes), "", true, true);
+    return ir_builder.CreateInBoundsGEP(buffer, offset, name);
+  };
+  Value *group_inputs = getGroupBlock(inputs, input_layout.getGroupBytes(), "group_inputs");
+  Value *group_outputs = getGroupBlock(outputs, output_layout.getGroupBytes(), "group_outputs");
+  Value *group_state = getGroupBlock(state, state_group_bytes, "group_state");
+
+  for (unsigned i = 0; i < sources.size(); i++) {
+    Value *addr = ir_builder.CreateConstInBoundsGEP1_64(group_inputs, input_layout.getOffset(i));
+    func.addValue(&sources[i], LoadSignal(func, addr, sources[i].getWidth(), sources[i].getName()));
+  }
+
+  for (const Instance *inst : defn_info.getStepDeps()) {
+    func.setDebugLine(getDebugLine(defn, inst));
+    makeInstanceComputeOutput(inst, defn_info, func, group_state);
+  }
+
+  func.setDebugLine(1);
+  for (unsigned i = 0; i < sinks.size(); i++) {
+    Value *addr = ir_builder.CreateConstInBoundsGEP1_64(group_outputs, output_layout.getOffset(i));
+    StoreSignal(func, makeValueReference(sinks[i].getSelect(), func), addr);
+  }
+
+  Value *shadow = getTopShadow(defn, group_state, func);
+  for (const Instance *inst : defn_info.getStatefulInstances()) {
+    func.setDebugLine(getDebugLine(defn, inst));
+    makeInstanceUpdateState(inst, defn_info, func, group_state, shadow);
+  }
+  func.setDebugLine(1);
+  commitShadow(defn, group_state, shadow, func);
+
+  Value *next_group = ir_builder.CreateAdd(group, ConstantInt::get(group_type, 1), "next_group");
+  group->addIncoming(next_group, ir_builder.GetInsertBlock());
+  func.createCondBr(ir_builder.CreateICmpEQ(next_group, num_groups), done_bb, loop_bb, BranchHint::Unlikely);
+
+  func.setCurBasicBlock(done_bb);
+  ir_builder.CreateRetVoid();
+  func.verify();
+
+  return mod_env;
+}
+
 ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn)
 {
   ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_get_values_wrapper");
@@ -597,11 +1538,16 @@ ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn)
 
   FunctionType *wrapper_type =
     FunctionType::get(Type::getVoidTy(mod_env.getContext()),
-                      {ConstructStructType(sources, mod_env.getContext(), "gv_wrapper_input")->getPointerTo(),
+                      {ConstructStructType(sources, mod_env.getContext())->getPointerTo(),
                        Type::getInt8PtrTy(mod_env.getContext()),
                        Type::getInt8PtrTy(mod_env.getContext())}, false);
 
   FunctionEnvironment func = mod_env.makeFunction("get_values", wrapper_type);
+  addStructAttributes(func.getFunction(), 0, mod_env);
+  if (defn.getSimInfo().isStateful()) {
+    addStateAttributes(func.getFunction(), 1, defn);
+  }
+  func.attachDebugInfo(GetDebugListingName(defn));
   func.addBasicBlock("entry");
 
   Value *inputs = func.getFunction()->arg_begin();
@@ -640,9 +1586,9 @@ ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn)
   state_deps_args.push_back(zero);
 
   FunctionType *sd_type = makeStateDepsType(defn, mod_env);
-  Function *sd_underlying = mod_env.makeFunctionDecl(defn.getSafeName() + "_state_deps", sd_type);
+  Function *sd_underlying = makeDefinitionDecl(defn.getSafeName() + "_state_deps", sd_type, defn, mod_env);
   FunctionType *od_type = makeOutputDepsType(defn, mod_env);
-  Function *od_underlying = mod_env.makeFunctionDecl(defn.getSafeName() + "_output_deps", od_type);
+  Function *od_underlying = makeDefinitionDecl(defn.getSafeName() + "_output_deps", od_type, defn, mod_env);
 
   func.getIRBuilder().CreateCall(od_underlying, output_deps_args);
   func.getIRBuilder().CreateCall(sd_underlying, state_deps_args);
@@ -652,4 +1598,257 @@ ModuleEnvironment MakeGetValuesWrapper(Builder &builder, const Definition &defn)
   return mod_env;
 }
 
+/* Instances of a definition's output deps that share a mask of ports (see
+ * SimInfo's cones), and so always run or are skipped together */
+struct GuardedGroup {
+  PortMask mask;
+  std::vector<const Instance *> insts;
+};
+
+/* An instance reads only from instances whose input deps are a subset of
+ * its own, and whose demanding sinks are a superset of its own. Ordering
+ * the groups by mask size (ascending for input deps, descending for
+ * demanding sinks) therefore keeps every group after the ones it reads. */
+static std::vector<GuardedGroup> groupByMask(const Definition &definition, bool by_inputs, unsigned init_bit)
+{
+  const SimInfo &defn_info = definition.getSimInfo();
+
+  std::vector<GuardedGroup> groups;
+  std::map<std::vector<uint64_t>, unsigned> group_idx;
+  for (const Instance *inst : defn_info.getOutputDeps()) {
+    PortMask mask = by_inputs ? defn_info.getInputDeps(inst) : defn_info.getDemandingSinks(inst);
+    if (by_inputs) {
+      mask.set(init_bit);
+    }
+
+    auto iter = group_idx.find(mask.getWords());
+    if (iter == group_idx.end()) {
+      iter = group_idx.emplace(mask.getWords(), groups.size()).first;
+      groups.push_back({ mask, {} });
+    }
+    groups[iter->second].insts.push_back(inst);
+  }
+
+  std::stable_sort(groups.begin(), groups.end(), [by_inputs](const GuardedGroup &a, const GuardedGroup &b) {
+    return by_inputs ? a.mask.count() < b.mask.count() : a.mask.count() > b.mask.count();
+  });
+
+  return groups;
+}
+
+/* Every source of the output deps gets a slot, so values of groups that
+ * are skipped can be reloaded from the previous call */
+static std::unordered_map<const Source *, uint64_t> getChangeCacheOffsets(const Definition &definition,
+                                                                          uint64_t &num_bytes)
+{
+  std::unordered_map<const Source *, uint64_t> offsets;
+  num_bytes = 0;
+  for (const Instance *inst : definition.getSimInfo().getOutputDeps()) {
+    for (const Source &src : inst->getIFace().getSources()) {
+      offsets[&src] = num_bytes;
+      num_bytes += (src.getWidth() + 63) / 64 * 8;
+    }
+  }
+
+  return offsets;
+}
+
+uint64_t GetChangeCacheBytes(const Definition &definition)
+{
+  uint64_t num_bytes;
+  getChangeCacheOffsets(definition, num_bytes);
+
+  return num_bytes;
+}
+
+unsigned GetNumMaskWords(const Definition &definition, bool changed)
+{
+  const IFace &iface = definition.getIFace();
+  unsigned num_bits = changed ? iface.getSources().size() + 2 : iface.getSinks().size();
+
+  return (num_bits + 63) / 64;
+}
+
+/* True if any port of mask is set in the mask argument */
+static Value * makeMaskTest(const PortMask &mask, Value *mask_ptr, FunctionEnvironment &env)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Type *word_type = Type::getInt64Ty(env.getContext());
+
+  Value *any_set = nullptr;
+  const std::vector<uint64_t> &words = mask.getWords();
+  for (unsigned i = 0; i < words.size(); i++) {
+    if (words[i] == 0) {
+      continue;
+    }
+
+    Value *word = ir_builder.CreateAlignedLoad(ir_builder.CreateConstInBoundsGEP1_64(mask_ptr, i), 8);
+    Value *bits = ir_builder.CreateAnd(word, ConstantInt::get(word_type, words[i]));
+    any_set = any_set ? ir_builder.CreateOr(any_set, bits) : bits;
+  }
+
+  if (!any_set) {
+    return ConstantInt::getFalse(env.getContext());
+  }
+
+  return ir_builder.CreateICmpNE(any_set, ConstantInt::get(word_type, 0));
+}
+
+/* Emits a group behind a test of its mask. When the group is skipped its
+ * values are reloaded from cache, or left undefined without one, which is
+ * safe since only skipped groups and unselected sinks can read them. */
+static void makeGuardedGroup(const GuardedGroup &group, const Definition &definition, Value *mask_ptr,
+                             Value *state_ptr, Value *cache,
+                             const std::unordered_map<const Source *, uint64_t> &cache_offsets,
+                             FunctionEnvironment &env)
+{
+  const SimInfo &defn_info = definition.getSimInfo();
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+
+  BasicBlock *compute_bb = env.addBasicBlock("compute", false);
+  BasicBlock *reuse_bb = cache ? env.addBasicBlock("reuse", false) : nullptr;
+  BasicBlock *merge_bb = env.addBasicBlock("merge", false);
+  BasicBlock *skip_pred = ir_builder.GetInsertBlock();
+  env.createCondBr(makeMaskTest(group.mask, mask_ptr, env), compute_bb, cache ? reuse_bb : merge_bb);
+
+  env.setCurBasicBlock(compute_bb);
+  std::vector<const Source *> group_sources;
+  for (const Instance *inst : group.insts) {
+    env.setDebugLine(getDebugLine(definition, inst));
+    makeInstanceComputeOutput(inst, defn_info, env, state_ptr);
+    for (const Source &src : inst->getIFace().getSources()) {
+      group_sources.push_back(&src);
+    }
+  }
+  env.setDebugLine(1);
+
+  std::vector<Value *> computed;
+  for (const Source *src : group_sources) {
+    computed.push_back(env.lookupValue(src));
+    if (cache) {
+      ir_builder.CreateAlignedStore(computed.back(), getSlotAddr(cache_offsets.find(src)->second, src, cache, env), 8);
+    }
+  }
+  BasicBlock *compute_pred = ir_builder.GetInsertBlock();
+  ir_builder.CreateBr(merge_bb);
+
+  std::vector<Value *> reused;
+  if (cache) {
+    env.setCurBasicBlock(reuse_bb);
+    for (const Source *src : group_sources) {
+      reused.push_back(ir_builder.CreateAlignedLoad(getSlotAddr(cache_offsets.find(src)->second, src, cache, env), 8));
+    }
+    skip_pred = reuse_bb;
+    ir_builder.CreateBr(merge_bb);
+  }
+
+  env.setCurBasicBlock(merge_bb);
+  for (unsigned i = 0; i < group_sources.size(); i++) {
+    PHINode *phi = ir_builder.CreatePHI(computed[i]->getType(), 2, group_sources[i]->getName());
+    phi->addIncoming(computed[i], compute_pred);
+    phi->addIncoming(cache ? reused[i] : UndefValue::get(computed[i]->getType()), skip_pred);
+    env.addValue(group_sources[i], phi);
+  }
+}
+
+/* compute_output_demand takes a mask of the sinks to compute, and
+ * compute_output_changed a mask of the inputs changed since its last call
+ * (see JITFrontend). Sinks outside the mask are left as they were in the
+ * output struct. */
+static ModuleEnvironment makePartialComputeOutputWrapper(Builder &builder, const Definition &defn, bool changed)
+{
+  const std::string name = changed ? "compute_output_changed" : "compute_output_demand";
+  ModuleEnvironment mod_env = builder.makeModule(defn.getSafeName() + "_" + name + "_wrapper");
+
+  const SimInfo &defn_info = defn.getSimInfo();
+  const std::vector<const Source *> & sources = defn_info.getOutputSources();
+  const std::vector<Sink> & sinks = defn.getIFace().getSinks();
+
+  std::vector<Type *> arg_types = { ConstructStructType(sources, mod_env.getContext())->getPointerTo(),
+                                    ConstructStructType(sinks, mod_env.getContext())->getPointerTo(),
+                                    Type::getInt8PtrTy(mod_env.getContext()),
+                                    Type::getInt64PtrTy(mod_env.getContext()) };
+  if (changed) {
+    arg_types.push_back(Type::getInt8PtrTy(mod_env.getContext()));
+  }
+
+  FunctionType *wrapper_type = FunctionType::get(Type::getVoidTy(mod_env.getContext()), arg_types, false);
+
+  uint64_t cache_bytes = 0;
+  std::unordered_map<const Source *, uint64_t> cache_offsets;
+  if (changed) {
+    cache_offsets = getChangeCacheOffsets(defn, cache_bytes);
+  }
+
+  FunctionEnvironment func = mod_env.makeFunction(name, wrapper_type);
+  addStructAttributes(func.getFunction(), 0, mod_env);
+  addStructAttributes(func.getFunction(), 1, mod_env);
+  if (defn_info.isStateful()) {
+    addStateAttributes(func.getFunction(), 2, defn);
+  }
+  addPointerAttributes(func.getFunction(), 3, GetNumMaskWords(defn, changed) * 8, 8);
+  if (changed) {
+    addPointerAttributes(func.getFunction(), 4, cache_bytes, 8);
+  }
+  func.attachDebugInfo(GetDebugListingName(defn));
+  func.setCurBasicBlock(func.addBasicBlock("entry"));
+
+  Value *inputs = func.getFunction()->arg_begin();
+  Value *outputs = func.getFunction()->arg_begin() + 1;
+  Value *state = func.getFunction()->arg_begin() + 2;
+  Value *mask_ptr = func.getFunction()->arg_begin() + 3;
+  Value *cache = changed ? func.getFunction()->arg_begin() + 4 : nullptr;
+  if (!defn_info.isStateful()) {
+    state = nullptr;
+  }
+
+  for (unsigned i = 0; i < sources.size(); i++) {
+    Value *arg = func.getIRBuilder().CreateStructGEP(inputs->getType()->getPointerElementType(), inputs, i);
+    func.addValue(sources[i], func.getIRBuilder().CreateLoad(arg));
+  }
+
+  /* Set on the first call, so everything is computed and cached once */
+  const unsigned init_bit = defn_info.getStateBit() + 1;
+  for (const GuardedGroup &group : groupByMask(defn, changed, init_bit)) {
+    makeGuardedGroup(group, defn, mask_ptr, state, cache, cache_offsets, func);
+  }
+
+  for (unsigned i = 0; i < sinks.size(); i++) {
+    PortMask mask;
+    if (changed) {
+      mask = defn_info.getSinkInputDeps(i);
+      mask.set(init_bit);
+    } else {
+      mask.set(i);
+    }
+
+    BasicBlock *store_bb = func.addBasicBlock("store." + sinks[i].getName(), false);
+    BasicBlock *next_bb = func.addBasicBlock("next", false);
+    func.createCondBr(makeMaskTest(mask, mask_ptr, func), store_bb, next_bb);
+
+    func.setCurBasicBlock(store_bb);
+    Value *val = makeValueReference(sinks[i].getSelect(), func);
+    Value *addr = func.getIRBuilder().CreateStructGEP(outputs->getType()->getPointerElementType(), outputs, i);
+    func.getIRBuilder().CreateStore(val, addr);
+    func.getIRBuilder().CreateBr(next_bb);
+
+    func.setCurBasicBlock(next_bb);
+  }
+
+  func.getIRBuilder().CreateRetVoid();
+  func.verify();
+
+  return mod_env;
+}
+
+ModuleEnvironment MakeComputeOutputDemandWrapper(Builder &builder, const Definition &defn)
+{
+  return makePartialComputeOutputWrapper(builder, defn, false);
+}
+
+ModuleEnvironment MakeComputeOutputChangedWrapper(Builder &builder, const Definition &defn)
+{
+  return makePartialComputeOutputWrapper(builder, defn, true);
+}
+
 }
@@ -0,0 +1,133 @@
+#include <jitsim/compile_stats.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+double CompileStats::getElapsedMS(Clock::time_point start)
+{
+  return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+uint64_t CompileStats::countInstructions(const Module &module)
+{
+  uint64_t num_instructions = 0;
+  for (const Function &func : module) {
+    for (const BasicBlock &bb : func) {
+      num_instructions += bb.size();
+    }
+  }
+
+  return num_instructions;
+}
+
+uint64_t CompileStats::getCodeBytes(const object::ObjectFile &obj)
+{
+  uint64_t code_bytes = 0;
+  for (const object::SectionRef &section : obj.sections()) {
+    if (section.isText()) {
+      code_bytes += section.getSize();
+    }
+  }
+
+  return code_bytes;
+}
+
+void CompileStats::recordGenerate(const string &name, double ms)
+{
+  lock_guard<mutex> guard(stats_lock);
+  ModuleStats &stats = modules[name];
+  stats.num_compiles++;
+  stats.generate_ms += ms;
+}
+
+void CompileStats::recordCacheHit(const string &name, uint64_t code_bytes)
+{
+  lock_guard<mutex> guard(stats_lock);
+  ModuleStats &stats = modules[name];
+  stats.num_cache_hits++;
+  stats.code_bytes = code_bytes;
+}
+
+void CompileStats::recordOptimize(const string &name, double ms, uint64_t num_instructions)
+{
+  lock_guard<mutex> guard(stats_lock);
+  ModuleStats &stats = modules[name];
+  stats.optimize_ms += ms;
+  stats.num_instructions = num_instructions;
+}
+
+void CompileStats::recordCodegen(const string &name, double ms, uint64_t code_bytes)
+{
+  lock_guard<mutex> guard(stats_lock);
+  ModuleStats &stats = modules[name];
+  stats.codegen_ms += ms;
+  stats.code_bytes = code_bytes;
+}
+
+map<string, ModuleStats> CompileStats::getModuleStats() const
+{
+  lock_guard<mutex> guard(stats_lock);
+  return modules;
+}
+
+static double getTotalMS(const ModuleStats &stats)
+{
+  return stats.generate_ms + stats.optimize_ms + stats.codegen_ms;
+}
+
+/* Module names are generated from safe names, but escape them anyway */
+static string escapeJSON(const string &str)
+{
+  string escaped;
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+
+  return escaped;
+}
+
+bool CompileStats::writeJSON(const string &path) const
+{
+  ofstream out(path);
+  if (!out) {
+    return false;
+  }
+
+  map<string, ModuleStats> snapshot = getModuleStats();
+  vector<const pair<const string, ModuleStats> *> sorted;
+  for (const auto &module : snapshot) {
+    sorted.push_back(&module);
+  }
+  stable_sort(sorted.begin(), sorted.end(), [](const pair<const string, ModuleStats> *a,
+                                               const pair<const string, ModuleStats> *b) {
+    return getTotalMS(a->second) > getTotalMS(b->second);
+  });
+
+  out << "{\n  \"modules\": [";
+  for (unsigned i = 0; i < sorted.size(); i++) {
+    const ModuleStats &stats = sorted[i]->second;
+    out << (i ? ",\n" : "\n");
+    out << "    { \"name\": \"" << escapeJSON(sorted[i]->first) << "\""
+        << ", \"compiles\": " << stats.num_compiles
+        << ", \"cache_hits\": " << stats.num_cache_hits
+        << ", \"generate_ms\": " << stats.generate_ms
+        << ", \"optimize_ms\": " << stats.optimize_ms
+        << ", \"codegen_ms\": " << stats.codegen_ms
+        << ", \"instructions\": " << stats.num_instructions
+        << ", \"code_bytes\": " << stats.code_bytes << " }";
+  }
+  out << "\n  ]\n}\n";
+
+  return !!out;
+}
+
+}
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cmath>
 #include "coreir_primitives.hpp"
+#include "lane_lowering.hpp"
 #include "utils.hpp"
+#include "wide_lowering.hpp"
 
 #include <coreir/ir/namespace.h>
 #include <coreir/ir/value.h>
@@ -18,7 +21,7 @@ Primitive BuildAdd(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *sum = env.getIRBuilder().CreateAdd(lhs, rhs, "sum");
+      llvm::Value *sum = LowerAdd(env, lhs, rhs, "sum");
       
       return std::vector<llvm::Value *> { sum };
     }
@@ -32,7 +35,7 @@ Primitive BuildSub(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *diff = env.getIRBuilder().CreateSub(lhs, rhs, "diff");
+      llvm::Value *diff = LowerSub(env, lhs, rhs, "diff");
       
       return std::vector<llvm::Value *> { diff };
     }
@@ -46,7 +49,7 @@ Primitive BuildMul(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *prod = env.getIRBuilder().CreateMul(lhs, rhs, "prod");
+      llvm::Value *prod = LowerMul(env, lhs, rhs, "prod");
 
       return std::vector<llvm::Value *> { prod };
     }
@@ -60,7 +63,7 @@ Primitive BuildEq(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpEQ(lhs, rhs, "eq_comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_EQ, lhs, rhs, "eq_comp");
 
       return std::vector<llvm::Value *> { comp };
     }
@@ -74,7 +77,7 @@ Primitive BuildNeq(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpNE(lhs, rhs, "neq_comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_NE, lhs, rhs, "neq_comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -87,7 +90,7 @@ Primitive BuildUGT(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpUGT(lhs, rhs, "comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_UGT, lhs, rhs, "comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -100,7 +103,7 @@ Primitive BuildUGE(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpUGE(lhs, rhs, "comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_UGE, lhs, rhs, "comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -113,7 +116,7 @@ Primitive BuildULT(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpULT(lhs, rhs, "comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_ULT, lhs, rhs, "comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -126,7 +129,7 @@ Primitive BuildULE(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpULE(lhs, rhs, "comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_ULE, lhs, rhs, "comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -139,7 +142,7 @@ Primitive BuildSGT(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpSGT(lhs, rhs, "comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_SGT, lhs, rhs, "comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -152,7 +155,7 @@ Primitive BuildSGE(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpSGE(lhs, rhs, "comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_SGE, lhs, rhs, "comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -165,7 +168,7 @@ Primitive BuildSLT(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpSLT(lhs, rhs, "comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_SLT, lhs, rhs, "comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -178,7 +181,7 @@ Primitive BuildSLE(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *comp = env.getIRBuilder().CreateICmpSLT(lhs, rhs, "comp");
+      llvm::Value *comp = LowerICmp(env, llvm::CmpInst::ICMP_SLT, lhs, rhs, "comp");
       return std::vector<llvm::Value *> { comp };
     }
   );
@@ -193,22 +196,24 @@ Primitive BuildReg(CoreIR::Module *mod)
     }
   }
 
-  return Primitive(true, getNumBytes(width),
+  Primitive reg(true, getNumBytes(width),
     { "in" }, {},
     [width](auto &env, auto &args, auto &inst)
     {
-      llvm::Value *addr = env.getIRBuilder().CreateBitCast(args[0], llvm::Type::getIntNPtrTy(env.getContext(), width));
-      llvm::Value *output = env.getIRBuilder().CreateLoad(addr, "output");
+      llvm::Value *output = LoadSignal(env, args[0], width, "output");
 
       return std::vector<llvm::Value *> { output };
     },
     [width](auto &env, auto &args, auto &inst)
     {
       llvm::Value *input = args[0];
-      llvm::Value *addr = env.getIRBuilder().CreateBitCast(args[1], llvm::Type::getIntNPtrTy(env.getContext(), width));
-      env.getIRBuilder().CreateStore(input, addr);
+      llvm::Value *state = env.getModule().getCodegenOptions().shadow_state ? args[2] : args[1];
+      StoreSignal(env, input, state);
     }
   );
+  reg.overwrites_state = true;
+
+  return reg;
 }
 
 Primitive BuildMux(CoreIR::Module *mod)
@@ -222,17 +227,65 @@ Primitive BuildMux(CoreIR::Module *mod)
 
       llvm::Value *if_cond =
         env.getIRBuilder().CreateICmpEQ(sel,
-                                        llvm::ConstantInt::get(env.getContext(), llvm::APInt(1, 0)),
+                                        llvm::ConstantInt::get(sel->getType(), 0),
                                         "ifcond");
 
       llvm::Value *result =
-        env.getIRBuilder().CreateSelect(if_cond, lhs, rhs, "result");
+        env.createSelect(if_cond, lhs, rhs, "result");
 
       return std::vector<llvm::Value *> { result };
     }
   );
 }      
       
+/* Addresses are only out of range when the memory is smaller than the
+ * address width can index */
+static bool needsBoundsCheck(llvm::Value *addr, unsigned depth)
+{
+  unsigned addr_bits = addr->getType()->getScalarSizeInBits();
+  return addr_bits >= 32 || depth < (1u << addr_bits);
+}
+
+/* Lanes read and write their own copy of the memory, so a branch on the
+ * address or wen becomes a mask on a gather or scatter of every lane.
+ * Words are stored whole (elem_bytes each) so the lanes of a word are
+ * evenly spaced. */
+static llvm::Value * makeLaneMemRead(FunctionEnvironment &env, llvm::Value *raddr, llvm::Value *state_addr,
+                                     int width, unsigned depth, unsigned elem_bytes)
+{
+  llvm::IRBuilder<> &ir_builder = env.getIRBuilder();
+  llvm::Type *elem_type = env.getModule().getValueType(elem_bytes * 8);
+
+  llvm::Value *addrs = GetLaneWordAddrs(env, state_addr, elem_type->getScalarType(), raddr);
+  llvm::Value *valid_cond = nullptr;
+  if (needsBoundsCheck(raddr, depth)) {
+    valid_cond = ir_builder.CreateICmpULT(raddr, llvm::ConstantInt::get(raddr->getType(), depth), "valid_cond");
+  }
+
+  /* Out of range lanes read 0, as in the scalar version */
+  llvm::Value *words = ir_builder.CreateMaskedGather(addrs, min(elem_bytes, 8u), valid_cond,
+                                                     llvm::Constant::getNullValue(elem_type), "words");
+
+  return ir_builder.CreateTrunc(words, env.getModule().getValueType(width), "rdata");
+}
+
+static void makeLaneMemWrite(FunctionEnvironment &env, llvm::Value *waddr, llvm::Value *wdata, llvm::Value *wen,
+                             llvm::Value *state_addr, unsigned depth, unsigned elem_bytes)
+{
+  llvm::IRBuilder<> &ir_builder = env.getIRBuilder();
+  llvm::Type *elem_type = env.getModule().getValueType(elem_bytes * 8);
+
+  llvm::Value *addrs = GetLaneWordAddrs(env, state_addr, elem_type->getScalarType(), waddr);
+  llvm::Value *write_cond = wen;
+  if (needsBoundsCheck(waddr, depth)) {
+    llvm::Value *valid_cond =
+      ir_builder.CreateICmpULT(waddr, llvm::ConstantInt::get(waddr->getType(), depth), "valid_cond");
+    write_cond = ir_builder.CreateAnd(write_cond, valid_cond, "write_cond");
+  }
+
+  ir_builder.CreateMaskedScatter(ir_builder.CreateZExt(wdata, elem_type), addrs, min(elem_bytes, 8u), write_cond);
+}
+
 Primitive BuildMem(CoreIR::Module *mod)
 {
   int width = 0; 
@@ -246,34 +299,55 @@ Primitive BuildMem(CoreIR::Module *mod)
     }
   }
 
-  return Primitive(true, getNumBytes(width*depth),
+  /* Words are laid out at the stride of an iN, so indexing with a GEP
+   * stays inside the state */
+  unsigned elem_bytes = getMemElementBytes(width);
+  unsigned elem_align = min(elem_bytes, 8u);
+
+  return Primitive(true, elem_bytes*depth,
     { "waddr", "wdata", "wen" }, { "raddr" },
-    [width, depth](auto &env, auto &args, auto &inst)
+    [width, depth, elem_bytes, elem_align](auto &env, auto &args, auto &inst)
     {
       llvm::Value *raddr = args[0];
       llvm::Value *state_addr = args[1];
 
+      if (env.getModule().getLanes() > 1) {
+        return std::vector<llvm::Value *> { makeLaneMemRead(env, raddr, state_addr, width, depth, elem_bytes) };
+      }
+
+      llvm::Value *cast_addr = 
+        env.getIRBuilder().CreateBitCast(state_addr,
+                                         llvm::Type::getIntNPtrTy(env.getContext(), width));
+
+      /* Every address is in range when depth covers the address width, so
+       * there is nothing to check */
+      if (!needsBoundsCheck(raddr, depth)) {
+        llvm::Value *full_addr = env.getIRBuilder().CreateZExt(raddr, llvm::Type::getInt64Ty(env.getContext()));
+        llvm::Value *addr = env.getIRBuilder().CreateInBoundsGEP(cast_addr, full_addr, "addr");
+        llvm::Value *rdata = env.getIRBuilder().CreateAlignedLoad(addr, elem_align, "rdata");
+
+        return std::vector<llvm::Value *> { rdata };
+      }
+
       // Check if raddr < depth
       llvm::Value *valid_cond =
         env.getIRBuilder().CreateICmpULT(raddr, 
-                                         llvm::ConstantInt::get(env.getContext(), llvm::APInt(ceil(log2(depth)), 1)),
+                                         llvm::ConstantInt::get(raddr->getType(), depth),
                                          "valid_cond");
       llvm::BasicBlock *then_bb = env.addBasicBlock("then", false);
       llvm::BasicBlock *else_bb = env.addBasicBlock("else", false);
       llvm::BasicBlock *merge_bb = env.addBasicBlock("merge", false);
-      env.getIRBuilder().CreateCondBr(valid_cond, then_bb, else_bb);
+      /* Out of range reads are rare, keep them out of the hot path */
+      env.createCondBr(valid_cond, then_bb, else_bb, BranchHint::Likely);
 
       // Emit then block.
       env.setCurBasicBlock(then_bb);
-      llvm::Value *cast_addr = 
-        env.getIRBuilder().CreateBitCast(state_addr,
-                                         llvm::Type::getIntNPtrTy(env.getContext(), width));
 
       /* Need to 0 extend this to the address width or llvm interprets it as negative */
       llvm::Value *full_addr = env.getIRBuilder().CreateZExt(raddr, llvm::Type::getInt64Ty(env.getContext()));
 
       llvm::Value *addr = env.getIRBuilder().CreateInBoundsGEP(cast_addr, full_addr, "addr");
-      llvm::Value *rdata = env.getIRBuilder().CreateLoad(addr, "rdata");
+      llvm::Value *rdata = env.getIRBuilder().CreateAlignedLoad(addr, elem_align, "rdata");
       
       env.getIRBuilder().CreateBr(merge_bb);
 
@@ -293,24 +367,33 @@ Primitive BuildMem(CoreIR::Module *mod)
 
       return std::vector<llvm::Value *> { phi_node };
     },
-    [width, depth](auto &env, auto &args, auto &inst)
+    [width, depth, elem_bytes, elem_align](auto &env, auto &args, auto &inst)
     {
       llvm::Value *waddr = args[0];
       llvm::Value *wdata = args[1];
       llvm::Value *wen = args[2];
       llvm::Value *state_addr = args[3];
 
-      // Check if waddr < depth
-      llvm::Value *valid_cond =
-        env.getIRBuilder().CreateICmpULT(waddr, 
-                                         llvm::ConstantInt::get(env.getContext(), llvm::APInt(ceil(log2(depth)), 1)),
-                                         "valid_cond");
-      llvm::BasicBlock *valid_then_bb = env.addBasicBlock("valid_then", false);
-      llvm::BasicBlock *valid_else_bb = env.addBasicBlock("valid_else", false);
-      env.getIRBuilder().CreateCondBr(valid_cond, valid_then_bb, valid_else_bb);
-
-      // Emit valid_then block.
-      env.setCurBasicBlock(valid_then_bb);
+      if (env.getModule().getLanes() > 1) {
+        makeLaneMemWrite(env, waddr, wdata, wen, state_addr, depth, elem_bytes);
+        return;
+      }
+
+      bool check_addr = needsBoundsCheck(waddr, depth);
+      llvm::BasicBlock *valid_else_bb = nullptr;
+      if (check_addr) {
+        // Check if waddr < depth
+        llvm::Value *valid_cond =
+          env.getIRBuilder().CreateICmpULT(waddr, 
+                                           llvm::ConstantInt::get(waddr->getType(), depth),
+                                           "valid_cond");
+        llvm::BasicBlock *valid_then_bb = env.addBasicBlock("valid_then", false);
+        valid_else_bb = env.addBasicBlock("valid_else", false);
+        env.createCondBr(valid_cond, valid_then_bb, valid_else_bb, BranchHint::Likely);
+
+        // Emit valid_then block.
+        env.setCurBasicBlock(valid_then_bb);
+      }
 
       llvm::Value *cast_addr = 
         env.getIRBuilder().CreateBitCast(state_addr,
@@ -327,17 +410,19 @@ Primitive BuildMem(CoreIR::Module *mod)
 
       llvm::BasicBlock *wen_then_bb = env.addBasicBlock("wen_then", false);
       llvm::BasicBlock *wen_else_bb = env.addBasicBlock("wen_else", false);
-      env.getIRBuilder().CreateCondBr(wen_cond, wen_then_bb, wen_else_bb);
+      env.createCondBr(wen_cond, wen_then_bb, wen_else_bb);
 
       // Emit wen_then block.
       env.setCurBasicBlock(wen_then_bb);
-      env.getIRBuilder().CreateStore(wdata, addr);
+      env.getIRBuilder().CreateAlignedStore(wdata, addr, elem_align);
       env.getIRBuilder().CreateBr(wen_else_bb);
 
       env.setCurBasicBlock(wen_else_bb); // wen_else
-      env.getIRBuilder().CreateBr(valid_else_bb); 
+      if (check_addr) {
+        env.getIRBuilder().CreateBr(valid_else_bb); 
 
-      env.setCurBasicBlock(valid_else_bb); // valid_else
+        env.setCurBasicBlock(valid_else_bb); // valid_else
+      }
     }
   );
 }      
@@ -349,7 +434,7 @@ Primitive BuildLShr(CoreIR::Module *mod)
     {
       llvm::Value *value = args[0];
       llvm::Value *shift_amount = args[1];
-      llvm::Value *result = env.getIRBuilder().CreateLShr(value, shift_amount, "shift_res");
+      llvm::Value *result = LowerLShr(env, value, shift_amount, "shift_res");
       return std::vector<llvm::Value *> { result };
     }
   );
@@ -362,7 +447,7 @@ Primitive BuildAShr(CoreIR::Module *mod)
     {
       llvm::Value *value = args[0];
       llvm::Value *shift_amount = args[1];
-      llvm::Value *result = env.getIRBuilder().CreateAShr(value, shift_amount, "shift_res");
+      llvm::Value *result = LowerAShr(env, value, shift_amount, "shift_res");
       return std::vector<llvm::Value *> { result };
     }
   );
@@ -375,7 +460,7 @@ Primitive BuildShl(CoreIR::Module *mod)
     {
       llvm::Value *value = args[0];
       llvm::Value *shift_amount = args[1];
-      llvm::Value *result = env.getIRBuilder().CreateShl(value, shift_amount, "shift_res");
+      llvm::Value *result = LowerShl(env, value, shift_amount, "shift_res");
       return std::vector<llvm::Value *> { result };
     }
   );
@@ -388,7 +473,7 @@ Primitive BuildAnd(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *result = env.getIRBuilder().CreateAnd(lhs, rhs, "and_res");
+      llvm::Value *result = LowerAnd(env, lhs, rhs, "and_res");
       return std::vector<llvm::Value *> { result };
     }
   );
@@ -401,7 +486,7 @@ Primitive BuildOr(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *result = env.getIRBuilder().CreateOr(lhs, rhs, "or_res");
+      llvm::Value *result = LowerOr(env, lhs, rhs, "or_res");
       return std::vector<llvm::Value *> { result };
     }
   );
@@ -414,7 +499,7 @@ Primitive BuildXor(CoreIR::Module *mod)
     {
       llvm::Value *lhs = args[0];
       llvm::Value *rhs = args[1];
-      llvm::Value *result = env.getIRBuilder().CreateXor(lhs, rhs, "xor_res");
+      llvm::Value *result = LowerXor(env, lhs, rhs, "xor_res");
       return std::vector<llvm::Value *> { result };
     }
   );
@@ -426,7 +511,7 @@ Primitive BuildNot(CoreIR::Module *mod)
     [](auto &env, auto &args, auto &inst)
     {
       llvm::Value *value = args[0];
-      llvm::Value *result = env.getIRBuilder().CreateNot(value, "not_res");
+      llvm::Value *result = LowerNot(env, value, "not_res");
       return std::vector<llvm::Value *> { result };
     }
   );
@@ -484,7 +569,16 @@ Primitive BuildCoreIRPrimitive(CoreIR::Module *mod)
   auto iter = prim_map.find(fullname);
   assert(iter != prim_map.end());
 
-  return iter->second(mod);
+  Primitive prim = iter->second(mod);
+
+  /* getGenArgs is an ordered map, so this is stable between runs */
+  string gen_args;
+  for (const auto & val : mod->getGenArgs()) {
+    gen_args += val.first + "=" + val.second->toString() + ";";
+  }
+  prim.gen_args = gen_args;
+
+  return prim;
 }
 
 }
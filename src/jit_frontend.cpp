@@ -5,6 +5,11 @@
 
 #include <llvm/IR/ValueSymbolTable.h>
 
+#include <atomic>
+#include <chrono>
+#include <regex>
+#include <unordered_set>
+
 namespace JITSim {
 
 using namespace std;
@@ -19,37 +24,35 @@ template <typename T>
 LLVMStruct::LLVMStruct(const vector<T> &members,
                        const llvm::DataLayout &data_layout,
                        llvm::LLVMContext &context)
-  : type(ConstructStructType(members, context)),
-    layout(data_layout.getStructLayout(type)),
+  : offsets(),
+    widths(),
     member_indices(),
-    data(layout->getSizeInBytes(), 0)
+    data()
 {
+  const llvm::StructLayout *layout = data_layout.getStructLayout(ConstructStructType(members, context));
+
   for (unsigned i = 0; i < members.size(); i++) {
     const auto &m = condDeref(members[i]);
+    offsets.push_back(layout->getElementOffset(i));
+    widths.push_back(m.getWidth());
     member_indices[m.getName()] = i;
   }
+  data.resize(layout->getSizeInBytes(), 0);
 }
 
 uint8_t * LLVMStruct::getMemberAddr(int idx)
 {
-  uint8_t *ptr = data.data();
-  uint64_t offset = layout->getElementOffset(idx);
-
-  return ptr + offset;
+  return data.data() + offsets[idx];
 }
 
 const uint8_t * LLVMStruct::getMemberAddr(int idx) const
 {
-  const uint8_t *ptr = data.data();
-  uint64_t offset = layout->getElementOffset(idx);
-
-  return ptr + offset;
+  return data.data() + offsets[idx];
 }
 
 int LLVMStruct::getMemberBits(int idx) const
 {
-  llvm::Type *elemty = type->getElementType(idx);
-  return elemty->getIntegerBitWidth();
+  return widths[idx];
 }
 
 void LLVMStruct::setMember(const string &name, llvm::APInt val)
@@ -63,10 +66,8 @@ void LLVMStruct::setMember(const string &name, llvm::APInt val)
   memcpy(ptr, val.getRawData(), getNumBytes(getMemberBits(idx)));
 }
 
-llvm::APInt LLVMStruct::getValue(int idx) const 
+static llvm::APInt readAPInt(const uint8_t *ptr, int bits)
 {
-  const uint8_t *ptr = getMemberAddr(idx);
-  int bits = getMemberBits(idx);
   int bytes = bits / 8;
   if (bits % 8 != 0) {
     bytes++;
@@ -81,6 +82,11 @@ llvm::APInt LLVMStruct::getValue(int idx) const
   return llvm::APInt(bits, llvm::ArrayRef<uint64_t>(safe_arr.data(), num64s));
 }
 
+llvm::APInt LLVMStruct::getValue(int idx) const 
+{
+  return readAPInt(getMemberAddr(idx), getMemberBits(idx));
+}
+
 llvm::APInt LLVMStruct::getValue(const string &name) const
 {
   int idx = member_indices.find(name)->second;
@@ -94,109 +100,748 @@ void LLVMStruct::dump() const
   }
 }
 
-void JITFrontend::addDefinitionFunctions(const Definition &defn)
+/* The first tier counts calls so hot definitions can be recompiled */
+shared_ptr<llvm::Module> JITFrontend::countCalls(ModuleEnvironment &&env, const Definition &defn,
+                                                 const string &fn_name)
 {
+  if (tiers) {
+    tiers->addCallCounter(*env.getModule(), fn_name, defn);
+  }
+
+  return env.getModule();
+}
+
+string JITFrontend::getCacheKey(const Definition &defn, bool counted) const
+{
+  return GetCacheKey(defn, builder->getCodegenOptions(), !jit.getCodeLayout().empty(), counted && tiers);
+}
+
+void JITFrontend::addSimulationFunctions(const Definition &defn)
+{
+  const std::string cache_key = getCacheKey(defn, true);
+
   jit.addLazyFunction(defn.getSafeName() + "_update_state", [this, &defn]() {
-    ModuleEnvironment env = MakeUpdateState(builder, defn);
+    ModuleEnvironment env = MakeUpdateState(*builder, defn);
 
-    return env.getModule();
-  });
+    return countCalls(move(env), defn, defn.getSafeName() + "_update_state");
+  }, cache_key);
 
   jit.addLazyFunction(defn.getSafeName() + "_compute_output", [this, &defn]() {
-    ModuleEnvironment env = MakeComputeOutput(builder, defn);
+    ModuleEnvironment env = MakeComputeOutput(*builder, defn);
 
-    return env.getModule();
-  });
+    return countCalls(move(env), defn, defn.getSafeName() + "_compute_output");
+  }, cache_key);
+}
 
-  jit.addLazyFunction(defn.getSafeName() + "_state_deps", [this, &defn]() {
-    ModuleEnvironment env = MakeStateDeps(builder, defn);
-    shared_ptr<llvm::Module> mod = env.getModule();
-    debug_modules.emplace(defn.getSafeName() + "_state_deps", move(env));
+vector<string> JITFrontend::getChunkNames(const Definition &defn) const
+{
+  vector<string> names;
+  for (bool update_state : { false, true }) {
+    unsigned num_chunks = GetNumChunks(defn, update_state, builder->getCodegenOptions().chunk_size);
+    for (unsigned i = 0; i < num_chunks; i++) {
+      names.push_back(GetChunkName(defn, update_state, i));
+    }
+  }
 
-    return llvm::CloneModule(mod.get(), debug_clone_map[defn.getSafeName() + "_state_deps"]);
-  });
+  return names;
+}
 
-  jit.addLazyFunction(defn.getSafeName() + "_output_deps", [this, &defn]() {
-    ModuleEnvironment env = MakeOutputDeps(builder, defn);
-    shared_ptr<llvm::Module> mod = env.getModule();
-    debug_modules.emplace(defn.getSafeName() + "_output_deps", move(env));
+/* Chunks are always their own units, even when their definition is
+ * bundled, since they are already as large as a unit should be */
+void JITFrontend::addChunkFunctions(const Definition &defn)
+{
+  const string cache_key = getCacheKey(defn, false);
 
-    return llvm::CloneModule(mod.get(), debug_clone_map[defn.getSafeName() + "_state_deps"]);
-  });
+  for (bool update_state : { false, true }) {
+    unsigned num_chunks = GetNumChunks(defn, update_state, builder->getCodegenOptions().chunk_size);
+    for (unsigned i = 0; i < num_chunks; i++) {
+      jit.addLazyFunction(GetChunkName(defn, update_state, i), [this, &defn, update_state, i]() {
+        return MakeChunk(*builder, defn, update_state, i).getModule();
+      }, cache_key);
+    }
+  }
+}
+
+static void collectPostOrder(const Definition &defn, unsigned flatten_threshold,
+                             unordered_set<const Definition *> &visited, vector<const Definition *> &order)
+{
+  if (!visited.insert(&defn).second) {
+    return;
+  }
+
+  for (const Instance &inst : defn.getInstances()) {
+    collectPostOrder(inst.getDefinition(), flatten_threshold, visited, order);
+  }
+
+  if (!isPrimitive(defn) && !ShouldFlatten(defn, flatten_threshold)) {
+    order.push_back(&defn);
+  }
+}
+
+/* Bundles are filled in post order, so each one is made of whole subtrees
+ * where possible and a definition is compiled along with the definitions it
+ * calls. Definitions with different optimization options aren't mixed. */
+void JITFrontend::formBundles(unsigned bundle_size)
+{
+  const unsigned flatten_threshold = builder->getCodegenOptions().flatten_threshold;
+  unordered_set<const Definition *> visited;
+  vector<const Definition *> order;
+  collectPostOrder(*top, flatten_threshold, visited, order);
+  for (const Definition &defn : circuit.getDefinitions()) {
+    collectPostOrder(defn, flatten_threshold, visited, order);
+  }
+
+  string bundle_key;
+  for (const Definition *defn : order) {
+    const OptimizationOptions &optimization = jit.getOptimizationOptions(defn->getSafeName() + "_update_state");
+    if (bundles.empty() || bundles.back().size() == bundle_size || optimization.getKey() != bundle_key) {
+      bundles.emplace_back();
+      bundle_key = optimization.getKey();
+      jit.setOptimizationOptions(getBundleName(bundles.size() - 1), optimization);
+    }
+    bundles.back().push_back(defn);
+  }
+}
+
+string JITFrontend::getBundleName(unsigned idx) const
+{
+  return "bundle_" + to_string(idx);
+}
+
+string JITFrontend::getBundleCacheKey(unsigned idx) const
+{
+  string cache_key;
+  for (const Definition *defn : bundles[idx]) {
+    string defn_key = getCacheKey(*defn, true);
+    if (defn_key.empty()) {
+      return "";
+    }
+    cache_key += defn_key + "/";
+  }
+
+  return cache_key;
+}
+
+vector<string> JITFrontend::getBundleFunctions(unsigned idx) const
+{
+  vector<string> names;
+  for (const Definition *defn : bundles[idx]) {
+    names.push_back(defn->getSafeName() + "_update_state");
+    names.push_back(defn->getSafeName() + "_compute_output");
+  }
+
+  return names;
+}
+
+void JITFrontend::addSimulationBundle(unsigned idx)
+{
+  vector<JIT::ModuleGenerator> generators;
+  for (const Definition *defn : bundles[idx]) {
+    generators.push_back([this, defn]() { return MakeUpdateState(*builder, *defn).getModule(); });
+    generators.push_back([this, defn]() { return MakeComputeOutput(*builder, *defn).getModule(); });
+  }
+
+  jit.addLazyBundle(getBundleName(idx), getBundleFunctions(idx), generators, getBundleCacheKey(idx));
+}
+
+/* Adds the simulation functions reachable from defn's function in the
+ * order they are first called */
+static void collectCallOrder(const Definition &defn, bool update_state, const CodegenOptions &options,
+                             unordered_set<string> &visited, vector<string> &order)
+{
+  const string name = defn.getSafeName() + (update_state ? "_update_state" : "_compute_output");
+  if (isPrimitive(defn) || ShouldFlatten(defn, options.flatten_threshold) || !visited.insert(name).second) {
+    return;
+  }
+  order.push_back(name);
+  for (unsigned i = 0; i < GetNumChunks(defn, update_state, options.chunk_size); i++) {
+    order.push_back(GetChunkName(defn, update_state, i));
+  }
+
+  const SimInfo &defn_info = defn.getSimInfo();
+  if (!update_state) {
+    for (const Instance *inst : defn_info.getOutputDeps()) {
+      collectCallOrder(inst->getDefinition(), false, options, visited, order);
+    }
+    return;
+  }
+
+  for (const Instance *inst : defn_info.getStateDeps()) {
+    collectCallOrder(inst->getDefinition(), false, options, visited, order);
+  }
+  for (const Instance *inst : defn_info.getStatefulInstances()) {
+    collectCallOrder(inst->getDefinition(), true, options, visited, order);
+  }
+}
+
+/* Each function is placed right after its first caller, so a cycle runs
+ * through the code mostly in address order. With a profile, functions are
+ * placed from most to least called instead, and functions never called in
+ * the profiled run are cold. The debug functions only run for getValue,
+ * so they are always cold. */
+CodeLayout JITFrontend::makeCodeLayout() const
+{
+  const CodegenOptions &options = builder->getCodegenOptions();
+  unordered_set<string> visited;
+  vector<string> order;
+  order.push_back("compute_output");
+  collectCallOrder(*top, false, options, visited, order);
+  order.push_back("update_state");
+  collectCallOrder(*top, true, options, visited, order);
+  for (const Definition &defn : circuit.getDefinitions()) {
+    collectCallOrder(defn, false, options, visited, order);
+    collectCallOrder(defn, true, options, visited, order);
+  }
+
+  unordered_map<string, uint64_t> entry_counts;
+  if (builder->getCodegenOptions().profile_mode == ProfileMode::Use) {
+    for (const string &name : order) {
+      uint64_t count;
+      if (profile.getEntryCount(name, count)) {
+        entry_counts[name] = count;
+      }
+    }
+    /* Called functions go first, hottest first, then functions the
+     * profile doesn't know about in call order, then the ones it never
+     * saw called */
+    auto getRank = [&entry_counts](const string &name) {
+      auto count = entry_counts.find(name);
+      if (count == entry_counts.end()) {
+        return make_pair(1, (uint64_t)0);
+      } else if (count->second == 0) {
+        return make_pair(2, (uint64_t)0);
+      }
+      return make_pair(0, UINT64_MAX - count->second);
+    };
+    stable_sort(order.begin(), order.end(), [&getRank](const string &a, const string &b) {
+      return getRank(a) < getRank(b);
+    });
+  }
+
+  CodeLayout layout;
+  for (const string &name : order) {
+    auto count = entry_counts.find(name);
+    if (count != entry_counts.end() && count->second == 0) {
+      layout.addColdFunction(name);
+    } else {
+      layout.addFunction(name);
+    }
+  }
+
+  for (const Definition &defn : circuit.getDefinitions()) {
+    if (!isPrimitive(defn)) {
+      layout.addColdFunction(defn.getSafeName() + "_output_deps");
+      layout.addColdFunction(defn.getSafeName() + "_state_deps");
+    }
+  }
+  layout.addColdFunction("get_values");
+
+  return layout;
+}
+
+void JITFrontend::addDefinitionFunctions(const Definition &defn)
+{
+  /* Bundled definitions are added once all the bundles are formed, and
+   * flattened definitions are never bundled */
+  if (bundles.empty() || ShouldFlatten(defn, builder->getCodegenOptions().flatten_threshold)) {
+    addSimulationFunctions(defn);
+  }
+  addChunkFunctions(defn);
+
+  const std::string cache_key = getCacheKey(defn, false);
+
+  for (bool output_deps : { false, true }) {
+    const string mod_name = defn.getSafeName() + (output_deps ? "_output_deps" : "_state_deps");
+
+    jit.addLazyFunction(mod_name, [this, &defn, output_deps, mod_name]() {
+      ModuleEnvironment &env = getDebugModule(defn, output_deps);
+      llvm::ValueToValueMapTy &val_map = debug_clone_map[mod_name];
+      val_map.clear();
+
+      return llvm::CloneModule(env.getModule().get(), val_map);
+    }, cache_key);
+  }
 }
 
 void JITFrontend::addWrappers(const Definition &top)
 {
   jit.addLazyFunction("update_state", [this, &top]() {
-    return MakeUpdateStateWrapper(builder, top).getModule();
+    return MakeUpdateStateWrapper(*builder, top).getModule();
   });
 
   jit.addLazyFunction("compute_output", [this, &top]() {
-    return MakeComputeOutputWrapper(builder, top).getModule();
+    return MakeComputeOutputWrapper(*builder, top).getModule();
   });
 
   jit.addLazyFunction("get_values", [this, &top]() {
-    return MakeGetValuesWrapper(builder, top).getModule();
+    return MakeGetValuesWrapper(*builder, top).getModule();
+  });
+
+  jit.addLazyFunction("compute_output_demand", [this, &top]() {
+    return MakeComputeOutputDemandWrapper(*builder, top).getModule();
+  });
+
+  jit.addLazyFunction("compute_output_changed", [this, &top]() {
+    return MakeComputeOutputChangedWrapper(*builder, top).getModule();
+  });
+
+  jit.addLazyFunction("run", [this, &top]() {
+    return MakeRunWrapper(*builder, top).getModule();
+  });
+
+  jit.addLazyFunction("step", [this, &top]() {
+    return MakeStepWrapper(*builder, top).getModule();
+  });
+
+  /* Everything is inlined into it, so it's only compiled when batching */
+  if (num_lanes > 0) {
+    jit.addLazyFunction("batch_step", [this, &top]() {
+      return MakeBatchStepWrapper(*builder, top).getModule();
+    });
+  }
+}
+
+/* Each worker owns its own TargetMachine and Builder (and so its own
+ * LLVMContext), so definitions are generated, optimized and codegen'd
+ * concurrently. The JIT itself isn't thread safe, so the objects are
+ * linked in once all the workers have finished. */
+void JITFrontend::precompileParallel(unsigned num_threads)
+{
+  /* Each job produces one object defining all of names */
+  struct CompileJob {
+    std::string unit_name;
+    std::vector<std::string> names;
+    std::function<shared_ptr<llvm::Module>(Builder &)> generate;
+    std::string cache_key;
+  };
+
+  vector<CompileJob> jobs;
+  auto addJob = [this, &jobs](const Definition &defn, const string &suffix,
+                              ModuleEnvironment (*make_module)(Builder &, const Definition &),
+                              bool count_calls) {
+    const string name = defn.getSafeName() + suffix;
+    jobs.push_back({ name, { name }, [this, &defn, name, make_module, count_calls](Builder &worker_builder) {
+      ModuleEnvironment env = make_module(worker_builder, defn);
+      if (count_calls) {
+        return countCalls(move(env), defn, name);
+      }
+      return env.getModule();
+    }, getCacheKey(defn, count_calls) });
+  };
+
+  for (const Definition &defn : circuit.getDefinitions()) {
+    if (isPrimitive(defn)) {
+      continue;
+    }
+    addJob(defn, "_state_deps", MakeStateDeps, false);
+    addJob(defn, "_output_deps", MakeOutputDeps, false);
+
+    /* Flattened definitions are only compiled if something asks for them */
+    if (ShouldFlatten(defn, builder->getCodegenOptions().flatten_threshold)) {
+      continue;
+    }
+    if (bundles.empty()) {
+      addJob(defn, "_update_state", MakeUpdateState, true);
+      addJob(defn, "_compute_output", MakeComputeOutput, true);
+    }
+
+    for (bool update_state : { false, true }) {
+      unsigned num_chunks = GetNumChunks(defn, update_state, builder->getCodegenOptions().chunk_size);
+      for (unsigned i = 0; i < num_chunks; i++) {
+        const string name = GetChunkName(defn, update_state, i);
+        jobs.push_back({ name, { name }, [&defn, update_state, i](Builder &worker_builder) {
+          return MakeChunk(worker_builder, defn, update_state, i).getModule();
+        }, getCacheKey(defn, false) });
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < bundles.size(); i++) {
+    jobs.push_back({ getBundleName(i), getBundleFunctions(i), [this, i](Builder &worker_builder) {
+      vector<shared_ptr<llvm::Module>> modules;
+      for (const Definition *defn : bundles[i]) {
+        modules.push_back(MakeUpdateState(worker_builder, *defn).getModule());
+        modules.push_back(MakeComputeOutput(worker_builder, *defn).getModule());
+      }
+      return LinkModules(getBundleName(i), modules);
+    }, getBundleCacheKey(i) });
+  }
+
+  num_threads = min<unsigned>(num_threads, jobs.size());
+
+  vector<unique_ptr<llvm::TargetMachine>> worker_machines;
+  for (unsigned i = 0; i < num_threads; i++) {
+    worker_machines.emplace_back(SelectTarget(cpu_target));
+    if (tiers) {
+      worker_machines.back()->setOptLevel(llvm::CodeGenOpt::None);
+      worker_machines.back()->setFastISel(true);
+    }
+  }
+
+  vector<unique_ptr<llvm::MemoryBuffer>> objects(jobs.size());
+  atomic<unsigned> next_job(0);
+
+  vector<thread> workers;
+  for (unsigned i = 0; i < num_threads; i++) {
+    llvm::TargetMachine *worker_machine = worker_machines[i].get();
+    workers.emplace_back([this, worker_machine, &jobs, &objects, &next_job]() {
+      Builder worker_builder(data_layout, *worker_machine, builder->getCodegenOptions());
+
+      for (unsigned idx = next_job++; idx < jobs.size(); idx = next_job++) {
+        const CompileJob &job = jobs[idx];
+        objects[idx] = jit.compileObject(job.unit_name, jit.getOptimizationOptions(job.unit_name), *worker_machine,
+                                         [&worker_builder, &job]() { return job.generate(worker_builder); },
+                                         job.cache_key);
+      }
+    });
+  }
+
+  for (thread &worker : workers) {
+    worker.join();
+  }
+
+  /* Objects are placed in memory in the order they are added */
+  const CodeLayout &layout = jit.getCodeLayout();
+  vector<unsigned> add_order;
+  for (unsigned i = 0; i < jobs.size(); i++) {
+    add_order.push_back(i);
+  }
+  stable_sort(add_order.begin(), add_order.end(), [&layout, &jobs](unsigned a, unsigned b) {
+    return layout.getRank(jobs[a].names[0]) < layout.getRank(jobs[b].names[0]);
   });
+
+  for (unsigned i : add_order) {
+    jit.addCompiledBundle(jobs[i].names, move(objects[i]));
+  }
+}
+
+static JITOptions getJITOptions(const FrontendOptions &options)
+{
+  JITOptions jit_options = options.jit;
+  if (options.tiered) {
+    jit_options.optimization = OptimizationOptions();
+    jit_options.optimization.opt_level = 0;
+  }
+  jit_options.huge_pages = jit_options.huge_pages || options.huge_pages;
+
+  return jit_options;
 }
 
-JITFrontend::JITFrontend(const Circuit &circuit, const Definition &top_)
-  : target_machine(llvm::EngineBuilder().selectTarget()),
+void JITFrontend::applyOptimizationOverrides(const vector<OptimizationOverride> &overrides)
+{
+  vector<regex> patterns;
+  for (const OptimizationOverride &over : overrides) {
+    patterns.emplace_back(over.pattern);
+  }
+
+  for (const Definition &defn : circuit.getDefinitions()) {
+    if (isPrimitive(defn)) {
+      continue;
+    }
+
+    for (unsigned i = 0; i < overrides.size(); i++) {
+      if (!regex_match(defn.getName(), patterns[i])) {
+        continue;
+      }
+
+      /* The first tier is always compiled quickly, so the override only
+       * applies once the definition is hot */
+      if (tiers) {
+        tiers->setTierUpOptions(defn, overrides[i].options);
+      } else {
+        for (const string &suffix : { "_update_state", "_compute_output", "_state_deps", "_output_deps" }) {
+          jit.setOptimizationOptions(defn.getSafeName() + suffix, overrides[i].options);
+        }
+        for (const string &chunk_name : getChunkNames(defn)) {
+          jit.setOptimizationOptions(chunk_name, overrides[i].options);
+        }
+      }
+      break;
+    }
+  }
+}
+
+static CodegenOptions getCodegenOptions(const FrontendOptions &options, ProfileData &profile)
+{
+  CodegenOptions codegen_options;
+  codegen_options.profile_mode = options.profile_mode;
+  codegen_options.profile = &profile;
+  codegen_options.debug_info = options.debug_info;
+  codegen_options.debug_dir = options.debug_dir;
+  codegen_options.chunk_size = options.chunk_size;
+  codegen_options.flatten_threshold = options.flatten_threshold;
+  codegen_options.wide_limbs = options.wide_limbs;
+  codegen_options.promote_widths = options.promote_widths;
+  codegen_options.shadow_state = options.shadow_state;
+
+  return codegen_options;
+}
+
+void JITFrontend::waitForCompile()
+{
+  if (compile_thread.joinable()) {
+    compile_thread.join();
+  }
+}
+
+JITFrontend::JITFrontend(const Circuit &circuit_, const Definition &top_, const FrontendOptions &options)
+  : cpu_target(GetCPUTarget(options.cpu)),
+    target_machine(SelectTarget(cpu_target)),
     data_layout(target_machine->createDataLayout()),
-    builder(data_layout, *target_machine),
-    jit(*target_machine, data_layout),
-    co_in(top_.getSimInfo().getOutputSources(), data_layout, builder.getContext()),
-    co_out(top_.getIFace().getSinks(), data_layout, builder.getContext()),
-    us_in(top_.getSimInfo().getStateSources(), data_layout, builder.getContext()),
-    gv_in(top_.getIFace().getSources(), data_layout, builder.getContext()),
-    state(top_.getSimInfo().allocateState()),
+    profile(),
+    builder(llvm::make_unique<Builder>(data_layout, *target_machine, getCodegenOptions(options, profile))),
+    jit(*target_machine, data_layout, getJITOptions(options)),
+    co_in(top_.getSimInfo().getOutputSources(), data_layout, builder->getContext()),
+    co_out(top_.getIFace().getSinks(), data_layout, builder->getContext()),
+    us_in(top_.getSimInfo().getStateSources(), data_layout, builder->getContext()),
+    gv_in(top_.getIFace().getSources(), data_layout, builder->getContext()),
+    state(top_.getSimInfo().getNumStateBytes() * (options.shadow_state ? 2 : 1), 0,
+          HugePageAllocator<uint8_t>(options.huge_pages)),
+    demand_mask(GetNumMaskWords(top_, false), 0),
+    changed_mask(GetNumMaskWords(top_, true), ~0ull),
+    change_cache(GetChangeCacheBytes(top_) / 8, 0),
+    lane_in_layout(top_.getIFace().getSources(), builder->getLaneWidth()),
+    lane_out_layout(top_.getIFace().getSinks(), builder->getLaneWidth()),
+    num_lanes(options.lanes),
+    num_lane_groups((options.lanes + builder->getLaneWidth() - 1) / builder->getLaneWidth()),
+    lane_in(num_lane_groups * lane_in_layout.getGroupBytes(), 0),
+    lane_out(num_lane_groups * lane_out_layout.getGroupBytes(), 0),
+    lane_state(num_lane_groups * GetLaneGroupStateBytes(top_, builder->getLaneWidth(), options.shadow_state), 0,
+               HugePageAllocator<uint8_t>(options.huge_pages)),
     compute_output_ptr(nullptr),
     update_state_ptr(nullptr),
-    top(&top_)
+    compute_output_demand_ptr(nullptr),
+    compute_output_changed_ptr(nullptr),
+    run_ptr(nullptr),
+    step_ptr(nullptr),
+    batch_step_ptr(nullptr),
+    circuit(circuit_),
+    top(&top_),
+    compile_thread(),
+    tiers(),
+    finalize_after(options.finalize_after),
+    num_cycles(0),
+    finalized(false),
+    time_finalize(options.time_finalize && options.profile_mode != ProfileMode::Instrument),
+    finalize_stats(),
+    context_recycle_interval(options.context_recycle_interval),
+    num_queries(0)
 {
+  if (options.tiered) {
+    target_machine->setOptLevel(llvm::CodeGenOpt::None);
+    target_machine->setFastISel(true);
+    tiers = llvm::make_unique<TierManager>(jit, data_layout, cpu_target, builder->getCodegenOptions(),
+                                           circuit, options.tier_up_threshold);
+  }
+
+  applyOptimizationOverrides(options.optimization_overrides);
+
+  if (options.bundle_size > 1) {
+    if (tiers) {
+      llvm::errs() << "Bundling isn't supported with tiered compilation\n";
+    } else {
+      formBundles(options.bundle_size);
+    }
+  }
+
+  if (options.profile_mode == ProfileMode::Use && !profile.read(options.profile_file)) {
+    llvm::errs() << "Unable to read profile " << options.profile_file << "\n";
+  }
+
+  if (options.code_layout) {
+    jit.setCodeLayout(makeCodeLayout());
+  }
+
   for (const Definition &defn : circuit.getDefinitions()) {
+    if (options.debug_info && !isPrimitive(defn) && !WriteDebugListing(defn, options.debug_dir)) {
+      llvm::errs() << "Unable to write debug listing for " << defn.getName() << "\n";
+    }
+
     if (!isPrimitive(defn)) {
       addDefinitionFunctions(defn);
     } else {
       // FIXME handle primitives that want to provide function definitions
     }
   }
+  for (unsigned i = 0; i < bundles.size(); i++) {
+    addSimulationBundle(i);
+  }
   addWrappers(top_);
 
   compute_output_ptr = (WrapperComputeOutputFn)jit.getSymbolAddress("compute_output");
   update_state_ptr = (WrapperUpdateStateFn)jit.getSymbolAddress("update_state");
   get_values_ptr = (WrapperGetValuesFn)jit.getSymbolAddress("get_values");
+  compute_output_demand_ptr = (WrapperComputeOutputDemandFn)jit.getSymbolAddress("compute_output_demand");
+  compute_output_changed_ptr = (WrapperComputeOutputChangedFn)jit.getSymbolAddress("compute_output_changed");
+  run_ptr = (WrapperRunFn)jit.getSymbolAddress("run");
+  step_ptr = (WrapperStepFn)jit.getSymbolAddress("step");
+  if (num_lanes > 0) {
+    batch_step_ptr = (WrapperBatchStepFn)jit.getSymbolAddress("batch_step");
+  }
 
   assert(compute_output_ptr && update_state_ptr);
+
+  if (options.compile_threads > 0) {
+    if (options.background_compile) {
+      unsigned num_threads = options.compile_threads;
+      compile_thread = thread([this, num_threads]() { precompileParallel(num_threads); });
+    } else {
+      precompileParallel(options.compile_threads);
+    }
+  }
 }
 
-JITFrontend::JITFrontend(const Circuit &circuit)
-  : JITFrontend(circuit, circuit.getTopDefinition())
+JITFrontend::JITFrontend(const Circuit &circuit, const FrontendOptions &options)
+  : JITFrontend(circuit, circuit.getTopDefinition(), options)
 {}
 
+JITFrontend::~JITFrontend()
+{
+  waitForCompile();
+}
+
 void JITFrontend::setInput(const std::string &name, uint64_t val)
 {
   setInput(name, llvm::APInt(64, val));
 }
 
+static void setMaskBit(vector<uint64_t> &mask, unsigned idx)
+{
+  mask[idx / 64] |= 1ull << (idx % 64);
+}
+
 void JITFrontend::setInput(const std::string &name, llvm::APInt val)
 {
   co_in.setMember(name, val);
   us_in.setMember(name, val);
   gv_in.setMember(name, val);
+
+  const IFace &iface = top->getIFace();
+  if (iface.hasSource(name)) {
+    setMaskBit(changed_mask, iface.getSource(name) - iface.getSources().data());
+  }
+}
+
+/* Nothing is executing between cycles, so it's safe to swap in recompiled code */
+void JITFrontend::finishCycle()
+{
+  setMaskBit(changed_mask, top->getSimInfo().getStateBit());
+
+  if (tiers) {
+    tiers->tierUp();
+  }
+
+  if (++num_cycles == finalize_after && !finalized) {
+    finalize();
+  }
 }
 
 void JITFrontend::updateState()
 {
+  waitForCompile();
   update_state_ptr(us_in.getData(), state.data());
+  finishCycle();
+}
+
+const LLVMStruct & JITFrontend::step()
+{
+  waitForCompile();
+  step_ptr(gv_in.getData(), co_out.getData(), state.data());
+  finishCycle();
+
+  return co_out;
+}
+
+const LLVMStruct & JITFrontend::run(uint64_t cycles)
+{
+  waitForCompile();
+  run_ptr(us_in.getData(), co_in.getData(), co_out.getData(), state.data(), cycles);
+  if (cycles == 0) {
+    return co_out;
+  }
+  setMaskBit(changed_mask, top->getSimInfo().getStateBit());
+
+  if (tiers) {
+    tiers->tierUp(cycles);
+  }
+
+  bool passed_finalize = num_cycles < finalize_after && num_cycles + cycles >= finalize_after;
+  num_cycles += cycles;
+  if (passed_finalize && !finalized) {
+    finalize();
+  }
+
+  return co_out;
+}
+
+void JITFrontend::setLaneInput(unsigned lane, const std::string &name, uint64_t val)
+{
+  setLaneInput(lane, name, llvm::APInt(64, val));
+}
+
+void JITFrontend::setLaneInput(unsigned lane, const std::string &name, llvm::APInt val)
+{
+  assert(lane < num_lanes);
+  if (!lane_in_layout.hasPort(name)) {
+    return;
+  }
+
+  unsigned idx = lane_in_layout.getIndex(name);
+  unsigned width = lane_in_layout.getWidth(idx);
+  val = val.zextOrTrunc(width);
+  memcpy(lane_in.data() + lane_in_layout.getLaneOffset(idx, lane), val.getRawData(), getNumBytes(width));
+}
+
+/* Lanes past num_lanes in the last group are simulated too, with inputs
+ * that are never set */
+void JITFrontend::stepLanes()
+{
+  waitForCompile();
+  if (num_lane_groups > 0) {
+    batch_step_ptr(lane_in.data(), lane_out.data(), lane_state.data(), num_lane_groups);
+  }
+}
+
+llvm::APInt JITFrontend::getLaneOutput(unsigned lane, const std::string &name) const
+{
+  assert(lane < num_lanes);
+  unsigned idx = lane_out_layout.getIndex(name);
+  return readAPInt(lane_out.data() + lane_out_layout.getLaneOffset(idx, lane), lane_out_layout.getWidth(idx));
 }
 
 const LLVMStruct & JITFrontend::computeOutput()
 {
+  waitForCompile();
   compute_output_ptr(co_in.getData(), co_out.getData(), state.data());
   return co_out;
 }
 
+const LLVMStruct & JITFrontend::computeOutputs(const vector<string> &names)
+{
+  waitForCompile();
+
+  fill(demand_mask.begin(), demand_mask.end(), 0);
+  const IFace &iface = top->getIFace();
+  for (const string &name : names) {
+    if (iface.hasSink(name)) {
+      setMaskBit(demand_mask, iface.getSink(name) - iface.getSinks().data());
+    }
+  }
+
+  compute_output_demand_ptr(co_in.getData(), co_out.getData(), state.data(), demand_mask.data());
+  return co_out;
+}
+
+const LLVMStruct & JITFrontend::computeChangedOutput()
+{
+  waitForCompile();
+  compute_output_changed_ptr(co_in.getData(), co_out.getData(), state.data(), changed_mask.data(),
+                             change_cache.data());
+  fill(changed_mask.begin(), changed_mask.end(), 0);
+
+  return co_out;
+}
+
 static tuple<const Definition *, const Instance *, unsigned> getDefnAndInst(const Definition *top, const vector<string> &inst_names)
 {
   const Definition *cur_defn = top;
@@ -235,12 +880,46 @@ vector<uint8_t> JITFrontend::allocateDebugStorage(const Instance *inst, const st
   return vector<uint8_t>(num_bytes, 0);
 }
 
+/* The IR for a deps module is kept after it's compiled so queries can
+ * recompile it with a value saved out */
+ModuleEnvironment & JITFrontend::getDebugModule(const Definition &defn, bool output_deps)
+{
+  const string mod_name = defn.getSafeName() + (output_deps ? "_output_deps" : "_state_deps");
+
+  auto iter = debug_modules.find(mod_name);
+  if (iter == debug_modules.end()) {
+    if (output_deps) {
+      iter = debug_modules.emplace(mod_name, MakeOutputDeps(*builder, defn)).first;
+    } else {
+      iter = debug_modules.emplace(mod_name, MakeStateDeps(*builder, defn)).first;
+    }
+  }
+
+  return iter->second;
+}
+
+/* Every module added to the JIT has already been compiled and dropped, so
+ * the IR kept for debugging is all that still refers to the context */
+void JITFrontend::recycleContext()
+{
+  debug_clone_map.clear();
+  debug_modules.clear();
+
+  builder = llvm::make_unique<Builder>(data_layout, *target_machine, builder->getCodegenOptions());
+}
+
 llvm::APInt JITFrontend::getValue(const vector<string> &inst_names, const string &input)
 {
   const Definition *defn;
   const Instance *inst;
   unsigned inst_num;
   tie(defn, inst, inst_num) = getDefnAndInst(top, inst_names);
+
+  waitForCompile();
+  if (context_recycle_interval && ++num_queries % context_recycle_interval == 0) {
+    recycleContext();
+  }
+
   vector<uint8_t> debug_store = allocateDebugStorage(inst, input);
   assert(debug_store.data() && "Data store is null?");
   const SimInfo &defn_info = defn->getSimInfo();
@@ -255,14 +934,15 @@ llvm::APInt JITFrontend::getValue(const vector<string> &inst_names, const string
     mod_name = defn->getSafeName() + "_state_deps";
   }
   if (jit.removeModule(mod_name)) {
-    /* If the module was removed, add a new callback to use the already generated IR */
-    assert(debug_modules.count(mod_name));
+    /* If the module was removed, add a new callback to use the already generated IR.
+     * Modules loaded from the object cache never had their IR generated, and
+     * recycling the context throws it away, so it's regenerated if needed. */
+    jit.addLazyFunction(mod_name, [this, defn, in_output_deps, mod_name]() {
+      ModuleEnvironment &env = getDebugModule(*defn, in_output_deps);
+      llvm::ValueToValueMapTy &val_map = debug_clone_map[mod_name];
+      val_map.clear();
 
-    jit.addLazyFunction(mod_name, [this, mod_name]() {
-      ModuleEnvironment &env = debug_modules.find(mod_name)->second;
-
-      auto cloned = llvm::CloneModule(env.getModule().get(), debug_clone_map[mod_name]);
-      return cloned;
+      return llvm::CloneModule(env.getModule().get(), val_map);
     });
   }
   auto txfm = jit.addDebugTransform(mod_name, [this, inst, defn, inst_num, &mod_name, &input, &debug_store](std::shared_ptr<llvm::Module> module) {
@@ -290,10 +970,10 @@ llvm::APInt JITFrontend::getValue(const vector<string> &inst_names, const string
 
     llvm::Value *inst_offset = symtab->lookup("inst_offset");
     assert(inst_offset && "Can't find inst_offset param");
-    llvm::IRBuilder<> ir_builder(builder.getContext());
+    llvm::IRBuilder<> ir_builder(builder->getContext());
 
     llvm::BasicBlock *last_bb = &func->back();
-    llvm::BasicBlock *debug_block = llvm::BasicBlock::Create(builder.getContext(), "debug_block", func);
+    llvm::BasicBlock *debug_block = llvm::BasicBlock::Create(builder->getContext(), "debug_block", func);
 
     // Rewrite every predecessor of the return block to instead jump to the debug block
     vector<llvm::Instruction *> terms;
@@ -309,8 +989,8 @@ llvm::APInt JITFrontend::getValue(const vector<string> &inst_names, const string
     }
 
     ir_builder.SetInsertPoint(debug_block);
-    llvm::Value *inst_eq = ir_builder.CreateICmpEQ(inst_offset, llvm::ConstantInt::get(builder.getContext(), llvm::APInt(64, inst_num)));
-    llvm::BasicBlock *val_save = llvm::BasicBlock::Create(builder.getContext(), "inst_match", func);
+    llvm::Value *inst_eq = ir_builder.CreateICmpEQ(inst_offset, llvm::ConstantInt::get(builder->getContext(), llvm::APInt(64, inst_num)));
+    llvm::BasicBlock *val_save = llvm::BasicBlock::Create(builder->getContext(), "inst_match", func);
     ir_builder.CreateCondBr(inst_eq, val_save, last_bb);
     ir_builder.SetInsertPoint(val_save);
 
@@ -345,8 +1025,138 @@ llvm::APInt JITFrontend::getValue(const vector<string> &inst_names, const string
   return llvm::APInt(debug_store.size()*8, llvm::ArrayRef<uint64_t>(safe_arr.data(), num64s));
 }
 
+void JITFrontend::reoptimizeWithProfile()
+{
+  waitForCompile();
+
+  CodegenOptions codegen_options = builder->getCodegenOptions();
+  codegen_options.profile_mode = ProfileMode::Use;
+  builder->setCodegenOptions(codegen_options);
+
+  if (!jit.getCodeLayout().empty()) {
+    jit.setCodeLayout(makeCodeLayout());
+  }
+
+  /* Nothing is executing, so the instrumented code can be dropped and
+   * regenerated with branch weights on its next call */
+  for (const Definition &defn : circuit.getDefinitions()) {
+    if (isPrimitive(defn)) {
+      continue;
+    }
+
+    jit.removeModule(defn.getSafeName() + "_update_state");
+    jit.removeModule(defn.getSafeName() + "_compute_output");
+    for (const string &chunk_name : getChunkNames(defn)) {
+      jit.removeModule(chunk_name);
+    }
+    if (bundles.empty() || ShouldFlatten(defn, codegen_options.flatten_threshold)) {
+      addSimulationFunctions(defn);
+    }
+    addChunkFunctions(defn);
+  }
+  for (unsigned i = 0; i < bundles.size(); i++) {
+    addSimulationBundle(i);
+  }
+
+  /* The finalized object calls the old code directly, so relink it */
+  if (finalized) {
+    finalize();
+  }
+}
+
+/* compute_output doesn't modify the state, so it can be called repeatedly
+ * without changing the simulation */
+double JITFrontend::timeComputeOutput()
+{
+  const unsigned num_calls = 1000;
+
+  compute_output_ptr(co_in.getData(), co_out.getData(), state.data());
+
+  auto start = chrono::steady_clock::now();
+  for (unsigned i = 0; i < num_calls; i++) {
+    compute_output_ptr(co_in.getData(), co_out.getData(), state.data());
+  }
+  auto end = chrono::steady_clock::now();
+
+  return chrono::duration<double, nano>(end - start).count() / num_calls;
+}
+
+bool JITFrontend::finalize()
+{
+  waitForCompile();
+
+  if (tiers) {
+    llvm::errs() << "Can't finalize with tiered compilation enabled\n";
+    return false;
+  }
+
+  vector<string> names;
+  for (const Definition &defn : circuit.getDefinitions()) {
+    if (isPrimitive(defn) || ShouldFlatten(defn, builder->getCodegenOptions().flatten_threshold)) {
+      continue;
+    }
+    names.push_back(defn.getSafeName() + "_update_state");
+    names.push_back(defn.getSafeName() + "_compute_output");
+    /* Otherwise split definitions would still reach their chunks through stubs */
+    for (const string &chunk_name : getChunkNames(defn)) {
+      names.push_back(chunk_name);
+    }
+  }
+  names.push_back("update_state");
+  names.push_back("compute_output");
+  names.push_back("get_values");
+  names.push_back("compute_output_demand");
+  names.push_back("compute_output_changed");
+  names.push_back("run");
+  names.push_back("step");
+  if (num_lanes > 0) {
+    names.push_back("batch_step");
+  }
+
+  if (time_finalize) {
+    finalize_stats.ns_before = timeComputeOutput();
+  }
+
+  if (!jit.finalize(names)) {
+    return false;
+  }
+
+  /* Skip the stubs for the entry points too */
+  compute_output_ptr = (WrapperComputeOutputFn)jit.getFunctionAddress("compute_output");
+  update_state_ptr = (WrapperUpdateStateFn)jit.getFunctionAddress("update_state");
+  get_values_ptr = (WrapperGetValuesFn)jit.getFunctionAddress("get_values");
+  compute_output_demand_ptr = (WrapperComputeOutputDemandFn)jit.getFunctionAddress("compute_output_demand");
+  compute_output_changed_ptr = (WrapperComputeOutputChangedFn)jit.getFunctionAddress("compute_output_changed");
+  run_ptr = (WrapperRunFn)jit.getFunctionAddress("run");
+  step_ptr = (WrapperStepFn)jit.getFunctionAddress("step");
+  if (num_lanes > 0) {
+    batch_step_ptr = (WrapperBatchStepFn)jit.getFunctionAddress("batch_step");
+  }
+  assert(compute_output_ptr && update_state_ptr && get_values_ptr);
+
+  if (time_finalize) {
+    finalize_stats.ns_after = timeComputeOutput();
+  }
+  finalized = true;
+
+  return true;
+}
+
+void JITFrontend::precompile()
+{
+  waitForCompile();
+  jit.precompileIR();
+}
+
+uint64_t JITFrontend::getCodeBytes() const
+{
+  const MemoryPool &pool = jit.getMemoryPool();
+  return pool.getMappedBytes() - pool.getFreeBytes();
+}
+
 void JITFrontend::dumpIR()
 {
+  waitForCompile();
   jit.precompileDumpIR();
 }
 
@@ -0,0 +1,63 @@
+#include "lane_lowering.hpp"
+#include "utils.hpp"
+
+#include <vector>
+
+namespace JITSim {
+
+using namespace llvm;
+
+Value * LoadSignal(FunctionEnvironment &env, Value *addr, unsigned width, const Twine &name)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  unsigned align = getAlignForBytes(getNumBytes(width));
+
+  if (env.getModule().getLanes() == 1) {
+    Value *cast_addr = ir_builder.CreateBitCast(addr, Type::getIntNPtrTy(env.getContext(), width));
+    return ir_builder.CreateAlignedLoad(cast_addr, align, name);
+  }
+
+  /* A vector of iN is packed bit by bit in memory, so each lane is loaded
+   * as whole bytes and truncated */
+  Type *storage_type = env.getModule().getValueType(getNumBytes(width) * 8);
+  Value *cast_addr = ir_builder.CreateBitCast(addr, storage_type->getPointerTo());
+  Value *val = ir_builder.CreateAlignedLoad(cast_addr, align);
+
+  return ir_builder.CreateTrunc(val, env.getModule().getValueType(width), name);
+}
+
+void StoreSignal(FunctionEnvironment &env, Value *val, Value *addr)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  unsigned width = val->getType()->getScalarSizeInBits();
+  unsigned align = getAlignForBytes(getNumBytes(width));
+
+  if (env.getModule().getLanes() > 1) {
+    val = ir_builder.CreateZExt(val, env.getModule().getValueType(getNumBytes(width) * 8));
+  }
+
+  Value *cast_addr = ir_builder.CreateBitCast(addr, val->getType()->getPointerTo());
+  ir_builder.CreateAlignedStore(val, cast_addr, align);
+}
+
+Value * GetLaneWordAddrs(FunctionEnvironment &env, Value *base, Type *elem_type, Value *idx)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  unsigned lanes = env.getModule().getLanes();
+  Type *i64 = Type::getInt64Ty(env.getContext());
+
+  std::vector<Constant *> lane_offsets;
+  for (unsigned i = 0; i < lanes; i++) {
+    lane_offsets.push_back(ConstantInt::get(i64, i));
+  }
+
+  /* Zero extended, or llvm interprets the top address bit as a sign */
+  Value *word = ir_builder.CreateZExt(idx, VectorType::get(i64, lanes));
+  Value *elem = ir_builder.CreateMul(word, ConstantInt::get(word->getType(), lanes), "", true, true);
+  elem = ir_builder.CreateAdd(elem, ConstantVector::get(lane_offsets), "", true, true);
+
+  Value *cast_base = ir_builder.CreateBitCast(base, elem_type->getPointerTo());
+  return ir_builder.CreateInBoundsGEP(cast_base, elem, "addrs");
+}
+
+}
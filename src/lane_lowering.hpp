@@ -0,0 +1,21 @@
+#ifndef JITSIM_LANE_LOWERING_HPP_INCLUDED
+#define JITSIM_LANE_LOWERING_HPP_INCLUDED
+
+#include <jitsim/builder.hpp>
+
+namespace JITSim {
+  /* A width bit signal kept in memory takes getNumBytes(width) bytes. When
+   * the module simulates several lanes (see ModuleEnvironment::getLanes)
+   * the lanes follow each other, lane i at addr + i * getNumBytes(width),
+   * and are loaded and stored as one vector. */
+  llvm::Value * LoadSignal(FunctionEnvironment &env, llvm::Value *addr, unsigned width, const llvm::Twine &name);
+  void StoreSignal(FunctionEnvironment &env, llvm::Value *val, llvm::Value *addr);
+
+  /* Pointers to word idx of a memory of elem_type words for each lane,
+   * with the lanes of each word next to each other. idx is a vector of
+   * one index per lane. */
+  llvm::Value * GetLaneWordAddrs(FunctionEnvironment &env, llvm::Value *base, llvm::Type *elem_type,
+                                 llvm::Value *idx);
+}
+
+#endif
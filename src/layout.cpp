@@ -0,0 +1,59 @@
+#include <jitsim/layout.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+void CodeLayout::addFunction(const string &name)
+{
+  ranks.emplace(name, ranks.size());
+}
+
+void CodeLayout::addColdFunction(const string &name)
+{
+  cold_functions.insert(name);
+}
+
+unsigned CodeLayout::getRank(const string &name) const
+{
+  auto iter = ranks.find(name);
+  if (iter == ranks.end()) {
+    return numeric_limits<unsigned>::max();
+  }
+
+  return iter->second;
+}
+
+void CodeLayout::apply(Module &module) const
+{
+  vector<Function *> defined;
+  for (Function &func : module) {
+    if (func.isDeclaration()) {
+      continue;
+    }
+
+    /* Cold functions get their own section, away from the hot code */
+    if (isCold(func.getName().str())) {
+      func.addFnAttr(Attribute::Cold);
+      func.setSectionPrefix(".unlikely");
+    }
+    defined.push_back(&func);
+  }
+
+  /* Functions in the same section are emitted in module order */
+  stable_sort(defined.begin(), defined.end(), [this](Function *a, Function *b) {
+    return getRank(a->getName().str()) < getRank(b->getName().str());
+  });
+
+  for (Function *func : defined) {
+    func->removeFromParent();
+    module.getFunctionList().push_back(func);
+  }
+}
+
+}
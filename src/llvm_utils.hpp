@@ -5,8 +5,10 @@
 #include <llvm/IR/DerivedTypes.h>
 
 namespace JITSim {
+  /* Literal struct types are uniqued by the context, so building the same
+   * interface repeatedly doesn't create a new type each time */
   template <typename T>
-  static llvm::StructType *ConstructStructType(const std::vector<T> &members, llvm::LLVMContext &context, const std::string &name = "")
+  static llvm::StructType *ConstructStructType(const std::vector<T> &members, llvm::LLVMContext &context)
   {
     std::vector<llvm::Type *> elem_types;
     for (unsigned i = 0; i < members.size(); i++) {
@@ -14,7 +16,7 @@ namespace JITSim {
       elem_types.push_back(llvm::Type::getIntNTy(context, m.getWidth()));
     }
   
-    return llvm::StructType::create(context, elem_types, name);
+    return llvm::StructType::get(context, elem_types);
   }
 }
 
@@ -0,0 +1,288 @@
+#include <jitsim/memory.hpp>
+
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Process.h>
+
+#include <fstream>
+#include <sstream>
+
+#include <sys/mman.h>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+void * MapHugePages(size_t size, bool executable)
+{
+  int prot = PROT_READ | PROT_WRITE | (executable ? PROT_EXEC : 0);
+
+#ifdef MAP_HUGETLB
+  void *addr = mmap(nullptr, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (addr != MAP_FAILED) {
+    return addr;
+  }
+#endif
+
+  /* No huge pages reserved, so map an aligned region and ask for
+   * transparent huge pages instead */
+  size_t padded = size + HUGE_PAGE_SIZE;
+  void *base = mmap(nullptr, padded, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return nullptr;
+  }
+
+  uintptr_t start = (uintptr_t)base;
+  uintptr_t aligned = alignTo(start, HUGE_PAGE_SIZE);
+  if (aligned != start) {
+    munmap(base, aligned - start);
+  }
+  uintptr_t tail = start + padded - (aligned + size);
+  if (tail) {
+    munmap((void *)(aligned + size), tail);
+  }
+
+#ifdef MADV_HUGEPAGE
+  madvise((void *)aligned, size, MADV_HUGEPAGE);
+#endif
+
+  return (void *)aligned;
+}
+
+void UnmapHugePages(void *addr, size_t size)
+{
+  munmap(addr, size);
+}
+
+uint64_t GetHugePageBytes()
+{
+  ifstream smaps("/proc/self/smaps");
+
+  uint64_t total_kb = 0;
+  string line;
+  while (getline(smaps, line)) {
+    istringstream fields(line);
+    string field;
+    uint64_t kb;
+    if (!(fields >> field >> kb)) {
+      continue;
+    }
+
+    if (field == "AnonHugePages:" || field == "Private_Hugetlb:" || field == "Shared_Hugetlb:") {
+      total_kb += kb;
+    }
+  }
+
+  return total_kb * 1024;
+}
+
+MemoryPool::MemoryPool(uint64_t max_free_bytes_, bool huge_pages_)
+  : free_blocks(),
+    free_bytes(0),
+    max_free_bytes(max_free_bytes_),
+    mapped_bytes(0),
+    huge_pages(huge_pages_),
+    huge_regions(),
+    region_ptr(0),
+    region_free(0),
+    pool_lock()
+{}
+
+MemoryPool::~MemoryPool()
+{
+  if (huge_pages) {
+    for (sys::MemoryBlock &region : huge_regions) {
+      UnmapHugePages(region.base(), region.size());
+    }
+    return;
+  }
+
+  for (auto &free_block : free_blocks) {
+    sys::Memory::releaseMappedMemory(free_block.second);
+  }
+}
+
+/* Huge pages can't be split between code and data permissions, so their
+ * regions are mapped readable, writable and executable, and blocks are
+ * carved out of them without ever being unmapped */
+sys::MemoryBlock MemoryPool::allocateFromRegion(size_t size)
+{
+  if (region_free < size) {
+    /* Keep what's left of the old region for smaller blocks */
+    if (region_free > 0) {
+      free_bytes += region_free;
+      free_blocks.emplace(region_free, sys::MemoryBlock((void *)region_ptr, region_free));
+    }
+
+    size_t region_size = alignTo(size, HUGE_PAGE_SIZE);
+    void *region = MapHugePages(region_size, true);
+    if (!region) {
+      region_free = 0;
+      return sys::MemoryBlock();
+    }
+
+    huge_regions.emplace_back(region, region_size);
+    mapped_bytes += region_size;
+    region_ptr = (uintptr_t)region;
+    region_free = region_size;
+  }
+
+  sys::MemoryBlock block((void *)region_ptr, size);
+  region_ptr += size;
+  region_free -= size;
+
+  return block;
+}
+
+sys::MemoryBlock MemoryPool::allocate(size_t size)
+{
+  /* Objects are often a single small definition, so blocks are only
+   * rounded up to whole pages */
+  size = alignTo(size, sys::Process::getPageSize());
+
+  lock_guard<mutex> guard(pool_lock);
+
+  /* Don't hand out a block much larger than needed, it would be wasted
+   * until the whole object is removed */
+  auto iter = free_blocks.lower_bound(size);
+  if (iter != free_blocks.end() && iter->first < 2 * size) {
+    sys::MemoryBlock block = iter->second;
+    free_blocks.erase(iter);
+    free_bytes -= block.size();
+    return block;
+  }
+
+  if (huge_pages) {
+    return allocateFromRegion(size);
+  }
+
+  error_code err;
+  sys::MemoryBlock block = sys::Memory::allocateMappedMemory(size, nullptr,
+                                                             sys::Memory::MF_READ | sys::Memory::MF_WRITE,
+                                                             err);
+  if (err) {
+    return sys::MemoryBlock();
+  }
+  mapped_bytes += block.size();
+
+  return block;
+}
+
+void MemoryPool::release(sys::MemoryBlock block)
+{
+  lock_guard<mutex> guard(pool_lock);
+
+  if (huge_pages) {
+    free_bytes += block.size();
+    free_blocks.emplace(block.size(), block);
+    return;
+  }
+
+  if (free_bytes + block.size() > max_free_bytes ||
+      sys::Memory::protectMappedMemory(block, sys::Memory::MF_READ | sys::Memory::MF_WRITE)) {
+    mapped_bytes -= block.size();
+    sys::Memory::releaseMappedMemory(block);
+    return;
+  }
+
+  free_bytes += block.size();
+  free_blocks.emplace(block.size(), block);
+}
+
+PooledMemoryManager::PooledMemoryManager(shared_ptr<MemoryPool> pool_)
+  : pool(move(pool_)),
+    code({ {}, 0, 0, sys::Memory::MF_READ | sys::Memory::MF_EXEC }),
+    ro_data({ {}, 0, 0, sys::Memory::MF_READ }),
+    rw_data({ {}, 0, 0, sys::Memory::MF_READ | sys::Memory::MF_WRITE }),
+    cold_code({ {}, 0, 0, sys::Memory::MF_READ | sys::Memory::MF_EXEC })
+{}
+
+PooledMemoryManager::~PooledMemoryManager()
+{
+  for (Arena *arena : { &code, &ro_data, &rw_data, &cold_code }) {
+    for (sys::MemoryBlock &block : arena->blocks) {
+      pool->release(block);
+    }
+  }
+}
+
+uint8_t * PooledMemoryManager::allocate(Arena &arena, uintptr_t size, unsigned alignment)
+{
+  if (alignment == 0) {
+    alignment = 16;
+  }
+
+  uintptr_t start = alignTo(arena.free_ptr, alignment);
+  if (arena.free_size == 0 || start + size > arena.free_ptr + arena.free_size) {
+    sys::MemoryBlock block = pool->allocate(size + alignment);
+    if (!block.base()) {
+      return nullptr;
+    }
+    arena.blocks.push_back(block);
+    arena.free_ptr = (uintptr_t)block.base();
+    arena.free_size = block.size();
+    start = alignTo(arena.free_ptr, alignment);
+  }
+
+  arena.free_size -= start + size - arena.free_ptr;
+  arena.free_ptr = start + size;
+
+  return (uint8_t *)start;
+}
+
+/* Code that CodeLayout marked cold goes in its own blocks, so it doesn't
+ * share pages or cache lines with the hot code */
+uint8_t * PooledMemoryManager::allocateCodeSection(uintptr_t size, unsigned alignment, unsigned,
+                                                   StringRef section_name)
+{
+  if (section_name.startswith(".text.unlikely")) {
+    return allocate(cold_code, size, alignment);
+  }
+
+  return allocate(code, size, alignment);
+}
+
+uint8_t * PooledMemoryManager::allocateDataSection(uintptr_t size, unsigned alignment, unsigned,
+                                                   StringRef, bool is_read_only)
+{
+  return allocate(is_read_only ? ro_data : rw_data, size, alignment);
+}
+
+bool PooledMemoryManager::protect(Arena &arena, string *err_msg)
+{
+  for (sys::MemoryBlock &block : arena.blocks) {
+    if (pool->usesHugePages()) {
+      break;
+    }
+
+    if (error_code err = sys::Memory::protectMappedMemory(block, arena.permissions)) {
+      if (err_msg) {
+        *err_msg = err.message();
+      }
+      return true;
+    }
+  }
+
+  /* Later sections must not land in memory that is no longer writable */
+  arena.free_size = 0;
+
+  return false;
+}
+
+/* Returns true on error, like SectionMemoryManager */
+bool PooledMemoryManager::finalizeMemory(string *err_msg)
+{
+  for (Arena *arena : { &code, &cold_code }) {
+    if (protect(*arena, err_msg)) {
+      return true;
+    }
+
+    for (sys::MemoryBlock &block : arena->blocks) {
+      sys::Memory::InvalidateInstructionCache(block.base(), block.size());
+    }
+  }
+
+  return protect(ro_data, err_msg) || protect(rw_data, err_msg);
+}
+
+}
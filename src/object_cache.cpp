@@ -0,0 +1,165 @@
+#include <jitsim/object_cache.hpp>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <utime.h>
+
+namespace JITSim {
+
+using namespace llvm;
+
+DiskObjectCache::DiskObjectCache(const std::string &cache_dir_, uint64_t max_bytes_)
+  : cache_dir(cache_dir_), max_bytes(max_bytes_), cur_bytes(0),
+    module_keys(), cache_lock()
+{
+  if (auto err = sys::fs::create_directories(cache_dir)) {
+    errs() << "Unable to create object cache directory " << cache_dir << ": " << err.message() << "\n";
+  }
+
+  cur_bytes = calculateSize();
+}
+
+std::string DiskObjectCache::getObjectPath(const std::string &key) const
+{
+  SmallString<128> path(cache_dir);
+  sys::path::append(path, key + ".o");
+
+  return path.str();
+}
+
+uint64_t DiskObjectCache::calculateSize() const
+{
+  uint64_t size = 0;
+  std::error_code ec;
+  for (sys::fs::directory_iterator iter(cache_dir, ec), end; iter != end && !ec; iter.increment(ec)) {
+    if (sys::path::extension(iter->path()) != ".o") {
+      continue;
+    }
+
+    sys::fs::file_status status;
+    if (!iter->status(status)) {
+      size += status.getSize();
+    }
+  }
+
+  return size;
+}
+
+/* Removes the least recently used objects until the cache fits in max_bytes.
+ * Hits refresh the modification time, so it doubles as the access time. */
+void DiskObjectCache::evict()
+{
+  if (cur_bytes <= max_bytes) {
+    return;
+  }
+
+  std::vector<std::tuple<sys::TimePoint<>, uint64_t, std::string>> entries;
+  std::error_code ec;
+  for (sys::fs::directory_iterator iter(cache_dir, ec), end; iter != end && !ec; iter.increment(ec)) {
+    if (sys::path::extension(iter->path()) != ".o") {
+      continue;
+    }
+
+    sys::fs::file_status status;
+    if (!iter->status(status)) {
+      entries.emplace_back(status.getLastModificationTime(), status.getSize(), iter->path());
+    }
+  }
+
+  std::sort(entries.begin(), entries.end());
+
+  /* Another process may have filled the directory too, so recount from disk */
+  cur_bytes = 0;
+  for (const auto &entry : entries) {
+    cur_bytes += std::get<1>(entry);
+  }
+
+  for (const auto &entry : entries) {
+    if (cur_bytes <= max_bytes) {
+      break;
+    }
+
+    if (!sys::fs::remove(std::get<2>(entry))) {
+      cur_bytes -= std::get<1>(entry);
+    }
+  }
+}
+
+void DiskObjectCache::setModuleKey(const std::string &module_name, const std::string &key)
+{
+  std::lock_guard<std::mutex> guard(cache_lock);
+  module_keys[module_name] = key;
+}
+
+std::unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const std::string &key)
+{
+  std::string path = getObjectPath(key);
+
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    return nullptr;
+  }
+
+  // Mark this entry as recently used
+  utime(path.c_str(), nullptr);
+
+  return std::move(*buffer);
+}
+
+std::unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const Module *module)
+{
+  std::string key;
+  {
+    std::lock_guard<std::mutex> guard(cache_lock);
+    auto iter = module_keys.find(module->getModuleIdentifier());
+    if (iter == module_keys.end()) {
+      return nullptr;
+    }
+    key = iter->second;
+  }
+
+  return getObject(key);
+}
+
+void DiskObjectCache::notifyObjectCompiled(const Module *module, MemoryBufferRef obj)
+{
+  std::lock_guard<std::mutex> guard(cache_lock);
+
+  auto iter = module_keys.find(module->getModuleIdentifier());
+  if (iter == module_keys.end()) {
+    return;
+  }
+  std::string path = getObjectPath(iter->second);
+  module_keys.erase(iter);
+
+  /* Write to a temporary and rename it into place so concurrent runs
+   * sharing the directory never see a partial object */
+  int fd;
+  SmallString<128> tmp_path;
+  if (sys::fs::createUniqueFile(cache_dir + "/%%%%%%%%.tmp", fd, tmp_path)) {
+    return;
+  }
+
+  {
+    raw_fd_ostream out(fd, true);
+    out << obj.getBuffer();
+  }
+
+  if (sys::fs::rename(tmp_path, path)) {
+    sys::fs::remove(tmp_path);
+    return;
+  }
+
+  cur_bytes += obj.getBufferSize();
+  evict();
+}
+
+} // end namespace JITSim
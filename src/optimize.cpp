@@ -0,0 +1,67 @@
+#include <jitsim/optimize.hpp>
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+
+namespace JITSim {
+
+using namespace llvm;
+
+std::string OptimizationOptions::getKey() const
+{
+  return "O" + std::to_string(opt_level) + "s" + std::to_string(size_level) +
+         (loop_vectorize ? "+lv" : "") + (slp_vectorize ? "+slp" : "") +
+         (module_passes ? "+mp" : "");
+}
+
+void OptimizeModule(Module &module, const OptimizationOptions &options, TargetMachine *target_machine)
+{
+  PassManagerBuilder manager_builder;
+  manager_builder.OptLevel = options.opt_level;
+  manager_builder.SizeLevel = options.size_level;
+  manager_builder.LoopVectorize = options.loop_vectorize;
+  manager_builder.SLPVectorize = options.slp_vectorize;
+  if (options.module_passes && options.opt_level > 0) {
+    manager_builder.Inliner = createFunctionInliningPass(options.opt_level, options.size_level, false);
+  }
+  if (target_machine) {
+    target_machine->adjustPassManager(manager_builder);
+  }
+
+  // Create a function pass manager.
+  auto fpm = make_unique<legacy::FunctionPassManager>(&module);
+  if (target_machine) {
+    fpm->add(createTargetTransformInfoWrapperPass(target_machine->getTargetIRAnalysis()));
+  }
+  manager_builder.populateFunctionPassManager(*fpm);
+
+  // Add some optimizations.
+  //fpm->add(createInstructionCombiningPass(true));
+  //fpm->add(createReassociatePass());
+  //fpm->add(createGVNPass());
+  //fpm->add(createCFGSimplificationPass());
+  fpm->doInitialization();
+
+  // Run the optimizations over all functions in the module being added to
+  // the JIT.
+  for (auto &fn : module)
+    fpm->run(fn);
+
+  fpm->doFinalization();
+
+  if (!options.module_passes) {
+    return;
+  }
+
+  legacy::PassManager mpm;
+  if (target_machine) {
+    mpm.add(createTargetTransformInfoWrapperPass(target_machine->getTargetIRAnalysis()));
+  }
+  manager_builder.populateModulePassManager(mpm);
+  mpm.run(module);
+}
+
+}
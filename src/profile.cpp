@@ -0,0 +1,110 @@
+#include <jitsim/profile.hpp>
+
+#include <fstream>
+#include <sstream>
+
+namespace JITSim {
+
+using namespace std;
+
+deque<uint64_t> & ProfileData::getFunctionCounters(const string &fn_name)
+{
+  deque<uint64_t> &fn_counters = counters[fn_name];
+  if (fn_counters.empty()) {
+    fn_counters.push_back(0);
+  }
+
+  return fn_counters;
+}
+
+uint64_t * ProfileData::getEntryCounter(const string &fn_name)
+{
+  lock_guard<mutex> guard(profile_lock);
+  return &getFunctionCounters(fn_name)[0];
+}
+
+uint64_t * ProfileData::getSiteCounters(const string &fn_name, unsigned site)
+{
+  lock_guard<mutex> guard(profile_lock);
+  deque<uint64_t> &fn_counters = getFunctionCounters(fn_name);
+  while (fn_counters.size() < 1 + 2 * (site + 1)) {
+    fn_counters.push_back(0);
+  }
+
+  return &fn_counters[1 + 2 * site];
+}
+
+bool ProfileData::getEntryCount(const string &fn_name, uint64_t &count) const
+{
+  lock_guard<mutex> guard(profile_lock);
+  auto iter = counters.find(fn_name);
+  if (iter == counters.end()) {
+    return false;
+  }
+
+  count = iter->second[0];
+  return true;
+}
+
+bool ProfileData::getSiteCounts(const string &fn_name, unsigned site,
+                                uint64_t &false_count, uint64_t &true_count) const
+{
+  lock_guard<mutex> guard(profile_lock);
+  auto iter = counters.find(fn_name);
+  if (iter == counters.end() || iter->second.size() < 1 + 2 * (site + 1)) {
+    return false;
+  }
+
+  false_count = iter->second[1 + 2 * site];
+  true_count = iter->second[2 + 2 * site];
+  return true;
+}
+
+/* One line per function: the name followed by all of its counters */
+bool ProfileData::write(const string &path) const
+{
+  ofstream out(path);
+  if (!out) {
+    return false;
+  }
+
+  lock_guard<mutex> guard(profile_lock);
+  for (const auto &fn_counters : counters) {
+    out << fn_counters.first;
+    for (uint64_t count : fn_counters.second) {
+      out << " " << count;
+    }
+    out << "\n";
+  }
+
+  return !!out;
+}
+
+bool ProfileData::read(const string &path)
+{
+  ifstream in(path);
+  if (!in) {
+    return false;
+  }
+
+  lock_guard<mutex> guard(profile_lock);
+  string line;
+  while (getline(in, line)) {
+    istringstream fields(line);
+    string fn_name;
+    if (!(fields >> fn_name)) {
+      continue;
+    }
+
+    deque<uint64_t> &fn_counters = counters[fn_name];
+    fn_counters.clear();
+    uint64_t count;
+    while (fields >> count) {
+      fn_counters.push_back(count);
+    }
+  }
+
+  return true;
+}
+
+}
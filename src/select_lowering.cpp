@@ -0,0 +1,263 @@
+#include "select_lowering.hpp"
+
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/Support/MathExtras.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+/* Bits [src_lo, src_lo + width) of src placed at [dst_lo, dst_lo + width)
+ * of the result, with the bit order flipped if reversed */
+struct BitRun {
+  const Source *src;
+  unsigned src_lo;
+  unsigned dst_lo;
+  unsigned width;
+  bool reversed;
+
+  int getShift() const { return (int)dst_lo - (int)src_lo; }
+};
+
+static unsigned getSelectWidth(const Select &select)
+{
+  unsigned width = 0;
+  for (const SourceSlice &slice : select.getSlices()) {
+    width += slice.getWidth();
+  }
+
+  return width;
+}
+
+/* Select already merges slices continuing each other, so the only runs
+ * left to find are single bits taken in descending order, which is what
+ * flattentypes leaves behind for a reversed bus */
+static vector<BitRun> getRuns(const Select &select, APInt &constant)
+{
+  vector<BitRun> runs;
+  unsigned dst = 0;
+  for (const SourceSlice &slice : select.getSlices()) {
+    unsigned width = slice.getWidth();
+    if (slice.isConstant()) {
+      constant |= slice.getConstant().zext(constant.getBitWidth()).shl(dst);
+      dst += width;
+      continue;
+    }
+
+    BitRun *prev = runs.empty() ? nullptr : &runs.back();
+    if (prev && width == 1 && prev->src == slice.getSource() && prev->dst_lo + prev->width == dst &&
+        (prev->reversed || prev->width == 1) && (unsigned)slice.getOffset() + 1 == prev->src_lo) {
+      prev->reversed = true;
+      prev->src_lo--;
+      prev->width++;
+    } else {
+      runs.push_back({ slice.getSource(), (unsigned)slice.getOffset(), dst, width, false });
+    }
+    dst += width;
+  }
+
+  return runs;
+}
+
+static Value * lowerReversedRun(const BitRun &run, Value *src_val, Type *result_type, FunctionEnvironment &env)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+
+  Value *bits = src_val;
+  if (run.src_lo > 0) {
+    bits = ir_builder.CreateLShr(bits, run.src_lo);
+  }
+  bits = ir_builder.CreateZExtOrTrunc(bits, env.getModule().getValueType(run.width));
+
+  Function *bitreverse = Intrinsic::getDeclaration(env.getModule().getModule().get(), Intrinsic::bitreverse,
+                                                   { bits->getType() });
+  bits = ir_builder.CreateCall(bitreverse, { bits }, "reversed");
+
+  bits = ir_builder.CreateZExtOrTrunc(bits, result_type);
+  if (run.dst_lo > 0) {
+    bits = ir_builder.CreateShl(bits, run.dst_lo);
+  }
+
+  return bits;
+}
+
+/* Every run in runs has the same shift, so they are all moved into place
+ * together and the bits between them masked off */
+static Value * lowerShiftGroup(const vector<BitRun> &runs, Value *src_val, unsigned result_width,
+                               FunctionEnvironment &env)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+
+  APInt mask(result_width, 0);
+  for (const BitRun &run : runs) {
+    mask.setBits(run.dst_lo, run.dst_lo + run.width);
+  }
+
+  unsigned src_width = src_val->getType()->getScalarSizeInBits();
+  Value *bits = ir_builder.CreateZExt(src_val, env.getModule().getValueType(max(src_width, result_width)));
+
+  int shift = runs.front().getShift();
+  if (shift > 0) {
+    bits = ir_builder.CreateShl(bits, shift);
+  } else if (shift < 0) {
+    bits = ir_builder.CreateLShr(bits, -shift);
+  }
+  bits = ir_builder.CreateZExtOrTrunc(bits, env.getModule().getValueType(result_width));
+
+  /* Every bit of the result comes from this group */
+  if (mask.isAllOnesValue()) {
+    return bits;
+  }
+
+  return ir_builder.CreateAnd(bits, env.getModule().getConstant(mask), "gather");
+}
+
+/* Runs in a chain take increasing, non overlapping bits of the source, so
+ * pext packs them together and pdep spreads them out to the result */
+static Value * lowerChain(const vector<BitRun> &chain, Value *src_val, Type *result_type, FunctionEnvironment &env)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Module *module = env.getModule().getModule().get();
+  Type *i64 = Type::getInt64Ty(env.getContext());
+
+  uint64_t src_mask = 0;
+  uint64_t dst_mask = 0;
+  for (const BitRun &run : chain) {
+    src_mask |= maskTrailingOnes<uint64_t>(run.width) << run.src_lo;
+    dst_mask |= maskTrailingOnes<uint64_t>(run.width) << run.dst_lo;
+  }
+
+  Value *bits = ir_builder.CreateZExt(src_val, i64);
+
+  /* A contiguous mask is cheaper as a shift and an and */
+  if (isShiftedMask_64(src_mask)) {
+    bits = ir_builder.CreateLShr(bits, countTrailingZeros(src_mask));
+    bits = ir_builder.CreateAnd(bits, src_mask >> countTrailingZeros(src_mask));
+  } else {
+    Function *pext = Intrinsic::getDeclaration(module, Intrinsic::x86_bmi_pext_64);
+    bits = ir_builder.CreateCall(pext, { bits, ConstantInt::get(i64, src_mask) }, "packed");
+  }
+
+  if (isShiftedMask_64(dst_mask)) {
+    bits = ir_builder.CreateShl(bits, countTrailingZeros(dst_mask));
+  } else {
+    Function *pdep = Intrinsic::getDeclaration(module, Intrinsic::x86_bmi_pdep_64);
+    bits = ir_builder.CreateCall(pdep, { bits, ConstantInt::get(i64, dst_mask) }, "scattered");
+  }
+
+  return ir_builder.CreateTrunc(bits, result_type);
+}
+
+/* Splits runs (in result order) into chains pext/pdep can move at once */
+static vector<vector<BitRun>> getChains(const vector<BitRun> &runs)
+{
+  vector<vector<BitRun>> chains;
+  for (const BitRun &run : runs) {
+    if (chains.empty() || run.src_lo < chains.back().back().src_lo + chains.back().back().width) {
+      chains.emplace_back();
+    }
+    chains.back().push_back(run);
+  }
+
+  return chains;
+}
+
+/* Adds the parts for the runs taken (in order) from a single source */
+static void lowerSource(const vector<BitRun> &runs, unsigned result_width, FunctionEnvironment &env,
+                        vector<Value *> &parts)
+{
+  Value *src_val = env.lookupValue(runs.front().src);
+  Type *result_type = env.getModule().getValueType(result_width);
+
+  vector<BitRun> forward;
+  for (const BitRun &run : runs) {
+    if (run.reversed) {
+      parts.push_back(lowerReversedRun(run, src_val, result_type, env));
+    } else {
+      forward.push_back(run);
+    }
+  }
+
+  if (forward.empty()) {
+    return;
+  }
+
+  /* Groups are kept in order of their first run */
+  vector<vector<BitRun>> groups;
+  unordered_map<int, unsigned> group_idx;
+  for (const BitRun &run : forward) {
+    auto inserted = group_idx.emplace(run.getShift(), groups.size());
+    if (inserted.second) {
+      groups.emplace_back();
+    }
+    groups[inserted.first->second].push_back(run);
+  }
+
+  unsigned src_width = src_val->getType()->getScalarSizeInBits();
+  /* pext and pdep have no vector forms */
+  if (env.getModule().getCodegenOptions().use_bmi2 && env.getModule().getLanes() == 1 &&
+      src_width <= 64 && result_width <= 64) {
+    vector<vector<BitRun>> chains = getChains(forward);
+    if (chains.size() < groups.size()) {
+      for (const vector<BitRun> &chain : chains) {
+        parts.push_back(lowerChain(chain, src_val, result_type, env));
+      }
+      return;
+    }
+  }
+
+  for (const vector<BitRun> &group : groups) {
+    parts.push_back(lowerShiftGroup(group, src_val, result_width, env));
+  }
+}
+
+/* Parts never overlap, so a balanced tree gives the same value as a chain
+ * with a log depth critical path */
+static Value * makeOrTree(const vector<Value *> &parts, size_t begin, size_t end, FunctionEnvironment &env)
+{
+  if (end - begin == 1) {
+    return parts[begin];
+  }
+
+  size_t mid = begin + (end - begin) / 2;
+  Value *lhs = makeOrTree(parts, begin, mid, env);
+  Value *rhs = makeOrTree(parts, mid, end, env);
+
+  return env.getIRBuilder().CreateOr(lhs, rhs, "concat");
+}
+
+Value * LowerConcat(const Select &select, FunctionEnvironment &env)
+{
+  unsigned result_width = getSelectWidth(select);
+  APInt constant(result_width, 0);
+  vector<BitRun> runs = getRuns(select, constant);
+
+  /* Sources are lowered in order of their first use */
+  vector<const Source *> sources;
+  unordered_map<const Source *, vector<BitRun>> source_runs;
+  for (const BitRun &run : runs) {
+    vector<BitRun> &src_runs = source_runs[run.src];
+    if (src_runs.empty()) {
+      sources.push_back(run.src);
+    }
+    src_runs.push_back(run);
+  }
+
+  vector<Value *> parts;
+  for (const Source *src : sources) {
+    lowerSource(source_runs[src], result_width, env, parts);
+  }
+
+  if (parts.empty() || !constant.isNullValue()) {
+    parts.push_back(env.getModule().getConstant(constant));
+  }
+
+  return makeOrTree(parts, 0, parts.size(), env);
+}
+
+}
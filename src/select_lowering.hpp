@@ -0,0 +1,16 @@
+#ifndef JITSIM_SELECT_LOWERING_HPP_INCLUDED
+#define JITSIM_SELECT_LOWERING_HPP_INCLUDED
+
+#include <jitsim/builder.hpp>
+#include <jitsim/circuit.hpp>
+
+namespace JITSim {
+  /* Builds the value of a Select made of several slices. Bits taken from
+   * the same source are gathered together (with one shift and mask per
+   * distinct shift amount, a bitreverse for reversed runs, or pext/pdep on
+   * BMI2 targets), and the parts are combined with a balanced tree of ors,
+   * so bit-blasted buses don't become one long chain per bit */
+  llvm::Value * LowerConcat(const Select &select, FunctionEnvironment &env);
+}
+
+#endif
@@ -1,12 +1,48 @@
 #include <jitsim/simanalysis.hpp>
 #include <jitsim/circuit.hpp>
 
+#include "utils.hpp"
+
+#include <algorithm>
 #include <unordered_set>
 
 namespace JITSim {
 
 using namespace std;
 
+void PortMask::set(unsigned idx)
+{
+  if (idx / 64 >= words.size()) {
+    words.resize(idx / 64 + 1, 0);
+  }
+  words[idx / 64] |= 1ull << (idx % 64);
+}
+
+bool PortMask::test(unsigned idx) const
+{
+  return idx / 64 < words.size() && (words[idx / 64] >> (idx % 64)) & 1;
+}
+
+void PortMask::merge(const PortMask &other)
+{
+  if (other.words.size() > words.size()) {
+    words.resize(other.words.size(), 0);
+  }
+  for (unsigned i = 0; i < other.words.size(); i++) {
+    words[i] |= other.words[i];
+  }
+}
+
+unsigned PortMask::count() const
+{
+  unsigned num = 0;
+  for (uint64_t word : words) {
+    num += __builtin_popcountll(word);
+  }
+
+  return num;
+}
+
 static vector<const Instance *> filterStatefulInstances(const vector<Instance> &instances)
 {
   vector<const Instance *> stateful;
@@ -161,15 +197,141 @@ void SimInfo::analyzeOutputDeps(const IFace &defn_iface)
   analyzeDependencies(defn_iface, frontier, output_deps, output_dep_srcs);
 }
 
+/* Inputs are propagated forward through the topologically sorted output
+ * deps, and sinks backward, so each instance is visited once per
+ * direction instead of once per port */
+void SimInfo::analyzeCones(const IFace &defn_iface)
+{
+  const vector<Source> &sources = defn_iface.getSources();
+  const vector<Sink> &sinks = defn_iface.getSinks();
+
+  auto getSelectInputs = [this, &sources](const Select &sel) {
+    PortMask inputs;
+    for (const SourceSlice &slice : sel.getSlices()) {
+      if (slice.isConstant()) {
+        continue;
+      } else if (slice.isDefinitionAttached()) {
+        inputs.set(slice.getSource() - sources.data());
+      } else {
+        inputs.merge(input_deps.find(slice.getInstance())->second);
+      }
+    }
+    return inputs;
+  };
+
+  for (const Instance *inst : output_deps) {
+    const SimInfo &inst_info = inst->getSimInfo();
+    PortMask inputs;
+    if (inst_info.isStateful()) {
+      inputs.set(state_bit);
+    }
+    for (const Source *src : inst_info.getOutputSources()) {
+      inputs.merge(getSelectInputs(inst->getIFace().getSink(src)->getSelect()));
+    }
+    input_deps[inst] = inputs;
+  }
+
+  for (const Sink &sink : sinks) {
+    sink_input_deps.push_back(getSelectInputs(sink.getSelect()));
+  }
+
+  auto addDemand = [this](const Select &sel, const PortMask &demand) {
+    for (const SourceSlice &slice : sel.getSlices()) {
+      if (slice.isInstanceAttached()) {
+        demanding_sinks[slice.getInstance()].merge(demand);
+      }
+    }
+  };
+
+  for (unsigned i = 0; i < sinks.size(); i++) {
+    PortMask demand;
+    demand.set(i);
+    addDemand(sinks[i].getSelect(), demand);
+  }
+
+  for (auto iter = output_deps.rbegin(); iter != output_deps.rend(); ++iter) {
+    const Instance *inst = *iter;
+    const PortMask demand = demanding_sinks[inst];
+    for (const Source *src : inst->getSimInfo().getOutputSources()) {
+      addDemand(inst->getIFace().getSink(src)->getSelect(), demand);
+    }
+  }
+}
+
+vector<const Instance *> SimInfo::getSinkCone(unsigned sink_idx) const
+{
+  vector<const Instance *> cone;
+  for (const Instance *inst : output_deps) {
+    if (getDemandingSinks(inst).test(sink_idx)) {
+      cone.push_back(inst);
+    }
+  }
+
+  return cone;
+}
+
+vector<const Instance *> SimInfo::getInputCone(unsigned input_bit) const
+{
+  vector<const Instance *> cone;
+  for (const Instance *inst : output_deps) {
+    if (getInputDeps(inst).test(input_bit)) {
+      cone.push_back(inst);
+    }
+  }
+
+  return cone;
+}
+
+void SimInfo::analyzeStepDeps()
+{
+  if (!is_stateful) {
+    step_deps = output_deps;
+    return;
+  }
+
+  unordered_set<const Instance *> unsorted(output_deps.begin(), output_deps.end());
+  unsorted.insert(state_deps.begin(), state_deps.end());
+  step_deps = topoSortInstances(unsorted);
+}
+
 void SimInfo::calculateStateOffsets()
 {
   unsigned offset = 0;
   for (const Instance *inst : stateful_insts) {
+    const SimInfo &inst_info = inst->getDefinition().getSimInfo();
+    unsigned align = inst_info.getStateAlign();
+    offset = (offset + align - 1) / align * align;
     offset_map[inst] = offset;
-    offset += inst->getDefinition().getSimInfo().getNumStateBytes();
+    offset += inst_info.getNumStateBytes();
+    state_align = max(state_align, align);
   }
 
-  num_state_bytes = offset;
+  /* Round up so the state of an array of instances stays aligned */
+  num_state_bytes = (offset + state_align - 1) / state_align * state_align;
+}
+
+/* A range covering the end of an instance's state also covers the padding
+ * up to the next instance, so runs of registers with different alignments
+ * still merge */
+void SimInfo::calculateCommitRanges()
+{
+  for (unsigned i = 0; i < stateful_insts.size(); i++) {
+    const Instance *inst = stateful_insts[i];
+    const SimInfo &inst_info = inst->getDefinition().getSimInfo();
+    unsigned offset = offset_map[inst];
+    unsigned end = i + 1 < stateful_insts.size() ? offset_map[stateful_insts[i + 1]] : num_state_bytes;
+
+    for (const StateRange &range : inst_info.getCommitRanges()) {
+      unsigned range_start = offset + range.offset;
+      unsigned range_end = range.offset + range.bytes == inst_info.getNumStateBytes() ? end : range_start + range.bytes;
+
+      if (!commit_ranges.empty() && commit_ranges.back().offset + commit_ranges.back().bytes == range_start) {
+        commit_ranges.back().bytes += range_end - range_start;
+      } else {
+        commit_ranges.push_back({ range_start, range_end - range_start });
+      }
+    }
+  }
 }
 
 void SimInfo::calculateInstanceNumbers(const vector<Instance> &instances)
@@ -185,22 +347,32 @@ SimInfo::SimInfo(const IFace &defn_iface, const vector<Instance> &instances)
   : stateful_insts(filterStatefulInstances(instances)),
     state_deps(),
     output_deps(),
+    step_deps(),
     state_deps_lookup(),
     output_deps_lookup(),
     offset_map(),
+    demanding_sinks(),
+    input_deps(),
+    sink_input_deps(),
+    state_bit(defn_iface.getSources().size()),
     primitive(),
     is_stateful(stateful_insts.size() > 0),
     num_state_bytes(0),
+    state_align(1),
+    commit_ranges(),
     state_dep_srcs(),
     output_dep_srcs()
 {
   if (is_stateful) {
     analyzeStateDeps(defn_iface);
     calculateStateOffsets();
+    calculateCommitRanges();
   }
   calculateInstanceNumbers(instances);
 
   analyzeOutputDeps(defn_iface);
+  analyzeCones(defn_iface);
+  analyzeStepDeps();
 
   for (const Instance *inst : output_deps) {
     output_deps_lookup.insert(inst);
@@ -215,14 +387,25 @@ SimInfo::SimInfo(const IFace &defn_iface, const Primitive &primitive_)
   : stateful_insts(),
     state_deps(),
     output_deps(),
+    step_deps(),
     state_deps_lookup(),
     output_deps_lookup(),
+    demanding_sinks(),
+    input_deps(),
+    sink_input_deps(),
+    state_bit(defn_iface.getSources().size()),
     primitive(primitive_),
     is_stateful(primitive->is_stateful),
     num_state_bytes(primitive->num_state_bytes),
+    state_align(getAlignForBytes(primitive->num_state_bytes)),
+    commit_ranges(),
     state_dep_srcs(),
     output_dep_srcs()
 {
+  if (primitive->overwrites_state && num_state_bytes > 0) {
+    commit_ranges.push_back({ 0, num_state_bytes });
+  }
+
   if (is_stateful) {
     for (const Source &src : defn_iface.getSources()) {
       if (primitive->state_deps.count(src.getName()) > 0) {
@@ -248,6 +431,12 @@ vector<uint8_t> SimInfo::allocateState() const
 void SimInfo::print(const string &prefix) const
 {
   cout << prefix << "Bytes for state: " << num_state_bytes << endl;
+  cout << prefix << "State alignment: " << state_align << endl;
+  cout << prefix << "Committed state:";
+  for (const StateRange &range : commit_ranges) {
+    cout << " [" << range.offset << ", " << range.offset + range.bytes << ")";
+  }
+  cout << endl;
   cout << prefix << "Stateful instances:\n";
   for (const Instance *inst : stateful_insts) {
     cout << prefix << "  " << inst->getName() << endl;
@@ -263,6 +452,11 @@ void SimInfo::print(const string &prefix) const
     cout << prefix << "  " << inst->getName() << endl;
   }
 
+  cout << prefix << "Step dependencies:\n";
+  for (const Instance *inst : step_deps) {
+    cout << prefix << "  " << inst->getName() << endl;
+  }
+
   cout << prefix << "Inputs for compute_outputs:\n";
   for (const Source *src : output_dep_srcs) {
     cout << prefix << "  self." << src->getName() << endl;
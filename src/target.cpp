@@ -0,0 +1,54 @@
+#include <jitsim/target.hpp>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/Support/Host.h>
+
+#include <algorithm>
+
+namespace JITSim {
+
+using namespace llvm;
+
+CPUTarget GetHostCPUTarget()
+{
+  CPUTarget target;
+  target.cpu = sys::getHostCPUName();
+
+  /* Detection can fail (e.g. on some non x86 hosts), fall back to the
+   * CPU's default features */
+  StringMap<bool> host_features;
+  if (sys::getHostCPUFeatures(host_features)) {
+    for (const auto &feature : host_features) {
+      target.features.push_back((feature.second ? "+" : "-") + feature.first().str());
+    }
+  }
+
+  /* StringMap order isn't stable, and the features end up in cache keys */
+  std::sort(target.features.begin(), target.features.end());
+
+  return target;
+}
+
+CPUTarget GetCPUTarget(const std::string &cpu)
+{
+  if (cpu == "host") {
+    return GetHostCPUTarget();
+  }
+
+  CPUTarget target;
+  target.cpu = cpu;
+
+  return target;
+}
+
+TargetMachine * SelectTarget(const CPUTarget &target, CodeGenOpt::Level opt_level)
+{
+  return EngineBuilder()
+    .setMCPU(target.cpu)
+    .setMAttrs(target.features)
+    .setOptLevel(opt_level)
+    .selectTarget();
+}
+
+}
@@ -0,0 +1,174 @@
+#include <jitsim/tiered.hpp>
+#include <jitsim/circuit_llvm.hpp>
+
+#include <llvm/IR/IRBuilder.h>
+
+namespace JITSim {
+
+using namespace llvm;
+
+/* Checking every counter each cycle would cost more than it saves */
+static const unsigned CHECK_INTERVAL = 1024;
+
+static OptimizationOptions getDefaultTierUpOptions()
+{
+  OptimizationOptions optimization;
+  optimization.opt_level = 3;
+
+  return optimization;
+}
+
+TierManager::TierManager(JIT &jit_, const DataLayout &data_layout_, const CPUTarget &cpu_target_,
+                         const CodegenOptions &codegen_options_, const Circuit &circuit, uint64_t threshold_)
+  : jit(jit_),
+    data_layout(data_layout_),
+    cpu_target(cpu_target_),
+    codegen_options(codegen_options_),
+    threshold(threshold_),
+    call_counts(),
+    promoted(),
+    tier_up_optimizations(),
+    cycles_since_check(0),
+    queue(),
+    finished(),
+    has_finished(false),
+    stopping(false),
+    lock(),
+    queue_cv(),
+    worker()
+{
+  for (const Definition &defn : circuit.getDefinitions()) {
+    if (!defn.getSimInfo().isPrimitive()) {
+      call_counts[&defn] = 0;
+    }
+  }
+
+  worker = std::thread([this]() { workerLoop(); });
+}
+
+TierManager::~TierManager()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  queue_cv.notify_one();
+  worker.join();
+}
+
+void TierManager::addCallCounter(Module &module, const std::string &fn_name, const Definition &defn)
+{
+  Function *fn = module.getFunction(fn_name);
+  assert(fn && "Can't find function to count calls to");
+
+  uint64_t *counter = &call_counts.find(&defn)->second;
+
+  BasicBlock &entry = fn->getEntryBlock();
+  IRBuilder<> ir_builder(&entry, entry.getFirstInsertionPt());
+  Type *count_type = Type::getInt64Ty(module.getContext());
+
+  Value *addr = Constant::getIntegerValue(count_type->getPointerTo(), APInt(64, (uint64_t)counter));
+  Value *count = ir_builder.CreateLoad(addr, "call_count");
+  count = ir_builder.CreateAdd(count, ConstantInt::get(count_type, 1));
+  ir_builder.CreateStore(count, addr);
+}
+
+void TierManager::setTierUpOptions(const Definition &defn, const OptimizationOptions &optimization)
+{
+  tier_up_optimizations[&defn] = optimization;
+}
+
+void TierManager::workerLoop()
+{
+  std::unique_ptr<TargetMachine> target_machine(SelectTarget(cpu_target, CodeGenOpt::Aggressive));
+  Builder tier_builder(data_layout, *target_machine, codegen_options);
+
+  while (true) {
+    TierJob job;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      queue_cv.wait(guard, [this]() { return stopping || !queue.empty(); });
+      if (stopping) {
+        return;
+      }
+      job = queue.front();
+      queue.pop_front();
+    }
+
+    /* Recompiled code doesn't count calls, so it can be cached */
+    std::string cache_key = GetCacheKey(*job.defn, codegen_options, !jit.getCodeLayout().empty(), false);
+
+    auto obj = jit.compileObject(job.name, job.optimization, *target_machine, [&tier_builder, &job]() {
+      return job.make_module(tier_builder, *job.defn).getModule();
+    }, cache_key);
+
+    std::lock_guard<std::mutex> guard(lock);
+    finished.emplace_back(job.name, std::move(obj));
+    has_finished = true;
+  }
+}
+
+void TierManager::tierUp(uint64_t cycles)
+{
+  if (has_finished) {
+    std::vector<std::pair<std::string, std::unique_ptr<MemoryBuffer>>> done;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      done.swap(finished);
+      has_finished = false;
+    }
+
+    for (auto &obj : done) {
+      jit.addCompiledFunction(obj.first, std::move(obj.second));
+    }
+  }
+
+  cycles_since_check += cycles;
+  if (cycles_since_check < CHECK_INTERVAL) {
+    return;
+  }
+  cycles_since_check = 0;
+
+  std::vector<TierJob> jobs;
+  for (const auto &count : call_counts) {
+    const Definition *defn = count.first;
+    if (count.second < threshold || promoted.count(defn)) {
+      continue;
+    }
+
+    promoted.insert(defn);
+
+    OptimizationOptions optimization = getDefaultTierUpOptions();
+    auto override_iter = tier_up_optimizations.find(defn);
+    if (override_iter != tier_up_optimizations.end()) {
+      optimization = override_iter->second;
+    }
+
+    jobs.push_back({ defn->getSafeName() + "_update_state", MakeUpdateState, defn, optimization });
+    jobs.push_back({ defn->getSafeName() + "_compute_output", MakeComputeOutput, defn, optimization });
+
+    /* The chunks of a split definition are what's actually hot */
+    for (bool update_state : { false, true }) {
+      unsigned num_chunks = GetNumChunks(*defn, update_state, codegen_options.chunk_size);
+      for (unsigned i = 0; i < num_chunks; i++) {
+        jobs.push_back({ GetChunkName(*defn, update_state, i),
+                         [update_state, i](Builder &builder, const Definition &chunk_defn) {
+                           return MakeChunk(builder, chunk_defn, update_state, i);
+                         },
+                         defn, optimization });
+      }
+    }
+  }
+
+  if (jobs.empty()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    queue.insert(queue.end(), jobs.begin(), jobs.end());
+  }
+  queue_cv.notify_one();
+}
+
+}
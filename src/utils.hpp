@@ -13,6 +13,26 @@ namespace JITSim {
       return bits / 8 + 1;
     }
   }
+
+  /* Alignment of a block of state, matching what LLVM assumes for a load
+   * of an integer that size, capped at 8 */
+  inline unsigned getAlignForBytes(unsigned bytes) {
+    unsigned align = 1;
+    while (align < bytes && align < 8) {
+      align *= 2;
+    }
+    return align;
+  }
+
+  /* Stride between the elements of a memory of bits wide words, which is
+   * the alloc size of an iN on x86-64 */
+  inline unsigned getMemElementBytes(int bits) {
+    unsigned bytes = getNumBytes(bits);
+    if (bytes <= 8) {
+      return getAlignForBytes(bytes);
+    }
+    return (bytes + 7) / 8 * 8;
+  }
 }
 
 #endif
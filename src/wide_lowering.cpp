@@ -0,0 +1,446 @@
+#include "wide_lowering.hpp"
+#include "width_promotion.hpp"
+
+#include <vector>
+
+namespace JITSim {
+
+using namespace std;
+using namespace llvm;
+
+static const unsigned LIMB_BITS = 64;
+
+/* Wide lanes are left to LLVM, which splits them up per lane */
+static bool useLimbs(FunctionEnvironment &env, Value *val)
+{
+  return env.getModule().getCodegenOptions().wide_limbs && !val->getType()->isVectorTy() &&
+         val->getType()->getIntegerBitWidth() > LIMB_BITS;
+}
+
+static Type * getLimbType(FunctionEnvironment &env)
+{
+  return Type::getInt64Ty(env.getContext());
+}
+
+/* Odd widths up to 64 bits are computed at the next native width */
+static Value * lowerPromotedBinOp(FunctionEnvironment &env, Instruction::BinaryOps op, Value *lhs, Extension lhs_ext,
+                                  Value *rhs, Extension rhs_ext, const Twine &name)
+{
+  Value *result = env.getIRBuilder().CreateBinOp(op, PromoteOperand(env, lhs, lhs_ext),
+                                                 PromoteOperand(env, rhs, rhs_ext));
+  return DemoteResult(env, result, lhs->getType(), name);
+}
+
+/* Limbs are least significant first. When the width isn't a multiple of
+ * 64 the top limb is zero or sign extended, and the extra bits are dropped
+ * again by joinLimbs. */
+static vector<Value *> splitLimbs(FunctionEnvironment &env, Value *val, bool is_signed = false)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  unsigned num_limbs = (val->getType()->getIntegerBitWidth() + LIMB_BITS - 1) / LIMB_BITS;
+
+  Type *padded_type = Type::getIntNTy(env.getContext(), num_limbs * LIMB_BITS);
+  Value *padded = is_signed ? ir_builder.CreateSExt(val, padded_type) : ir_builder.CreateZExt(val, padded_type);
+
+  vector<Value *> limbs;
+  for (unsigned i = 0; i < num_limbs; i++) {
+    Value *limb = padded;
+    if (i > 0) {
+      limb = ir_builder.CreateLShr(limb, i * LIMB_BITS);
+    }
+    limbs.push_back(ir_builder.CreateTrunc(limb, getLimbType(env)));
+  }
+
+  return limbs;
+}
+
+static Value * joinLimbs(FunctionEnvironment &env, const vector<Value *> &limbs, Type *type, const Twine &name)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Type *padded_type = Type::getIntNTy(env.getContext(), limbs.size() * LIMB_BITS);
+
+  Value *result = nullptr;
+  for (unsigned i = 0; i < limbs.size(); i++) {
+    Value *part = ir_builder.CreateZExt(limbs[i], padded_type);
+    if (i > 0) {
+      part = ir_builder.CreateShl(part, i * LIMB_BITS);
+    }
+    result = result ? ir_builder.CreateOr(result, part) : part;
+  }
+
+  return ir_builder.CreateTrunc(result, type, name);
+}
+
+/* Each step adds in i128, which the backend turns into an add/adc pair,
+ * and the top half is the carry into the next limb */
+static vector<Value *> addLimbs(FunctionEnvironment &env, const vector<Value *> &lhs, const vector<Value *> &rhs,
+                                Value *carry)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Type *i128 = Type::getInt128Ty(env.getContext());
+
+  vector<Value *> sum;
+  for (unsigned i = 0; i < lhs.size(); i++) {
+    Value *wide_sum = ir_builder.CreateAdd(ir_builder.CreateZExt(lhs[i], i128), ir_builder.CreateZExt(rhs[i], i128));
+    wide_sum = ir_builder.CreateAdd(wide_sum, ir_builder.CreateZExt(carry, i128));
+
+    sum.push_back(ir_builder.CreateTrunc(wide_sum, getLimbType(env)));
+    carry = ir_builder.CreateTrunc(ir_builder.CreateLShr(wide_sum, LIMB_BITS), getLimbType(env));
+  }
+
+  return sum;
+}
+
+Value * LowerAdd(FunctionEnvironment &env, Value *lhs, Value *rhs, const Twine &name)
+{
+  if (UsePromotion(env, lhs)) {
+    return lowerPromotedBinOp(env, Instruction::Add, lhs, Extension::Any, rhs, Extension::Any, name);
+  } else if (!useLimbs(env, lhs)) {
+    return env.getIRBuilder().CreateAdd(lhs, rhs, name);
+  }
+
+  vector<Value *> sum = addLimbs(env, splitLimbs(env, lhs), splitLimbs(env, rhs),
+                                 ConstantInt::get(getLimbType(env), 0));
+  return joinLimbs(env, sum, lhs->getType(), name);
+}
+
+/* lhs - rhs is lhs + ~rhs + 1 */
+Value * LowerSub(FunctionEnvironment &env, Value *lhs, Value *rhs, const Twine &name)
+{
+  if (UsePromotion(env, lhs)) {
+    return lowerPromotedBinOp(env, Instruction::Sub, lhs, Extension::Any, rhs, Extension::Any, name);
+  } else if (!useLimbs(env, lhs)) {
+    return env.getIRBuilder().CreateSub(lhs, rhs, name);
+  }
+
+  vector<Value *> rhs_limbs = splitLimbs(env, rhs);
+  for (Value *&limb : rhs_limbs) {
+    limb = env.getIRBuilder().CreateNot(limb);
+  }
+
+  vector<Value *> diff = addLimbs(env, splitLimbs(env, lhs), rhs_limbs, ConstantInt::get(getLimbType(env), 1));
+  return joinLimbs(env, diff, lhs->getType(), name);
+}
+
+/* Schoolbook multiplication keeping only the low limbs. Each step is a
+ * 64x64->128 multiply plus two limbs, which can't overflow 128 bits. */
+Value * LowerMul(FunctionEnvironment &env, Value *lhs, Value *rhs, const Twine &name)
+{
+  if (UsePromotion(env, lhs)) {
+    return lowerPromotedBinOp(env, Instruction::Mul, lhs, Extension::Any, rhs, Extension::Any, name);
+  } else if (!useLimbs(env, lhs)) {
+    return env.getIRBuilder().CreateMul(lhs, rhs, name);
+  }
+
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Type *i128 = Type::getInt128Ty(env.getContext());
+
+  vector<Value *> lhs_limbs = splitLimbs(env, lhs);
+  vector<Value *> rhs_limbs = splitLimbs(env, rhs);
+  unsigned num_limbs = lhs_limbs.size();
+
+  vector<Value *> prod(num_limbs, ConstantInt::get(getLimbType(env), 0));
+  for (unsigned i = 0; i < num_limbs; i++) {
+    Value *carry = ConstantInt::get(getLimbType(env), 0);
+    for (unsigned j = 0; i + j < num_limbs; j++) {
+      Value *step = ir_builder.CreateMul(ir_builder.CreateZExt(lhs_limbs[i], i128),
+                                         ir_builder.CreateZExt(rhs_limbs[j], i128));
+      step = ir_builder.CreateAdd(step, ir_builder.CreateZExt(prod[i + j], i128));
+      step = ir_builder.CreateAdd(step, ir_builder.CreateZExt(carry, i128));
+
+      prod[i + j] = ir_builder.CreateTrunc(step, getLimbType(env));
+      carry = ir_builder.CreateTrunc(ir_builder.CreateLShr(step, LIMB_BITS), getLimbType(env));
+    }
+  }
+
+  return joinLimbs(env, prod, lhs->getType(), name);
+}
+
+/* Bitwise operations are independent per limb, so with --vectorize the
+ * SLP vectorizer can put neighbouring limbs in one SIMD register */
+static Value * lowerBitwise(FunctionEnvironment &env, Instruction::BinaryOps op, Value *lhs, Value *rhs,
+                            const Twine &name)
+{
+  if (UsePromotion(env, lhs)) {
+    return lowerPromotedBinOp(env, op, lhs, Extension::Any, rhs, Extension::Any, name);
+  } else if (!useLimbs(env, lhs)) {
+    return env.getIRBuilder().CreateBinOp(op, lhs, rhs, name);
+  }
+
+  vector<Value *> lhs_limbs = splitLimbs(env, lhs);
+  vector<Value *> rhs_limbs = splitLimbs(env, rhs);
+  vector<Value *> result;
+  for (unsigned i = 0; i < lhs_limbs.size(); i++) {
+    result.push_back(env.getIRBuilder().CreateBinOp(op, lhs_limbs[i], rhs_limbs[i]));
+  }
+
+  return joinLimbs(env, result, lhs->getType(), name);
+}
+
+Value * LowerAnd(FunctionEnvironment &env, Value *lhs, Value *rhs, const Twine &name)
+{
+  return lowerBitwise(env, Instruction::And, lhs, rhs, name);
+}
+
+Value * LowerOr(FunctionEnvironment &env, Value *lhs, Value *rhs, const Twine &name)
+{
+  return lowerBitwise(env, Instruction::Or, lhs, rhs, name);
+}
+
+Value * LowerXor(FunctionEnvironment &env, Value *lhs, Value *rhs, const Twine &name)
+{
+  return lowerBitwise(env, Instruction::Xor, lhs, rhs, name);
+}
+
+Value * LowerNot(FunctionEnvironment &env, Value *value, const Twine &name)
+{
+  return lowerBitwise(env, Instruction::Xor, value, Constant::getAllOnesValue(value->getType()), name);
+}
+
+enum class ShiftKind { Left, LogicalRight, ArithmeticRight };
+
+/* Low bits of a left shift only depend on low bits, but a right shift
+ * pulls the upper bits down. Amounts are always compared in full. */
+static Value * lowerPromotedShift(FunctionEnvironment &env, ShiftKind kind, Value *value, Value *amount,
+                                  const Twine &name)
+{
+  switch (kind) {
+    case ShiftKind::Left:
+      return lowerPromotedBinOp(env, Instruction::Shl, value, Extension::Any, amount, Extension::Zero, name);
+    case ShiftKind::LogicalRight:
+      return lowerPromotedBinOp(env, Instruction::LShr, value, Extension::Zero, amount, Extension::Zero, name);
+    case ShiftKind::ArithmeticRight:
+      return lowerPromotedBinOp(env, Instruction::AShr, value, Extension::Sign, amount, Extension::Zero, name);
+  }
+
+  return nullptr;
+}
+
+static Value * createNarrowShift(FunctionEnvironment &env, ShiftKind kind, Value *value, Value *amount,
+                                 const Twine &name)
+{
+  switch (kind) {
+    case ShiftKind::Left:
+      return env.getIRBuilder().CreateShl(value, amount, name);
+    case ShiftKind::LogicalRight:
+      return env.getIRBuilder().CreateLShr(value, amount, name);
+    case ShiftKind::ArithmeticRight:
+      return env.getIRBuilder().CreateAShr(value, amount, name);
+  }
+
+  return nullptr;
+}
+
+/* Shifting by a constant only moves whole limbs around and merges each
+ * pair of neighbouring limbs */
+static vector<Value *> shiftLimbsConstant(FunctionEnvironment &env, ShiftKind kind, const vector<Value *> &limbs,
+                                          Value *fill, uint64_t amount)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  int num_limbs = limbs.size();
+  int limb_shift = amount / LIMB_BITS;
+  unsigned bit_shift = amount % LIMB_BITS;
+
+  auto get_limb = [&](int idx) -> Value * {
+    if (idx < 0) {
+      return ConstantInt::get(getLimbType(env), 0);
+    } else if (idx >= num_limbs) {
+      return fill;
+    }
+    return limbs[idx];
+  };
+
+  vector<Value *> result;
+  for (int i = 0; i < num_limbs; i++) {
+    if (kind == ShiftKind::Left) {
+      Value *hi = get_limb(i - limb_shift);
+      if (bit_shift == 0) {
+        result.push_back(hi);
+      } else {
+        Value *lo = get_limb(i - limb_shift - 1);
+        result.push_back(ir_builder.CreateOr(ir_builder.CreateShl(hi, bit_shift),
+                                             ir_builder.CreateLShr(lo, LIMB_BITS - bit_shift)));
+      }
+    } else {
+      Value *lo = get_limb(i + limb_shift);
+      if (bit_shift == 0) {
+        result.push_back(lo);
+      } else {
+        Value *hi = get_limb(i + limb_shift + 1);
+        result.push_back(ir_builder.CreateOr(ir_builder.CreateLShr(lo, bit_shift),
+                                             ir_builder.CreateShl(hi, LIMB_BITS - bit_shift)));
+      }
+    }
+  }
+
+  return result;
+}
+
+/* Shifting by a variable amount writes the limbs next to a run of fill
+ * limbs in a stack buffer and reads each result limb's two source limbs
+ * back at an offset. The shifts by 1 then by 63 - bit_shift keep a
+ * bit_shift of 0 from shifting by the full limb width. */
+static vector<Value *> shiftLimbsVariable(FunctionEnvironment &env, ShiftKind kind, const vector<Value *> &limbs,
+                                          Value *fill, Value *amount, Value *in_range)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  Type *limb_type = getLimbType(env);
+  unsigned num_limbs = limbs.size();
+
+  BasicBlock &entry = env.getFunction()->getEntryBlock();
+  IRBuilder<> entry_builder(&entry, entry.begin());
+  AllocaInst *buffer = entry_builder.CreateAlloca(limb_type, ConstantInt::get(limb_type, 2 * num_limbs),
+                                                  "shift_buf");
+  buffer->setAlignment(8);
+
+  bool left = kind == ShiftKind::Left;
+  Value *zero = ConstantInt::get(limb_type, 0);
+  for (unsigned i = 0; i < num_limbs; i++) {
+    Value *low_half = left ? zero : limbs[i];
+    Value *high_half = left ? limbs[i] : fill;
+    ir_builder.CreateAlignedStore(low_half, ir_builder.CreateConstInBoundsGEP1_64(buffer, i), 8);
+    ir_builder.CreateAlignedStore(high_half, ir_builder.CreateConstInBoundsGEP1_64(buffer, num_limbs + i), 8);
+  }
+
+  /* Keep the reads inside the buffer when the result is all fill anyway */
+  Value *amount64 = ir_builder.CreateZExtOrTrunc(amount, limb_type);
+  Value *limb_shift = ir_builder.CreateSelect(in_range, ir_builder.CreateLShr(amount64, 6), zero);
+  Value *bit_shift = ir_builder.CreateAnd(amount64, LIMB_BITS - 1);
+  Value *inv_shift = ir_builder.CreateXor(bit_shift, LIMB_BITS - 1);
+
+  vector<Value *> result;
+  for (unsigned i = 0; i < num_limbs; i++) {
+    Value *near_idx;
+    Value *far_idx;
+    if (left) {
+      near_idx = ir_builder.CreateSub(ConstantInt::get(limb_type, num_limbs + i), limb_shift);
+      far_idx = ir_builder.CreateSub(near_idx, ConstantInt::get(limb_type, 1));
+    } else {
+      near_idx = ir_builder.CreateAdd(ConstantInt::get(limb_type, i), limb_shift);
+      far_idx = ir_builder.CreateAdd(near_idx, ConstantInt::get(limb_type, 1));
+    }
+
+    Value *near = ir_builder.CreateAlignedLoad(ir_builder.CreateInBoundsGEP(buffer, near_idx), 8);
+    Value *far = ir_builder.CreateAlignedLoad(ir_builder.CreateInBoundsGEP(buffer, far_idx), 8);
+
+    Value *limb;
+    if (left) {
+      Value *carried = ir_builder.CreateLShr(ir_builder.CreateLShr(far, 1), inv_shift);
+      limb = ir_builder.CreateOr(ir_builder.CreateShl(near, bit_shift), carried);
+    } else {
+      Value *carried = ir_builder.CreateShl(ir_builder.CreateShl(far, 1), inv_shift);
+      limb = ir_builder.CreateOr(ir_builder.CreateLShr(near, bit_shift), carried);
+    }
+    result.push_back(ir_builder.CreateSelect(in_range, limb, left ? zero : fill));
+  }
+
+  return result;
+}
+
+static Value * lowerShift(FunctionEnvironment &env, ShiftKind kind, Value *value, Value *amount, const Twine &name)
+{
+  if (UsePromotion(env, value)) {
+    return lowerPromotedShift(env, kind, value, amount, name);
+  } else if (!useLimbs(env, value)) {
+    return createNarrowShift(env, kind, value, amount, name);
+  }
+
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  unsigned width = value->getType()->getIntegerBitWidth();
+
+  bool is_signed = kind == ShiftKind::ArithmeticRight;
+  vector<Value *> limbs = splitLimbs(env, value, is_signed);
+  Value *fill = is_signed ? ir_builder.CreateAShr(limbs.back(), LIMB_BITS - 1) : ConstantInt::get(getLimbType(env), 0);
+
+  vector<Value *> result;
+  if (auto *const_amount = dyn_cast<ConstantInt>(amount)) {
+    uint64_t shift = const_amount->getValue().getLimitedValue(width);
+    result = shiftLimbsConstant(env, kind, limbs, fill, shift);
+  } else {
+    Value *in_range = ir_builder.CreateICmpULT(amount, ConstantInt::get(amount->getType(), width));
+    result = shiftLimbsVariable(env, kind, limbs, fill, amount, in_range);
+  }
+
+  return joinLimbs(env, result, value->getType(), name);
+}
+
+Value * LowerShl(FunctionEnvironment &env, Value *value, Value *amount, const Twine &name)
+{
+  return lowerShift(env, ShiftKind::Left, value, amount, name);
+}
+
+Value * LowerLShr(FunctionEnvironment &env, Value *value, Value *amount, const Twine &name)
+{
+  return lowerShift(env, ShiftKind::LogicalRight, value, amount, name);
+}
+
+Value * LowerAShr(FunctionEnvironment &env, Value *value, Value *amount, const Twine &name)
+{
+  return lowerShift(env, ShiftKind::ArithmeticRight, value, amount, name);
+}
+
+/* Compares limbs from the bottom up, so each more significant limb
+ * overrides the result unless it is equal. Only the top limb carries the
+ * sign. */
+static Value * lowerLessThan(FunctionEnvironment &env, bool is_signed, Value *lhs, Value *rhs)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  vector<Value *> lhs_limbs = splitLimbs(env, lhs, is_signed);
+  vector<Value *> rhs_limbs = splitLimbs(env, rhs, is_signed);
+
+  Value *less = ConstantInt::getFalse(env.getContext());
+  for (unsigned i = 0; i < lhs_limbs.size(); i++) {
+    bool top = i + 1 == lhs_limbs.size();
+    Value *limb_less = top && is_signed ? ir_builder.CreateICmpSLT(lhs_limbs[i], rhs_limbs[i])
+                                        : ir_builder.CreateICmpULT(lhs_limbs[i], rhs_limbs[i]);
+    Value *limb_eq = ir_builder.CreateICmpEQ(lhs_limbs[i], rhs_limbs[i]);
+    less = ir_builder.CreateSelect(limb_eq, less, limb_less);
+  }
+
+  return less;
+}
+
+Value * LowerICmp(FunctionEnvironment &env, CmpInst::Predicate pred, Value *lhs, Value *rhs, const Twine &name)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  if (UsePromotion(env, lhs)) {
+    Extension ext = CmpInst::isSigned(pred) ? Extension::Sign : Extension::Zero;
+    return ir_builder.CreateICmp(pred, PromoteOperand(env, lhs, ext), PromoteOperand(env, rhs, ext), name);
+  } else if (!useLimbs(env, lhs)) {
+    return ir_builder.CreateICmp(pred, lhs, rhs, name);
+  }
+
+  if (pred == CmpInst::ICMP_EQ || pred == CmpInst::ICMP_NE) {
+    vector<Value *> lhs_limbs = splitLimbs(env, lhs);
+    vector<Value *> rhs_limbs = splitLimbs(env, rhs);
+
+    Value *diff = nullptr;
+    for (unsigned i = 0; i < lhs_limbs.size(); i++) {
+      Value *limb_diff = ir_builder.CreateXor(lhs_limbs[i], rhs_limbs[i]);
+      diff = diff ? ir_builder.CreateOr(diff, limb_diff) : limb_diff;
+    }
+
+    return ir_builder.CreateICmp(pred, diff, ConstantInt::get(getLimbType(env), 0), name);
+  }
+
+  bool is_signed = CmpInst::isSigned(pred);
+  switch (pred) {
+    case CmpInst::ICMP_ULT:
+    case CmpInst::ICMP_SLT:
+      return lowerLessThan(env, is_signed, lhs, rhs);
+    case CmpInst::ICMP_UGT:
+    case CmpInst::ICMP_SGT:
+      return lowerLessThan(env, is_signed, rhs, lhs);
+    case CmpInst::ICMP_UGE:
+    case CmpInst::ICMP_SGE:
+      return ir_builder.CreateNot(lowerLessThan(env, is_signed, lhs, rhs), name);
+    case CmpInst::ICMP_ULE:
+    case CmpInst::ICMP_SLE:
+      return ir_builder.CreateNot(lowerLessThan(env, is_signed, rhs, lhs), name);
+    default:
+      assert(false);
+      return nullptr;
+  }
+}
+
+}
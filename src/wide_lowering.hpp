@@ -0,0 +1,34 @@
+#ifndef JITSIM_WIDE_LOWERING_HPP_INCLUDED
+#define JITSIM_WIDE_LOWERING_HPP_INCLUDED
+
+#include <jitsim/builder.hpp>
+
+namespace JITSim {
+  /* Arithmetic on values wider than 64 bits, lowered onto 64 bit limbs
+   * with explicit carry chains instead of LLVM's generic wide integer
+   * legalization (see CodegenOptions::wide_limbs). Odd widths up to 64
+   * bits are computed at the next native width (see width_promotion.hpp),
+   * and anything else gets the plain iN instruction, so the primitive
+   * builders can call these unconditionally. Lanes of a batch are
+   * always computed with the plain vector instruction.
+   *
+   * Shifts by at least the width give 0 (or the sign for AShr) on the
+   * limb path, where plain iN shifts would be poison. */
+  llvm::Value * LowerAdd(FunctionEnvironment &env, llvm::Value *lhs, llvm::Value *rhs, const llvm::Twine &name);
+  llvm::Value * LowerSub(FunctionEnvironment &env, llvm::Value *lhs, llvm::Value *rhs, const llvm::Twine &name);
+  llvm::Value * LowerMul(FunctionEnvironment &env, llvm::Value *lhs, llvm::Value *rhs, const llvm::Twine &name);
+
+  llvm::Value * LowerAnd(FunctionEnvironment &env, llvm::Value *lhs, llvm::Value *rhs, const llvm::Twine &name);
+  llvm::Value * LowerOr(FunctionEnvironment &env, llvm::Value *lhs, llvm::Value *rhs, const llvm::Twine &name);
+  llvm::Value * LowerXor(FunctionEnvironment &env, llvm::Value *lhs, llvm::Value *rhs, const llvm::Twine &name);
+  llvm::Value * LowerNot(FunctionEnvironment &env, llvm::Value *value, const llvm::Twine &name);
+
+  llvm::Value * LowerShl(FunctionEnvironment &env, llvm::Value *value, llvm::Value *amount, const llvm::Twine &name);
+  llvm::Value * LowerLShr(FunctionEnvironment &env, llvm::Value *value, llvm::Value *amount, const llvm::Twine &name);
+  llvm::Value * LowerAShr(FunctionEnvironment &env, llvm::Value *value, llvm::Value *amount, const llvm::Twine &name);
+
+  llvm::Value * LowerICmp(FunctionEnvironment &env, llvm::CmpInst::Predicate pred,
+                          llvm::Value *lhs, llvm::Value *rhs, const llvm::Twine &name);
+}
+
+#endif
@@ -0,0 +1,74 @@
+#include "width_promotion.hpp"
+
+#include <llvm/Analysis/ValueTracking.h>
+
+namespace JITSim {
+
+using namespace llvm;
+
+unsigned GetPromotedWidth(unsigned width)
+{
+  if (width <= 1 || width > 64) {
+    return width;
+  }
+
+  unsigned promoted = 8;
+  while (promoted < width) {
+    promoted *= 2;
+  }
+
+  return promoted;
+}
+
+bool UsePromotion(FunctionEnvironment &env, Value *val)
+{
+  /* Vector elements are already widened by type legalization */
+  if (val->getType()->isVectorTy()) {
+    return false;
+  }
+
+  unsigned width = val->getType()->getIntegerBitWidth();
+  return env.getModule().getCodegenOptions().promote_widths && GetPromotedWidth(width) != width;
+}
+
+Value * PromoteOperand(FunctionEnvironment &env, Value *val, Extension ext)
+{
+  IRBuilder<> &ir_builder = env.getIRBuilder();
+  unsigned width = val->getType()->getIntegerBitWidth();
+  unsigned promoted_width = GetPromotedWidth(width);
+  Type *promoted_type = Type::getIntNTy(env.getContext(), promoted_width);
+
+  auto *trunc = dyn_cast<TruncInst>(val);
+  if (trunc && trunc->getOperand(0)->getType() == promoted_type) {
+    Value *wide = trunc->getOperand(0);
+    const DataLayout &data_layout = env.getModule().getModule()->getDataLayout();
+
+    switch (ext) {
+      case Extension::Any:
+        return wide;
+      case Extension::Zero:
+        if (MaskedValueIsZero(wide, APInt::getHighBitsSet(promoted_width, promoted_width - width), data_layout)) {
+          return wide;
+        }
+        return ir_builder.CreateAnd(wide, APInt::getLowBitsSet(promoted_width, width));
+      case Extension::Sign:
+        if (ComputeNumSignBits(wide, data_layout) > promoted_width - width) {
+          return wide;
+        }
+        break;
+    }
+  }
+
+  if (ext == Extension::Sign) {
+    return ir_builder.CreateSExt(val, promoted_type);
+  }
+
+  return ir_builder.CreateZExt(val, promoted_type);
+}
+
+Value * DemoteResult(FunctionEnvironment &env, Value *val, Type *type, const Twine &name)
+{
+  return env.getIRBuilder().CreateTrunc(val, type, name);
+}
+
+}
@@ -0,0 +1,35 @@
+#ifndef JITSIM_WIDTH_PROMOTION_HPP_INCLUDED
+#define JITSIM_WIDTH_PROMOTION_HPP_INCLUDED
+
+#include <jitsim/builder.hpp>
+
+namespace JITSim {
+  /* What an operation needs from the bits of a promoted operand above its
+   * real width */
+  enum class Extension {
+    Any,  /* Only the low bits matter, as for add, mul or xor */
+    Zero, /* Must be zero, as for unsigned compares and lshr */
+    Sign  /* Must be copies of the sign bit, as for signed compares and ashr */
+  };
+
+  /* The next native width (8, 16, 32 or 64) up from width. Widths of 1 and
+   * above 64 are left alone. */
+  unsigned GetPromotedWidth(unsigned width);
+
+  /* Whether operations on val are computed at a wider native width (see
+   * CodegenOptions::promote_widths) */
+  bool UsePromotion(FunctionEnvironment &env, llvm::Value *val);
+
+  /* Returns val at its promoted width. A val that was itself demoted from
+   * a promoted operation is used directly, and is only masked or sign
+   * extended if ext needs it and its upper bits aren't already known to be
+   * right. */
+  llvm::Value * PromoteOperand(FunctionEnvironment &env, llvm::Value *val, Extension ext);
+
+  /* Truncates a promoted result back to type. This is the only place the
+   * result is narrowed, so values that are stored or returned get their
+   * exact width there, while promoted consumers look through it. */
+  llvm::Value * DemoteResult(FunctionEnvironment &env, llvm::Value *val, llvm::Type *type, const llvm::Twine &name);
+}
+
+#endif